@@ -0,0 +1,634 @@
+#include "imagekernels.h"
+#include <QByteArray>
+#include <cstring>
+
+#if defined(Q_PROCESSOR_X86)
+    #if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+        #define IMAGEKERNELS_SSE2
+        #include <emmintrin.h>
+    #endif
+    #if defined(IMAGEKERNELS_SSE2) && (defined(__GNUC__) || defined(__clang__) || defined(_MSC_VER))
+        #define IMAGEKERNELS_AVX2
+        #include <immintrin.h>
+        #if defined(_MSC_VER)
+            #include <intrin.h>
+            #define IMAGEKERNELS_AVX2_TARGET
+        #else
+            #define IMAGEKERNELS_AVX2_TARGET __attribute__((target("avx2")))
+        #endif
+    #endif
+#endif
+
+#if defined(Q_PROCESSOR_ARM) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+    #define IMAGEKERNELS_NEON
+    #include <arm_neon.h>
+#endif
+
+namespace
+{
+
+typedef void (*PixelKernel)(const uchar* src, uchar* dst, int pixelCount);
+typedef bool (*CompareKernel)(const uchar* a, const uchar* b, int byteCount);
+typedef void (*DownscaleKernel)(const uchar* src, int srcBytesPerLine, uchar* dst, int dstBytesPerLine, int dstWidth, int dstHeight);
+
+struct KernelTable
+{
+    ImageKernels::InstructionSet _instructionSet;
+    PixelKernel _swizzleRedBlue;
+    PixelKernel _premultiplyAlpha;
+    DownscaleKernel _downscaleByTwo;
+    CompareKernel _isRowEqual;
+};
+
+// Exact rounded division by 255 of a product of two bytes, shared by every path
+inline uint divideBy255(uint value)
+{
+    return (value + ((value + 128) >> 8) + 128) >> 8;
+}
+
+// Scalar kernels
+
+void swizzleRedBlueScalar(const uchar* src, uchar* dst, int pixelCount)
+{
+    for(int i = 0; i < pixelCount; ++i)
+    {
+        const uchar red = src[0];
+        const uchar green = src[1];
+        const uchar blue = src[2];
+        const uchar alpha = src[3];
+        dst[0] = blue;
+        dst[1] = green;
+        dst[2] = red;
+        dst[3] = alpha;
+        src += 4;
+        dst += 4;
+    }
+}
+
+void premultiplyAlphaScalar(const uchar* src, uchar* dst, int pixelCount)
+{
+    for(int i = 0; i < pixelCount; ++i)
+    {
+        const uint alpha = src[3];
+        dst[0] = static_cast<uchar>(divideBy255(src[0] * alpha));
+        dst[1] = static_cast<uchar>(divideBy255(src[1] * alpha));
+        dst[2] = static_cast<uchar>(divideBy255(src[2] * alpha));
+        dst[3] = static_cast<uchar>(alpha);
+        src += 4;
+        dst += 4;
+    }
+}
+
+bool isRowEqualScalar(const uchar* a, const uchar* b, int byteCount)
+{
+    return memcmp(a, b, static_cast<size_t>(byteCount)) == 0;
+}
+
+void downscaleRowScalar(const uchar* row0, const uchar* row1, uchar* dst, int dstWidth)
+{
+    for(int x = 0; x < dstWidth; ++x)
+    {
+        for(int c = 0; c < 4; ++c)
+            dst[c] = static_cast<uchar>((row0[c] + row0[c + 4] + row1[c] + row1[c + 4] + 2) >> 2);
+
+        row0 += 8;
+        row1 += 8;
+        dst += 4;
+    }
+}
+
+void downscaleByTwoScalar(const uchar* src, int srcBytesPerLine, uchar* dst, int dstBytesPerLine, int dstWidth, int dstHeight)
+{
+    for(int y = 0; y < dstHeight; ++y)
+    {
+        const uchar* row0 = src + (static_cast<qsizetype>(2 * y) * srcBytesPerLine);
+        downscaleRowScalar(row0, row0 + srcBytesPerLine, dst + (static_cast<qsizetype>(y) * dstBytesPerLine), dstWidth);
+    }
+}
+
+#ifdef IMAGEKERNELS_SSE2
+
+// SSE2 has no byte shuffle, so red and blue are swapped with 32 bit shifts
+void swizzleRedBlueSSE2(const uchar* src, uchar* dst, int pixelCount)
+{
+    const __m128i greenAlphaMask = _mm_set1_epi32(static_cast<int>(0xFF00FF00));
+    const __m128i redBlueMask = _mm_set1_epi32(0x00FF00FF);
+
+    int i = 0;
+    for(; i + 4 <= pixelCount; i += 4)
+    {
+        const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + (4 * i)));
+        const __m128i redBlue = _mm_and_si128(pixels, redBlueMask);
+        const __m128i swapped = _mm_or_si128(_mm_slli_epi32(redBlue, 16), _mm_srli_epi32(redBlue, 16));
+        const __m128i result = _mm_or_si128(_mm_and_si128(pixels, greenAlphaMask), swapped);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + (4 * i)), result);
+    }
+
+    swizzleRedBlueScalar(src + (4 * i), dst + (4 * i), pixelCount - i);
+}
+
+// Premultiplies the two pixels held in the 16 bit lanes of the value
+inline __m128i premultiplyPixelsSSE2(__m128i pixels)
+{
+    const __m128i alphaLanes = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+    const __m128i alphaOne = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+    const __m128i rounding = _mm_set1_epi16(128);
+
+    __m128i alpha = _mm_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3));
+    alpha = _mm_shufflehi_epi16(alpha, _MM_SHUFFLE(3, 3, 3, 3));
+    // Multiply alpha by 255 so it comes out unchanged
+    alpha = _mm_or_si128(_mm_andnot_si128(alphaLanes, alpha), alphaOne);
+
+    const __m128i product = _mm_mullo_epi16(pixels, alpha);
+    const __m128i high = _mm_srli_epi16(_mm_add_epi16(product, rounding), 8);
+    return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(product, high), rounding), 8);
+}
+
+void premultiplyAlphaSSE2(const uchar* src, uchar* dst, int pixelCount)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    int i = 0;
+    for(; i + 4 <= pixelCount; i += 4)
+    {
+        const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + (4 * i)));
+        const __m128i low = premultiplyPixelsSSE2(_mm_unpacklo_epi8(pixels, zero));
+        const __m128i high = premultiplyPixelsSSE2(_mm_unpackhi_epi8(pixels, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + (4 * i)), _mm_packus_epi16(low, high));
+    }
+
+    premultiplyAlphaScalar(src + (4 * i), dst + (4 * i), pixelCount - i);
+}
+
+void downscaleByTwoSSE2(const uchar* src, int srcBytesPerLine, uchar* dst, int dstBytesPerLine, int dstWidth, int dstHeight)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rounding = _mm_set1_epi16(2);
+
+    for(int y = 0; y < dstHeight; ++y)
+    {
+        const uchar* row0 = src + (static_cast<qsizetype>(2 * y) * srcBytesPerLine);
+        const uchar* row1 = row0 + srcBytesPerLine;
+        uchar* dstRow = dst + (static_cast<qsizetype>(y) * dstBytesPerLine);
+
+        // Four source pixels from each row make two destination pixels
+        int x = 0;
+        for(; x + 2 <= dstWidth; x += 2)
+        {
+            const __m128i top = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + (8 * x)));
+            const __m128i bottom = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + (8 * x)));
+            const __m128i low = _mm_add_epi16(_mm_unpacklo_epi8(top, zero), _mm_unpacklo_epi8(bottom, zero));
+            const __m128i high = _mm_add_epi16(_mm_unpackhi_epi8(top, zero), _mm_unpackhi_epi8(bottom, zero));
+            const __m128i lowPair = _mm_add_epi16(low, _mm_srli_si128(low, 8));
+            const __m128i highPair = _mm_add_epi16(high, _mm_srli_si128(high, 8));
+            const __m128i sum = _mm_unpacklo_epi64(lowPair, highPair);
+            const __m128i average = _mm_srli_epi16(_mm_add_epi16(sum, rounding), 2);
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(dstRow + (4 * x)), _mm_packus_epi16(average, zero));
+        }
+
+        downscaleRowScalar(row0 + (8 * x), row1 + (8 * x), dstRow + (4 * x), dstWidth - x);
+    }
+}
+
+bool isRowEqualSSE2(const uchar* a, const uchar* b, int byteCount)
+{
+    int i = 0;
+    for(; i + 16 <= byteCount; i += 16)
+    {
+        const __m128i left = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        const __m128i right = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(left, right)) != 0xFFFF)
+            return false;
+    }
+
+    return isRowEqualScalar(a + i, b + i, byteCount - i);
+}
+
+#endif // IMAGEKERNELS_SSE2
+
+#ifdef IMAGEKERNELS_AVX2
+
+IMAGEKERNELS_AVX2_TARGET void swizzleRedBlueAVX2(const uchar* src, uchar* dst, int pixelCount)
+{
+    const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                             2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+    int i = 0;
+    for(; i + 8 <= pixelCount; i += 8)
+    {
+        const __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + (4 * i)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + (4 * i)), _mm256_shuffle_epi8(pixels, shuffle));
+    }
+
+    swizzleRedBlueScalar(src + (4 * i), dst + (4 * i), pixelCount - i);
+}
+
+IMAGEKERNELS_AVX2_TARGET void premultiplyAlphaAVX2(const uchar* src, uchar* dst, int pixelCount)
+{
+    // Spread each pixel's alpha over its four 16 bit lanes, with 255 in the alpha lane itself
+    const __m256i alphaShuffle = _mm256_setr_epi8(6, -1, 6, -1, 6, -1, -1, -1, 14, -1, 14, -1, 14, -1, -1, -1,
+                                                  6, -1, 6, -1, 6, -1, -1, -1, 14, -1, 14, -1, 14, -1, -1, -1);
+    const __m256i alphaOne = _mm256_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255);
+    const __m256i rounding = _mm256_set1_epi16(128);
+    const __m256i zero = _mm256_setzero_si256();
+
+    int i = 0;
+    for(; i + 8 <= pixelCount; i += 8)
+    {
+        const __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + (4 * i)));
+        __m256i halves[2] = {_mm256_unpacklo_epi8(pixels, zero), _mm256_unpackhi_epi8(pixels, zero)};
+        for(__m256i& half : halves)
+        {
+            const __m256i alpha = _mm256_or_si256(_mm256_shuffle_epi8(half, alphaShuffle), alphaOne);
+            const __m256i product = _mm256_mullo_epi16(half, alpha);
+            const __m256i high = _mm256_srli_epi16(_mm256_add_epi16(product, rounding), 8);
+            half = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(product, high), rounding), 8);
+        }
+        // Unpack and pack both work within 128 bit lanes, so the pixel order is preserved
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + (4 * i)), _mm256_packus_epi16(halves[0], halves[1]));
+    }
+
+    premultiplyAlphaScalar(src + (4 * i), dst + (4 * i), pixelCount - i);
+}
+
+IMAGEKERNELS_AVX2_TARGET bool isRowEqualAVX2(const uchar* a, const uchar* b, int byteCount)
+{
+    int i = 0;
+    for(; i + 32 <= byteCount; i += 32)
+    {
+        const __m256i left = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        const __m256i right = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(left, right)) != -1)
+            return false;
+    }
+
+    return isRowEqualScalar(a + i, b + i, byteCount - i);
+}
+
+bool isAVX2Supported()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if(info[0] < 7)
+        return false;
+
+    // AVX2 also needs the OS to save the YMM registers
+    __cpuid(info, 1);
+    const bool osSavesRegisters = ((info[2] & (1 << 27)) != 0) && ((info[2] & (1 << 28)) != 0);
+    if((!osSavesRegisters) || ((_xgetbv(0) & 0x6) != 0x6))
+        return false;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // IMAGEKERNELS_AVX2
+
+#ifdef IMAGEKERNELS_NEON
+
+void swizzleRedBlueNEON(const uchar* src, uchar* dst, int pixelCount)
+{
+    int i = 0;
+    for(; i + 16 <= pixelCount; i += 16)
+    {
+        uint8x16x4_t pixels = vld4q_u8(src + (4 * i));
+        const uint8x16_t red = pixels.val[0];
+        pixels.val[0] = pixels.val[2];
+        pixels.val[2] = red;
+        vst4q_u8(dst + (4 * i), pixels);
+    }
+
+    swizzleRedBlueScalar(src + (4 * i), dst + (4 * i), pixelCount - i);
+}
+
+void premultiplyAlphaNEON(const uchar* src, uchar* dst, int pixelCount)
+{
+    int i = 0;
+    for(; i + 8 <= pixelCount; i += 8)
+    {
+        uint8x8x4_t pixels = vld4_u8(src + (4 * i));
+        for(int c = 0; c < 3; ++c)
+        {
+            const uint16x8_t product = vmull_u8(pixels.val[c], pixels.val[3]);
+            pixels.val[c] = vraddhn_u16(product, vrshrq_n_u16(product, 8));
+        }
+        vst4_u8(dst + (4 * i), pixels);
+    }
+
+    premultiplyAlphaScalar(src + (4 * i), dst + (4 * i), pixelCount - i);
+}
+
+void downscaleByTwoNEON(const uchar* src, int srcBytesPerLine, uchar* dst, int dstBytesPerLine, int dstWidth, int dstHeight)
+{
+    for(int y = 0; y < dstHeight; ++y)
+    {
+        const uchar* row0 = src + (static_cast<qsizetype>(2 * y) * srcBytesPerLine);
+        const uchar* row1 = row0 + srcBytesPerLine;
+        uchar* dstRow = dst + (static_cast<qsizetype>(y) * dstBytesPerLine);
+
+        int x = 0;
+        for(; x + 8 <= dstWidth; x += 8)
+        {
+            const uint8x16x4_t top = vld4q_u8(row0 + (8 * x));
+            const uint8x16x4_t bottom = vld4q_u8(row1 + (8 * x));
+            uint8x8x4_t result;
+            for(int c = 0; c < 4; ++c)
+            {
+                const uint16x8_t sum = vaddq_u16(vpaddlq_u8(top.val[c]), vpaddlq_u8(bottom.val[c]));
+                result.val[c] = vrshrn_n_u16(sum, 2);
+            }
+            vst4_u8(dstRow + (4 * x), result);
+        }
+
+        downscaleRowScalar(row0 + (8 * x), row1 + (8 * x), dstRow + (4 * x), dstWidth - x);
+    }
+}
+
+bool isRowEqualNEON(const uchar* a, const uchar* b, int byteCount)
+{
+    int i = 0;
+    for(; i + 16 <= byteCount; i += 16)
+    {
+        const uint64x2_t equal = vreinterpretq_u64_u8(vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+        if((vgetq_lane_u64(equal, 0) & vgetq_lane_u64(equal, 1)) != ~static_cast<quint64>(0))
+            return false;
+    }
+
+    return isRowEqualScalar(a + i, b + i, byteCount - i);
+}
+
+#endif // IMAGEKERNELS_NEON
+
+// Fill the table with the kernels of one instruction set, false if this build or CPU lacks it
+bool createKernelTable(ImageKernels::InstructionSet instructionSet, KernelTable& table)
+{
+    switch(instructionSet)
+    {
+        case ImageKernels::InstructionSet_Scalar:
+            table = {ImageKernels::InstructionSet_Scalar, swizzleRedBlueScalar, premultiplyAlphaScalar, downscaleByTwoScalar, isRowEqualScalar};
+            return true;
+#ifdef IMAGEKERNELS_SSE2
+        case ImageKernels::InstructionSet_SSE2:
+            table = {ImageKernels::InstructionSet_SSE2, swizzleRedBlueSSE2, premultiplyAlphaSSE2, downscaleByTwoSSE2, isRowEqualSSE2};
+            return true;
+#endif
+#ifdef IMAGEKERNELS_AVX2
+        case ImageKernels::InstructionSet_AVX2:
+            if(!isAVX2Supported())
+                return false;
+            // The downscale is bound by loads and gains nothing from the wider registers
+            table = {ImageKernels::InstructionSet_AVX2, swizzleRedBlueAVX2, premultiplyAlphaAVX2, downscaleByTwoSSE2, isRowEqualAVX2};
+            return true;
+#endif
+#ifdef IMAGEKERNELS_NEON
+        case ImageKernels::InstructionSet_NEON:
+            table = {ImageKernels::InstructionSet_NEON, swizzleRedBlueNEON, premultiplyAlphaNEON, downscaleByTwoNEON, isRowEqualNEON};
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+// The best instruction set available, tried from the widest down
+KernelTable createKernelTable()
+{
+    const ImageKernels::InstructionSet preferred[] = {ImageKernels::InstructionSet_AVX2, ImageKernels::InstructionSet_NEON,
+                                                      ImageKernels::InstructionSet_SSE2, ImageKernels::InstructionSet_Scalar};
+    KernelTable table;
+    for(ImageKernels::InstructionSet instructionSet : preferred)
+    {
+        if(createKernelTable(instructionSet, table))
+            break;
+    }
+
+    return table;
+}
+
+KernelTable& getKernelTable()
+{
+    static KernelTable table = createKernelTable();
+    return table;
+}
+
+}
+
+ImageKernels::InstructionSet ImageKernels::getInstructionSet()
+{
+    return getKernelTable()._instructionSet;
+}
+
+bool ImageKernels::isInstructionSetAvailable(InstructionSet instructionSet)
+{
+    KernelTable table;
+    return createKernelTable(instructionSet, table);
+}
+
+// Switch every kernel to one instruction set, for comparing the paths. Not thread safe, call it
+// while no kernel is running.
+bool ImageKernels::setInstructionSet(InstructionSet instructionSet)
+{
+    KernelTable table;
+    if(!createKernelTable(instructionSet, table))
+        return false;
+
+    getKernelTable() = table;
+    return true;
+}
+
+// Swap the first and third byte of every pixel, RGBA <-> BGRA
+void ImageKernels::swizzleRedBlue(const uchar* src, uchar* dst, int pixelCount)
+{
+    if((!src) || (!dst) || (pixelCount <= 0))
+        return;
+
+    getKernelTable()._swizzleRedBlue(src, dst, pixelCount);
+}
+
+// Multiply the color bytes by the alpha in the fourth byte, for RGBA and BGRA alike
+void ImageKernels::premultiplyAlpha(const uchar* src, uchar* dst, int pixelCount)
+{
+    if((!src) || (!dst) || (pixelCount <= 0))
+        return;
+
+    getKernelTable()._premultiplyAlpha(src, dst, pixelCount);
+}
+
+// Average each 2x2 block of the source into one destination pixel, the source must be at least twice the destination size
+void ImageKernels::downscaleByTwo(const uchar* src, int srcBytesPerLine, uchar* dst, int dstBytesPerLine, int dstWidth, int dstHeight)
+{
+    if((!src) || (!dst) || (dstWidth <= 0) || (dstHeight <= 0))
+        return;
+
+    getKernelTable()._downscaleByTwo(src, srcBytesPerLine, dst, dstBytesPerLine, dstWidth, dstHeight);
+}
+
+// Swap rows in place, memcpy is already vectorized by the runtime
+void ImageKernels::flipVertical(uchar* bits, int bytesPerLine, int height)
+{
+    if((!bits) || (bytesPerLine <= 0) || (height <= 1))
+        return;
+
+    QByteArray rowBuffer(bytesPerLine, Qt::Uninitialized);
+    uchar* top = bits;
+    uchar* bottom = bits + (static_cast<qsizetype>(height - 1) * bytesPerLine);
+    while(top < bottom)
+    {
+        memcpy(rowBuffer.data(), top, static_cast<size_t>(bytesPerLine));
+        memcpy(top, bottom, static_cast<size_t>(bytesPerLine));
+        memcpy(bottom, rowBuffer.constData(), static_cast<size_t>(bytesPerLine));
+        top += bytesPerLine;
+        bottom -= bytesPerLine;
+    }
+}
+
+// Compare a block of two images row by row, stopping at the first difference
+bool ImageKernels::isBlockEqual(const uchar* a, int aBytesPerLine, const uchar* b, int bBytesPerLine, int rowBytes, int rows)
+{
+    if((!a) || (!b))
+        return false;
+
+    const CompareKernel isRowEqual = getKernelTable()._isRowEqual;
+    for(int y = 0; y < rows; ++y)
+    {
+        if(!isRowEqual(a + (static_cast<qsizetype>(y) * aBytesPerLine), b + (static_cast<qsizetype>(y) * bBytesPerLine), rowBytes))
+            return false;
+    }
+
+    return true;
+}
+
+// RGBA8888 with the rows bottom up as expected by glTexImage2D, in a single pass for 32 bit images
+QImage ImageKernels::prepareForUpload(const QImage& image)
+{
+    if(image.isNull())
+        return QImage();
+
+    const int width = image.width();
+    const int height = image.height();
+
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    // (A)RGB32 is BGRA in memory, so swizzle each row straight into its flipped place
+    if((image.format() == QImage::Format_RGB32) || (image.format() == QImage::Format_ARGB32))
+    {
+        QImage result(width, height, QImage::Format_RGBA8888);
+        for(int y = 0; y < height; ++y)
+            swizzleRedBlue(image.constScanLine(y), result.scanLine(height - 1 - y), width);
+        return result;
+    }
+#endif
+
+    QImage result = image.convertToFormat(QImage::Format_RGBA8888);
+    flipVertical(result.bits(), result.bytesPerLine(), height);
+    return result;
+}
+
+// Convert a bottom up RGBA8888 readback into a top down premultiplied ARGB32 image
+QImage ImageKernels::convertReadback(const QImage& image)
+{
+    if(image.isNull())
+        return QImage();
+
+    const int width = image.width();
+    const int height = image.height();
+
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    if(image.format() == QImage::Format_RGBA8888)
+    {
+        QImage result(width, height, QImage::Format_ARGB32_Premultiplied);
+        for(int y = 0; y < height; ++y)
+        {
+            uchar* dstRow = result.scanLine(height - 1 - y);
+            swizzleRedBlue(image.constScanLine(y), dstRow, width);
+            premultiplyAlpha(dstRow, dstRow, width);
+        }
+        return result;
+    }
+#endif
+
+    return image.mirrored().convertToFormat(QImage::Format_ARGB32_Premultiplied);
+}
+
+// Half size box filtered copy, keeping the 32 bit format of the image
+QImage ImageKernels::downscaleImage(const QImage& image)
+{
+    if((image.isNull()) || (image.width() < 2) || (image.height() < 2))
+        return QImage();
+
+    QImage source = (image.depth() == 32) ? image : image.convertToFormat(QImage::Format_ARGB32);
+    QImage result(source.width() / 2, source.height() / 2, source.format());
+    downscaleByTwo(source.constBits(), source.bytesPerLine(), result.bits(), result.bytesPerLine(), result.width(), result.height());
+    return result;
+}
+
+// Compare two images of the same size and 32 bit format tile by tile. Changed tiles are merged
+// into horizontal runs, and runs of the same span in consecutive tile rows into one rectangle.
+QVector<QRect> ImageKernels::findChangedRects(const QImage& before, const QImage& after, int tileSize)
+{
+    QVector<QRect> changedRects;
+    if((before.size() != after.size()) || (before.format() != after.format()) || (before.depth() != 32) || (tileSize <= 0))
+    {
+        changedRects.append(after.rect());
+        return changedRects;
+    }
+
+    const QRect imageRect = after.rect();
+    const int tilesX = (after.width() + tileSize - 1) / tileSize;
+    const int tilesY = (after.height() + tileSize - 1) / tileSize;
+    QVector<int> previousRow;
+    QVector<int> currentRow;
+
+    for(int ty = 0; ty < tilesY; ++ty)
+    {
+        currentRow.clear();
+        int runStart = -1;
+        for(int tx = 0; tx <= tilesX; ++tx)
+        {
+            bool changed = false;
+            if(tx < tilesX)
+            {
+                const QRect tileRect = QRect(tx * tileSize, ty * tileSize, tileSize, tileSize).intersected(imageRect);
+                const qsizetype offset = (static_cast<qsizetype>(tileRect.x()) * 4);
+                changed = !isBlockEqual(before.constScanLine(tileRect.y()) + offset, before.bytesPerLine(),
+                                        after.constScanLine(tileRect.y()) + offset, after.bytesPerLine(),
+                                        tileRect.width() * 4, tileRect.height());
+            }
+
+            if((changed) && (runStart < 0))
+            {
+                runStart = tx;
+            }
+            else if((!changed) && (runStart >= 0))
+            {
+                const QRect runRect = QRect(runStart * tileSize, ty * tileSize, (tx - runStart) * tileSize, tileSize).intersected(imageRect);
+                int merged = -1;
+                for(int index : previousRow)
+                {
+                    QRect& previous = changedRects[index];
+                    if((previous.left() == runRect.left()) && (previous.width() == runRect.width()) && (previous.bottom() + 1 == runRect.top()))
+                    {
+                        previous.setBottom(runRect.bottom());
+                        merged = index;
+                        break;
+                    }
+                }
+
+                if(merged < 0)
+                {
+                    changedRects.append(runRect);
+                    merged = changedRects.count() - 1;
+                }
+                currentRow.append(merged);
+                runStart = -1;
+            }
+        }
+        previousRow.swap(currentRow);
+    }
+
+    return changedRects;
+}
@@ -0,0 +1,42 @@
+#ifndef IMAGEKERNELS_H
+#define IMAGEKERNELS_H
+
+#include <QtGlobal>
+#include <QImage>
+#include <QVector>
+#include <QRect>
+
+// Pixel kernels for preparing 32 bit images for texture upload and for
+// converting readbacks. Each kernel has SSE2, AVX2 and NEON variants where
+// they help, picked once at runtime from the CPU features, and a scalar
+// fallback producing bit identical results.
+class ImageKernels
+{
+public:
+    enum InstructionSet
+    {
+        InstructionSet_Scalar = 0,
+        InstructionSet_SSE2,
+        InstructionSet_AVX2,
+        InstructionSet_NEON
+    };
+
+    static InstructionSet getInstructionSet();
+    static bool isInstructionSetAvailable(InstructionSet instructionSet);
+    static bool setInstructionSet(InstructionSet instructionSet);
+
+    // Raw kernels on 4 byte pixels, source and destination may be the same buffer
+    static void swizzleRedBlue(const uchar* src, uchar* dst, int pixelCount);
+    static void premultiplyAlpha(const uchar* src, uchar* dst, int pixelCount);
+    static void downscaleByTwo(const uchar* src, int srcBytesPerLine, uchar* dst, int dstBytesPerLine, int dstWidth, int dstHeight);
+    static void flipVertical(uchar* bits, int bytesPerLine, int height);
+    static bool isBlockEqual(const uchar* a, int aBytesPerLine, const uchar* b, int bBytesPerLine, int rowBytes, int rows);
+
+    // Image helpers built on the kernels
+    static QImage prepareForUpload(const QImage& image);
+    static QImage convertReadback(const QImage& image);
+    static QImage downscaleImage(const QImage& image);
+    static QVector<QRect> findChangedRects(const QImage& before, const QImage& after, int tileSize);
+};
+
+#endif // IMAGEKERNELS_H
@@ -0,0 +1,164 @@
+#include "publishglassetloader.h"
+#include "imagekernels.h"
+#include "publishglmipcache.h"
+#include <QImageReader>
+#include <QCache>
+#include <QElapsedTimer>
+#include <QDebug>
+
+const int ASSETLOADER_THREAD_COUNT = 2;
+const int PLACEHOLDER_MAX_DIMENSION = 256;
+const int PLACEHOLDER_CACHE_KB = 16 * 1024;
+
+namespace
+{
+
+struct PlaceholderEntry
+{
+    QImage _image;
+    QSize _fullSize;
+};
+
+// Only touched from the thread owning the loaders, which is the GUI thread
+QCache<QString, PlaceholderEntry>& getPlaceholderCache()
+{
+    static QCache<QString, PlaceholderEntry> cache(PLACEHOLDER_CACHE_KB);
+    return cache;
+}
+
+}
+
+PublishGLAssetLoader::PublishGLAssetLoader(QObject *parent) :
+    QObject(parent),
+    _pool(),
+    _pendingCount(0)
+{
+    _pool.setMaxThreadCount(ASSETLOADER_THREAD_COUNT);
+}
+
+PublishGLAssetLoader::~PublishGLAssetLoader()
+{
+    _pool.clear();
+    _pool.waitForDone();
+}
+
+// Decode the image on the worker pool, the result arrives through imageLoaded or imageFailed.
+// With mipChain a cached chain arrives through chainLoaded instead, without decoding the image.
+void PublishGLAssetLoader::requestImage(const QString& fileName, const QSize& maxSize, bool mipChain)
+{
+    ++_pendingCount;
+
+    _pool.start([this, fileName, maxSize, mipChain]()
+    {
+        if(mipChain)
+        {
+            QSize chainSize;
+            QString chainFileName = PublishGLMipCache::findCachedChain(fileName, maxSize, &chainSize);
+            if(!chainFileName.isEmpty())
+            {
+                QMetaObject::invokeMethod(this, "deliverChain", Qt::QueuedConnection,
+                                          Q_ARG(QString, fileName),
+                                          Q_ARG(QString, chainFileName),
+                                          Q_ARG(QSize, chainSize));
+
+                // The chain is shown right away, the check of the contents reads the whole file
+                if(PublishGLMipCache::verifyCachedChain(fileName, chainFileName))
+                {
+                    QMetaObject::invokeMethod(this, "finishRequest", Qt::QueuedConnection);
+                    return;
+                }
+            }
+        }
+
+        QElapsedTimer decodeTimer;
+        decodeTimer.start();
+
+        QImageReader reader(fileName);
+        reader.setAutoTransform(true);
+
+        // Let the decoder produce the reduced size directly instead of scaling a full size image
+        QSize imageSize = reader.size();
+        if((imageSize.isValid()) && (maxSize.isValid()) &&
+           ((imageSize.width() > maxSize.width()) || (imageSize.height() > maxSize.height())))
+        {
+            reader.setScaledSize(imageSize.scaled(maxSize, Qt::KeepAspectRatio));
+        }
+
+        QImage image = reader.read();
+        QImage placeholder;
+        QString error;
+        if(image.isNull())
+        {
+            error = reader.errorString();
+        }
+        else
+        {
+            placeholder = image;
+            while((placeholder.width() > PLACEHOLDER_MAX_DIMENSION) || (placeholder.height() > PLACEHOLDER_MAX_DIMENSION))
+                placeholder = ImageKernels::downscaleImage(placeholder);
+
+            qDebug() << "[PublishGLAssetLoader] Decoded " << fileName << " at " << image.size() << " from " << imageSize << " in " << decodeTimer.elapsed() << " ms";
+        }
+
+        QString chainFileName;
+        if((mipChain) && (!image.isNull()))
+            chainFileName = PublishGLMipCache::storeChain(fileName, maxSize, image);
+
+        QMetaObject::invokeMethod(this, "deliverImage", Qt::QueuedConnection,
+                                  Q_ARG(QString, fileName),
+                                  Q_ARG(QImage, image),
+                                  Q_ARG(QImage, placeholder),
+                                  Q_ARG(QString, chainFileName),
+                                  Q_ARG(QString, error));
+    });
+}
+
+int PublishGLAssetLoader::getPendingCount() const
+{
+    return _pendingCount;
+}
+
+// Small version of a previously decoded image, fullSize returns the size it stands in for
+QImage PublishGLAssetLoader::getPlaceholder(const QString& fileName, QSize* fullSize)
+{
+    PlaceholderEntry* entry = getPlaceholderCache().object(fileName);
+    if(!entry)
+        return QImage();
+
+    if(fullSize)
+        *fullSize = entry->_fullSize;
+
+    return entry->_image;
+}
+
+void PublishGLAssetLoader::deliverImage(const QString& fileName, const QImage& image, const QImage& placeholder, const QString& chainFileName, const QString& error)
+{
+    --_pendingCount;
+
+    if(image.isNull())
+    {
+        qDebug() << "[PublishGLAssetLoader] ERROR: unable to decode " << fileName << ": " << error;
+        emit imageFailed(fileName, error);
+        return;
+    }
+
+    if(!placeholder.isNull())
+    {
+        PlaceholderEntry* entry = new PlaceholderEntry{placeholder, image.size()};
+        getPlaceholderCache().insert(fileName, entry, qMax(1, static_cast<int>(placeholder.sizeInBytes() / 1024)));
+    }
+
+    emit imageLoaded(fileName, image, chainFileName);
+}
+
+// A cached chain of the image, the request continues until its contents have been checked
+void PublishGLAssetLoader::deliverChain(const QString& fileName, const QString& chainFileName, const QSize& imageSize)
+{
+    qDebug() << "[PublishGLAssetLoader] Found the mip chain of " << fileName << " at " << imageSize << " in the cache";
+    emit chainLoaded(fileName, chainFileName, imageSize);
+}
+
+void PublishGLAssetLoader::finishRequest()
+{
+    --_pendingCount;
+}
@@ -0,0 +1,44 @@
+#ifndef PUBLISHGLASSETLOADER_H
+#define PUBLISHGLASSETLOADER_H
+
+#include <QObject>
+#include <QThreadPool>
+#include <QImage>
+#include <QSize>
+#include <QString>
+
+// Decodes images on a worker pool so large map images do not block the GUI
+// thread. Images larger than the requested maximum are decoded directly at
+// the reduced size. A small placeholder of every decoded image is kept in a
+// process wide cache so a renderer can show something immediately the next
+// time the same image is opened. Images requested with a mip chain are looked
+// up in the mip cache first and only decoded on a miss, which also builds and
+// stores their chain on the worker.
+class PublishGLAssetLoader : public QObject
+{
+    Q_OBJECT
+public:
+    explicit PublishGLAssetLoader(QObject *parent = nullptr);
+    virtual ~PublishGLAssetLoader() override;
+
+    void requestImage(const QString& fileName, const QSize& maxSize, bool mipChain = false);
+    int getPendingCount() const;
+
+    static QImage getPlaceholder(const QString& fileName, QSize* fullSize = nullptr);
+
+signals:
+    void imageLoaded(const QString& fileName, const QImage& image, const QString& chainFileName);
+    void chainLoaded(const QString& fileName, const QString& chainFileName, const QSize& imageSize);
+    void imageFailed(const QString& fileName, const QString& error);
+
+protected slots:
+    void deliverImage(const QString& fileName, const QImage& image, const QImage& placeholder, const QString& chainFileName, const QString& error);
+    void deliverChain(const QString& fileName, const QString& chainFileName, const QSize& imageSize);
+    void finishRequest();
+
+private:
+    QThreadPool _pool;
+    int _pendingCount;
+};
+
+#endif // PUBLISHGLASSETLOADER_H
@@ -0,0 +1,250 @@
+#include "publishglfoglayer.h"
+#include <QOpenGLFunctions>
+#include <QPainter>
+#include <QPainterPathStroker>
+#include <QDebug>
+
+#ifndef GL_R8
+#define GL_R8 0x8229
+#endif
+#ifndef GL_RED
+#define GL_RED 0x1903
+#endif
+#ifndef GL_UNPACK_ROW_LENGTH
+#define GL_UNPACK_ROW_LENGTH 0x0CF2
+#endif
+
+// Past this many separate rectangles a single upload of their bounds is cheaper than the calls
+const int FOG_MAX_UPLOAD_RECTS = 32;
+
+PublishGLFogLayer::PublishGLFogLayer(const QSize& maskSize) :
+    _context(nullptr),
+    _mask(maskSize, QImage::Format_Alpha8),
+    _texture(0),
+    _operations(),
+    _fullUpload(true),
+    _bytesUploaded(0)
+{
+    // Everything starts fogged
+    _mask.fill(0);
+}
+
+PublishGLFogLayer::~PublishGLFogLayer()
+{
+    cleanup();
+}
+
+// Delete the texture, the context must be current. The mask is kept and uploaded again by the next update.
+void PublishGLFogLayer::cleanup()
+{
+    QOpenGLFunctions *f = _context ? _context->functions() : nullptr;
+    if((f) && (_texture > 0))
+        f->glDeleteTextures(1, &_texture);
+
+    _texture = 0;
+    _context = nullptr;
+    _fullUpload = true;
+}
+
+QSize PublishGLFogLayer::getMaskSize() const
+{
+    return _mask.size();
+}
+
+GLuint PublishGLFogLayer::getTexture() const
+{
+    return _texture;
+}
+
+// A stroke of round brush dabs through the points
+void PublishGLFogLayer::revealStroke(const QVector<QPointF>& points, qreal radius)
+{
+    addOperation(true, createStrokePath(points, radius));
+}
+
+void PublishGLFogLayer::hideStroke(const QVector<QPointF>& points, qreal radius)
+{
+    addOperation(false, createStrokePath(points, radius));
+}
+
+void PublishGLFogLayer::revealPolygon(const QPolygonF& polygon)
+{
+    QPainterPath path;
+    path.addPolygon(polygon);
+    path.closeSubpath();
+    addOperation(true, path);
+}
+
+void PublishGLFogLayer::hidePolygon(const QPolygonF& polygon)
+{
+    QPainterPath path;
+    path.addPolygon(polygon);
+    path.closeSubpath();
+    addOperation(false, path);
+}
+
+void PublishGLFogLayer::revealAll()
+{
+    _operations.clear();
+    _mask.fill(255);
+    _fullUpload = true;
+}
+
+void PublishGLFogLayer::hideAll()
+{
+    _operations.clear();
+    _mask.fill(0);
+    _fullUpload = true;
+}
+
+bool PublishGLFogLayer::isDirty() const
+{
+    return ((_fullUpload) || (!_operations.isEmpty()));
+}
+
+// Rasterize the queued operations into the mask and upload the area they touched, the context must be current
+QRect PublishGLFogLayer::update(QOpenGLContext* context)
+{
+    QOpenGLFunctions *f = context ? context->functions() : nullptr;
+    if((!f) || (_mask.isNull()))
+        return QRect();
+
+    if((_texture == 0) || (context != _context))
+    {
+        // A texture of a shared context is deleted here. Otherwise it belongs to a context that is gone,
+        // or to one that doesn't share with this one and frees it when it is destroyed.
+        if((_texture > 0) && (_context) && (QOpenGLContext::areSharing(_context, context)))
+            f->glDeleteTextures(1, &_texture);
+
+        _texture = 0;
+        _context = context;
+        f->glGenTextures(1, &_texture);
+        f->glBindTexture(GL_TEXTURE_2D, _texture);
+        f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        f->glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, _mask.width(), _mask.height(), 0, GL_RED, GL_UNSIGNED_BYTE, nullptr);
+        _fullUpload = true;
+    }
+
+    if(!isDirty())
+        return QRect();
+
+    // One rect per operation, so strokes at opposite corners don't upload everything between them
+    QVector<QRect> operationRects;
+    if(!_operations.isEmpty())
+    {
+        QPainter painter(&_mask);
+        painter.setRenderHint(QPainter::Antialiasing);
+        painter.setCompositionMode(QPainter::CompositionMode_Source);
+        painter.setPen(Qt::NoPen);
+        for(const FogOperation& operation : qAsConst(_operations))
+        {
+            painter.fillPath(operation._path, operation._reveal ? QColor(0, 0, 0, 255) : QColor(0, 0, 0, 0));
+            QRect operationRect = operation._path.boundingRect().toAlignedRect().adjusted(-1, -1, 1, 1) & _mask.rect();
+            if(!operationRect.isEmpty())
+                operationRects.append(operationRect);
+        }
+        painter.end();
+        _operations.clear();
+    }
+
+    QVector<QRect> uploadRects;
+    if(_fullUpload)
+        uploadRects.append(_mask.rect());
+    else
+        uploadRects = mergeOverlappingRects(operationRects);
+
+    if(uploadRects.count() > FOG_MAX_UPLOAD_RECTS)
+    {
+        QRect boundingRect;
+        for(const QRect& uploadRect : qAsConst(uploadRects))
+            boundingRect |= uploadRect;
+        uploadRects = QVector<QRect>(1, boundingRect);
+    }
+
+    if(uploadRects.isEmpty())
+        return QRect();
+
+    // The texture keeps the mask's top down rows, the map shader flips the lookup
+    QRect dirtyRect;
+    f->glBindTexture(GL_TEXTURE_2D, _texture);
+    f->glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    f->glPixelStorei(GL_UNPACK_ROW_LENGTH, _mask.bytesPerLine());
+    for(const QRect& uploadRect : qAsConst(uploadRects))
+    {
+        f->glTexSubImage2D(GL_TEXTURE_2D, 0, uploadRect.x(), uploadRect.y(), uploadRect.width(), uploadRect.height(),
+                           GL_RED, GL_UNSIGNED_BYTE, _mask.constScanLine(uploadRect.y()) + uploadRect.x());
+        _bytesUploaded += static_cast<quint64>(uploadRect.width()) * static_cast<quint64>(uploadRect.height());
+        dirtyRect |= uploadRect;
+    }
+    f->glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    f->glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    f->glBindTexture(GL_TEXTURE_2D, 0);
+
+    _fullUpload = false;
+    return dirtyRect;
+}
+
+quint64 PublishGLFogLayer::getBytesUploaded() const
+{
+    return _bytesUploaded;
+}
+
+void PublishGLFogLayer::addOperation(bool reveal, const QPainterPath& path)
+{
+    if(path.isEmpty())
+        return;
+
+    _operations.append(FogOperation{reveal, path});
+}
+
+// Merge rects that overlap until no two do, rects that are only near each other stay separate
+QVector<QRect> PublishGLFogLayer::mergeOverlappingRects(const QVector<QRect>& rects)
+{
+    QVector<QRect> merged = rects;
+    bool changed = true;
+    while(changed)
+    {
+        changed = false;
+        for(int i = 0; (i < merged.count()) && (!changed); ++i)
+        {
+            for(int j = i + 1; j < merged.count(); ++j)
+            {
+                if(merged.at(i).intersects(merged.at(j)))
+                {
+                    merged[i] |= merged.at(j);
+                    merged.removeAt(j);
+                    changed = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    return merged;
+}
+
+QPainterPath PublishGLFogLayer::createStrokePath(const QVector<QPointF>& points, qreal radius)
+{
+    QPainterPath path;
+    if((points.isEmpty()) || (radius <= 0.0))
+        return path;
+
+    if(points.count() == 1)
+    {
+        path.addEllipse(points.first(), radius, radius);
+        return path;
+    }
+
+    QPainterPath line(points.first());
+    for(int i = 1; i < points.count(); ++i)
+        line.lineTo(points.at(i));
+
+    QPainterPathStroker stroker;
+    stroker.setWidth(radius * 2.0);
+    stroker.setCapStyle(Qt::RoundCap);
+    stroker.setJoinStyle(Qt::RoundJoin);
+    return stroker.createStroke(line);
+}
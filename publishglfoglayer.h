@@ -0,0 +1,60 @@
+#ifndef PUBLISHGLFOGLAYER_H
+#define PUBLISHGLFOGLAYER_H
+
+#include <QImage>
+#include <QPainterPath>
+#include <QPolygonF>
+#include <QVector>
+#include <QRect>
+#include <QPointer>
+#include <QOpenGLContext>
+#include <qopengl.h>
+
+// Fog of war held as a single channel mask texture, 0 where the map is
+// fogged and 255 where it is revealed. Reveal and hide operations are
+// queued and rasterized together on the next update, which only uploads
+// the rectangles they touched, merging only the ones that overlap. Coordinates are mask pixels with the origin
+// at the top left.
+class PublishGLFogLayer
+{
+public:
+    explicit PublishGLFogLayer(const QSize& maskSize);
+    ~PublishGLFogLayer();
+
+    void cleanup();
+
+    QSize getMaskSize() const;
+    GLuint getTexture() const;
+
+    void revealStroke(const QVector<QPointF>& points, qreal radius);
+    void hideStroke(const QVector<QPointF>& points, qreal radius);
+    void revealPolygon(const QPolygonF& polygon);
+    void hidePolygon(const QPolygonF& polygon);
+    void revealAll();
+    void hideAll();
+
+    bool isDirty() const;
+    QRect update(QOpenGLContext* context);
+
+    quint64 getBytesUploaded() const;
+
+private:
+    struct FogOperation
+    {
+        bool _reveal;
+        QPainterPath _path;
+    };
+
+    void addOperation(bool reveal, const QPainterPath& path);
+    static QPainterPath createStrokePath(const QVector<QPointF>& points, qreal radius);
+    static QVector<QRect> mergeOverlappingRects(const QVector<QRect>& rects);
+
+    QPointer<QOpenGLContext> _context;
+    QImage _mask;
+    GLuint _texture;
+    QVector<FogOperation> _operations;
+    bool _fullUpload;
+    quint64 _bytesUploaded;
+};
+
+#endif // PUBLISHGLFOGLAYER_H
@@ -1,43 +1,148 @@
 #include "publishglmaprenderer.h"
 #include "map.h"
 #include "videoplayerglplayer.h"
-#include "battleglbackground.h"
 #include "publishglobject.h"
-#include "publishglimage.h"
+#include "publishglshadermanager.h"
+#include "publishglassetloader.h"
+#include "publishglunitquad.h"
+#include "publishgltiledbackground.h"
+#include "publishglfoglayer.h"
+#include "imagekernels.h"
+#include "publishglmipcache.h"
 #include <QOpenGLWidget>
 #include <QOpenGLContext>
 #include <QOpenGLFunctions>
+#include <QOpenGLExtraFunctions>
 #include <QMatrix4x4>
+#include <QImageReader>
 #include <QDebug>
 
+// Log the paint, upload and batching counters every PAINT_STATS_INTERVAL paints
+//#define PUBLISHGL_PAINT_STATS
+
+const quint64 PAINT_STATS_INTERVAL = 600;
+// Backgrounds larger than this in either direction are streamed in tiles
+const int TILED_BACKGROUND_MIN_DIMENSION = 8192;
+// Granularity of the change detection in setImage, and the point where a full upload is cheaper
+const int BACKGROUND_DIFF_TILE_SIZE = 64;
+const int BACKGROUND_MAX_DIRTY_RECTS = 64;
+// The fog mask stays bound to its own unit, the quads all sample unit 0
+const GLint FOG_TEXTURE_UNIT = 1;
+
+#ifndef GL_TEXTURE_MAX_LEVEL
+#define GL_TEXTURE_MAX_LEVEL 0x813D
+#endif
+
+// Scene uniform block layout (std140): mat4 view, mat4 projection
+const GLuint SCENE_BLOCK_BINDING = 0;
+const GLsizeiptr SCENE_BLOCK_MATRIX_SIZE = 16 * sizeof(GLfloat);
+const GLintptr SCENE_BLOCK_VIEW_OFFSET = 0;
+const GLintptr SCENE_BLOCK_PROJECTION_OFFSET = SCENE_BLOCK_MATRIX_SIZE;
+const GLsizeiptr SCENE_BLOCK_SIZE = 2 * SCENE_BLOCK_MATRIX_SIZE;
+
 PublishGLMapRenderer::PublishGLMapRenderer(Map* map, QObject *parent) :
     PublishGLRenderer(parent),
     _map(map),
     _image(),
     _videoPlayer(nullptr),
+    _videoLoopCache(VideoPlayerGLLoopCache::Storage_None),
     _targetSize(),
     _color(),
     _initialized(false),
     _shaderProgram(0),
-    _backgroundObject(nullptr),
-    _partyToken(nullptr)
+    _modelLocation(-1),
+    _fogRectLocation(-1),
+    _fogColorLocation(-1),
+    _fogEnabledLocation(-1),
+    _sceneBlock(0),
+    _backgroundTexture(0),
+    _backgroundTextureSize(),
+    _backgroundFullUpload(false),
+    _backgroundChainFile(),
+    _backgroundChainSize(),
+    _backgroundMipmapped(false),
+    _backgroundDirtyRects(),
+    _backgroundUploadsFull(0),
+    _backgroundUploadsPartial(0),
+    _backgroundBytesUploaded(0),
+    _tiledBackground(nullptr),
+    _assetLoader(nullptr),
+    _backgroundGeneration(0),
+    _backgroundRequest(0),
+    _backgroundFile(),
+    _quad(nullptr),
+    _placeholderTexture(0),
+    _placeholderSize(),
+    _partyImageId(-1),
+    _partyTokenSize(),
+    _dirtyLayers(DirtyLayer_All),
+    _paintedTokenRect(),
+    _paintsTotal(0),
+    _paintsSkipped(0),
+    _paintsPartial(0),
+    _screenshotRequested(false),
+    _spriteBatch(),
+    _textureAtlas(nullptr),
+    _fogLayer(nullptr),
+    _fogColor(Qt::black)
 {
+    _assetLoader = new PublishGLAssetLoader(this);
+    connect(_assetLoader, &PublishGLAssetLoader::imageLoaded, this, &PublishGLMapRenderer::backgroundLoaded);
+    connect(_assetLoader, &PublishGLAssetLoader::chainLoaded, this, &PublishGLMapRenderer::backgroundChainLoaded);
 }
 
 PublishGLMapRenderer::~PublishGLMapRenderer()
 {
     cleanup();
+
+    delete _fogLayer;
+    _fogLayer = nullptr;
 }
 
 void PublishGLMapRenderer::cleanup()
 {
     _initialized = false;
 
-    delete _partyToken;
-    _partyToken = nullptr;
+    if((_targetWidget) && (_targetWidget->context()))
+    {
+        QOpenGLFunctions *f = _targetWidget->context()->functions();
+        if(f)
+        {
+            if(_sceneBlock > 0)
+                f->glDeleteBuffers(1, &_sceneBlock);
+
+            if(_backgroundTexture > 0)
+                f->glDeleteTextures(1, &_backgroundTexture);
+        }
+    }
+    _sceneBlock = 0;
+    _backgroundTexture = 0;
+    _backgroundTextureSize = QSize();
+    _backgroundMipmapped = false;
+
+    // The atlas outlives the renderer, so the token stays resident for the next activation
+    if(_textureAtlas)
+        _textureAtlas->releaseImage(_partyImageId);
+    _partyImageId = -1;
+    _textureAtlas = nullptr;
+    _spriteBatch.cleanup();
+
+    // The mask itself is kept, it is uploaded again after the next initializeGL
+    if(_fogLayer)
+        _fogLayer->cleanup();
+
+    cleanupPlaceholder();
+    if(_quad)
+    {
+        PublishGLUnitQuad::release(_targetWidget ? _targetWidget->context() : nullptr);
+        _quad = nullptr;
+    }
+    // A later initializeGL uploads the whole image again
+    _backgroundFullUpload = (!_image.isNull()) || (!_backgroundChainFile.isEmpty());
+    _backgroundDirtyRects.clear();
 
-    delete _backgroundObject;
-    _backgroundObject = nullptr;
+    delete _tiledBackground;
+    _tiledBackground = nullptr;
 
     delete _videoPlayer;
     _videoPlayer = nullptr;
@@ -51,6 +156,7 @@ bool PublishGLMapRenderer::deleteOnDeactivation()
 void PublishGLMapRenderer::setBackgroundColor(const QColor& color)
 {
     _color = color;
+    _dirtyLayers |= DirtyLayer_Background;
     emit updateWidget();
 }
 
@@ -61,95 +167,116 @@ void PublishGLMapRenderer::initializeGL()
 
     // Set up the rendering context, load shaders and other resources, etc.:
     QOpenGLFunctions *f = _targetWidget->context()->functions();
-    if(!f)
+    QOpenGLExtraFunctions *e = _targetWidget->context()->extraFunctions();
+    if((!f) || (!e))
         return;
 
+    // Keep the previous frame in the widget so unchanged frames can be skipped
+    _targetWidget->setUpdateBehavior(QOpenGLWidget::PartialUpdate);
+
     f->glEnable(GL_TEXTURE_2D); // Enable texturing
     f->glEnable(GL_BLEND);// you enable blending function
     f->glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
     const char *vertexShaderSource = "#version 330 core\n"
         "layout (location = 0) in vec3 aPos;   // the position variable has attribute position 0\n"
-        "layout (location = 1) in vec3 aColor; // the color variable has attribute position 1\n"
         "layout (location = 2) in vec2 aTexCoord;\n"
+        "layout (std140) uniform SceneBlock\n"
+        "{\n"
+        "    mat4 view;\n"
+        "    mat4 projection;\n"
+        "};\n"
         "uniform mat4 model;\n"
-        "uniform mat4 view;\n"
-        "uniform mat4 projection;\n"
-        "out vec3 ourColor; // output a color to the fragment shader\n"
+        "uniform vec4 fogRect;\n"
         "out vec2 TexCoord;\n"
+        "out vec2 FogCoord;\n"
         "void main()\n"
         "{\n"
         "   // note that we read the multiplication from right to left\n"
-        "   gl_Position = projection * view * model * vec4(aPos, 1.0); // gl_Position = vec4(aPos.x, aPos.y, aPos.z, 1.0);\n"
-        "   ourColor = aColor; // set ourColor to the input color we got from the vertex data\n"
+        "   vec4 worldPos = model * vec4(aPos, 1.0);\n"
+        "   gl_Position = projection * view * worldPos; // gl_Position = vec4(aPos.x, aPos.y, aPos.z, 1.0);\n"
         "   TexCoord = aTexCoord;\n"
+        "   FogCoord = (worldPos.xy - fogRect.xy) / fogRect.zw;\n"
         "}\0";
 
-    unsigned int vertexShader;
-    vertexShader = f->glCreateShader(GL_VERTEX_SHADER);
-    f->glShaderSource(vertexShader, 1, &vertexShaderSource, NULL);
-    f->glCompileShader(vertexShader);
-
-    int  success;
-    char infoLog[512];
-    f->glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &success);
-    if(!success)
-    {
-        f->glGetShaderInfoLog(vertexShader, 512, NULL, infoLog);
-        qDebug() << "[PublishGLMapRenderer] ERROR::SHADER::VERTEX::COMPILATION_FAILED: " << infoLog;
-        return;
-    }
-
     const char *fragmentShaderSource = "#version 330 core\n"
         "out vec4 FragColor;\n"
-        "in vec3 ourColor;\n"
         "in vec2 TexCoord;\n"
+        "in vec2 FogCoord;\n"
         "uniform sampler2D texture1;\n"
+        "uniform sampler2D fogMask;\n"
+        "uniform vec4 fogColor;\n"
+        "uniform bool fogEnabled;\n"
         "void main()\n"
         "{\n"
         "    FragColor = texture(texture1, TexCoord); // FragColor = vec4(ourColor, 1.0f);\n"
+        "    if(fogEnabled)\n"
+        "    {\n"
+        "        // The mask rows are top down, the scene is y up\n"
+        "        float revealed = texture(fogMask, vec2(FogCoord.x, 1.0 - FogCoord.y)).r;\n"
+        "        FragColor.rgb = mix(fogColor.rgb, FragColor.rgb, revealed);\n"
+        "    }\n"
         "}\0";
 
-    unsigned int fragmentShader;
-    fragmentShader = f->glCreateShader(GL_FRAGMENT_SHADER);
-    f->glShaderSource(fragmentShader, 1, &fragmentShaderSource, NULL);
-    f->glCompileShader(fragmentShader);
-
-    f->glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &success);
-    if(!success)
-    {
-        f->glGetShaderInfoLog(fragmentShader, 512, NULL, infoLog);
-        qDebug() << "[PublishGLMapRenderer] ERROR::SHADER::FRAGMENT::COMPILATION_FAILED: " << infoLog;
+    // Programs are compiled once per share group and shared by all renderer instances.
+    // All of them are requested before waiting for the first, so drivers with parallel
+    // compilation build them at the same time.
+    PublishGLShaderManager* shaderManager = getShaderManager();
+    if(!shaderManager)
         return;
-    }
 
-    _shaderProgram = f->glCreateProgram();
+    shaderManager->requestProgram(QString("map"), vertexShaderSource, fragmentShaderSource);
+    PublishGLSpriteBatch::requestProgram(shaderManager);
+    if(VideoPlayerGLPlayer::isSoftwareFramesRequired(_videoLoopCache))
+        VideoPlayerGLSoftware::requestProgram(shaderManager);
 
-    f->glAttachShader(_shaderProgram, vertexShader);
-    f->glAttachShader(_shaderProgram, fragmentShader);
-    f->glLinkProgram(_shaderProgram);
-
-    f->glGetProgramiv(_shaderProgram, GL_LINK_STATUS, &success);
-    if(!success) {
-        f->glGetProgramInfoLog(_shaderProgram, 512, NULL, infoLog);
-        qDebug() << "[PublishGLMapRenderer] ERROR::SHADER::PROGRAM::COMPILATION_FAILED: " << infoLog;
+    _shaderProgram = shaderManager->getProgram(QString("map"));
+    if(_shaderProgram == 0)
+    {
+        qDebug() << "[PublishGLMapRenderer] ERROR: map shader program not available";
         return;
     }
 
     f->glUseProgram(_shaderProgram);
-    f->glDeleteShader(vertexShader);
-    f->glDeleteShader(fragmentShader);
 
     // Create the objects
-    _image.load(QString("C:\\Users\\turne\\Documents\\DnD\\DM Helper\\testdata\\Desert Stronghold.jpg"));
-    _backgroundObject = new BattleGLBackground(nullptr, _image, GL_NEAREST);
+    _quad = PublishGLUnitQuad::acquire(_targetWidget->context());
+
+    // Decode the background off the GUI thread, showing the clear color or a cached placeholder until it is ready
+    _backgroundFile = QString("C:\\Users\\turne\\Documents\\DnD\\DM Helper\\testdata\\Desert Stronghold.jpg");
+    GLint maxTextureSize = 0;
+    f->glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+    QSize backgroundSize = QImageReader(_backgroundFile).size();
+    const int tiledDimension = qMin(static_cast<int>(maxTextureSize), TILED_BACKGROUND_MIN_DIMENSION);
+    if((backgroundSize.width() > tiledDimension) || (backgroundSize.height() > tiledDimension))
+    {
+        // Too large to keep resident, only the visible tiles are decoded and uploaded
+        _tiledBackground = new PublishGLTiledBackground(_backgroundFile, this);
+        _tiledBackground->initialize(_targetWidget->context());
+        connect(_tiledBackground, &PublishGLTiledBackground::tileReady, this, &PublishGLMapRenderer::backgroundTileReady);
+    }
+    else
+    {
+        QSize placeholderSize;
+        QImage placeholder = PublishGLAssetLoader::getPlaceholder(_backgroundFile, &placeholderSize);
+        createPlaceholder(placeholder, placeholderSize);
+        requestBackground(maxTextureSize);
+    }
 
     // Create the party token
     if(_map->getShowParty())
     {
-        QImage partyImage = _map->getPartyPixmap().toImage();
-        _partyToken = new PublishGLImage(partyImage, false);
-        _partyToken->setScale(0.04f * static_cast<float>(_map->getPartyScale()));
+        QPixmap partyPixmap = _map->getPartyPixmap();
+        QImage partyImage = partyPixmap.toImage();
+        _partyTokenSize = QSizeF(partyImage.size()) * (0.04 * _map->getPartyScale());
+
+        // Store the token at its displayed size, the atlas does not keep mipmaps
+        QSize atlasSize = (_partyTokenSize * _targetWidget->devicePixelRatioF()).toSize().expandedTo(QSize(1, 1));
+        // The atlas is shared by all renderers, so the key names the pixmap as well as the size
+        _textureAtlas = getTextureAtlas();
+        if(_textureAtlas)
+            _partyImageId = _textureAtlas->acquireImage(QString("party:%1:%2x%3").arg(partyPixmap.cacheKey()).arg(atlasSize.width()).arg(atlasSize.height()),
+                                                        partyImage.scaled(atlasSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation));
     }
 
     // Create the objects
@@ -158,23 +285,49 @@ void PublishGLMapRenderer::initializeGL()
                                            _targetWidget->format(),
                                            _targetSize,
                                            true,
-                                           false);
-    connect(_videoPlayer, &VideoPlayerGLPlayer::frameAvailable, this, &PublishGLMapRenderer::updateWidget);
+                                           false,
+                                           _videoLoopCache);
+    _videoPlayer->setRenderAtTargetSize(true);
+    _videoPlayer->setLooping(true);
+    _videoPlayer->setGovernorEnabled(true);
+    connect(_videoPlayer, &VideoPlayerGLPlayer::frameAvailable, this, &PublishGLMapRenderer::scheduleRedraw, Qt::DirectConnection);
+    connect(_videoPlayer, &VideoPlayerGLPlayer::screenshotReady, this, &PublishGLMapRenderer::screenshotReady);
+    if(_screenshotRequested)
+    {
+        _videoPlayer->requestScreenshot();
+        _screenshotRequested = false;
+    }
+
+    // Resolve the uniforms once, the per-draw data is only the model matrix
+    _modelLocation = f->glGetUniformLocation(_shaderProgram, "model");
+    _fogRectLocation = f->glGetUniformLocation(_shaderProgram, "fogRect");
+    _fogColorLocation = f->glGetUniformLocation(_shaderProgram, "fogColor");
+    _fogEnabledLocation = f->glGetUniformLocation(_shaderProgram, "fogEnabled");
+    f->glUniform1i(f->glGetUniformLocation(_shaderProgram, "texture1"), 0); // set it manually
+    f->glUniform1i(f->glGetUniformLocation(_shaderProgram, "fogMask"), FOG_TEXTURE_UNIT);
+    e->glUniformBlockBinding(_shaderProgram, e->glGetUniformBlockIndex(_shaderProgram, "SceneBlock"), SCENE_BLOCK_BINDING);
+
+    // View and projection are shared by all draws through the scene uniform block
+    f->glGenBuffers(1, &_sceneBlock);
+    f->glBindBuffer(GL_UNIFORM_BUFFER, _sceneBlock);
+    f->glBufferData(GL_UNIFORM_BUFFER, SCENE_BLOCK_SIZE, nullptr, GL_DYNAMIC_DRAW);
+    e->glBindBufferBase(GL_UNIFORM_BUFFER, SCENE_BLOCK_BINDING, _sceneBlock);
 
-    // Matrices
     // Model
     QMatrix4x4 modelMatrix;
-    f->glUniformMatrix4fv(f->glGetUniformLocation(_shaderProgram, "model"), 1, GL_FALSE, modelMatrix.constData());
+    f->glUniformMatrix4fv(_modelLocation, 1, GL_FALSE, modelMatrix.constData());
     // View
     QMatrix4x4 viewMatrix;
     viewMatrix.lookAt(QVector3D(0.f, 0.f, 500.f), QVector3D(0.f, 0.f, 0.f), QVector3D(0.f, 1.f, 0.f));
-    f->glUniformMatrix4fv(f->glGetUniformLocation(_shaderProgram, "view"), 1, GL_FALSE, viewMatrix.constData());
+    f->glBufferSubData(GL_UNIFORM_BUFFER, SCENE_BLOCK_VIEW_OFFSET, SCENE_BLOCK_MATRIX_SIZE, viewMatrix.constData());
     // Projection - note, this is set later when resizing the window
     setOrthoProjection();
 
-    f->glUseProgram(_shaderProgram);
-    f->glUniform1i(f->glGetUniformLocation(_shaderProgram, "texture1"), 0); // set it manually
+    // Tokens share the scene block with the map program
+    if(!_spriteBatch.initialize(_targetWidget->context(), shaderManager, SCENE_BLOCK_BINDING))
+        qDebug() << "[PublishGLMapRenderer] ERROR: sprite batch could not be initialized";
 
+    _dirtyLayers = DirtyLayer_All;
     _initialized = true;
 }
 
@@ -188,6 +341,7 @@ void PublishGLMapRenderer::resizeGL(int w, int h)
         _videoPlayer->targetResized(_targetSize);
         _videoPlayer->initializationComplete();
     }
+    _dirtyLayers = DirtyLayer_All;
     emit updateWidget();
 }
 
@@ -204,32 +358,226 @@ void PublishGLMapRenderer::paintGL()
     if((!f) || (!e))
         return;
 
+    ++_paintsTotal;
+#ifdef PUBLISHGL_PAINT_STATS
+    if((_paintsTotal % PAINT_STATS_INTERVAL) == 0)
+    {
+        qDebug() << "[PublishGLMapRenderer] Paints requested: " << _paintsTotal << ", skipped: " << _paintsSkipped << ", partial: " << _paintsPartial;
+        qDebug() << "[PublishGLMapRenderer] GL state changes issued: " << _stateCache.getCallsIssued() << ", avoided: " << _stateCache.getCallsAvoided();
+        qDebug() << "[PublishGLMapRenderer] Sprites in last paint: " << _spriteBatch.getSpriteCount() << ", draw calls: " << _spriteBatch.getDrawCalls();
+        if(_textureAtlas)
+            qDebug() << "[PublishGLMapRenderer] Atlas pages: " << _textureAtlas->getPageCount() << ", entries: " << _textureAtlas->getEntryCount() << ", evictions: " << _textureAtlas->getEvictions();
+        qDebug() << "[PublishGLMapRenderer] Background uploads full: " << _backgroundUploadsFull << ", partial: " << _backgroundUploadsPartial << ", bytes: " << _backgroundBytesUploaded;
+        if(_tiledBackground)
+            qDebug() << "[PublishGLMapRenderer] Background tiles resident: " << _tiledBackground->getResidentTiles() << ", memory: " << _tiledBackground->getMemoryUsed() << ", loaded: " << _tiledBackground->getTilesLoaded() << ", evicted: " << _tiledBackground->getTilesEvicted() << ", cancelled: " << _tiledBackground->getTilesCancelled() << ", average latency: " << _tiledBackground->getAverageTileLatency() << " ms";
+    }
+#endif
+
+    // Qt may have touched the GL state between paints, so the state cache starts from scratch every frame
+    _stateCache.reset(_targetWidget->context());
+
+    // Work out which layers changed since the last paint. The video frame is taken
+    // here, so a frame arriving later in the paint cannot end up in a partial paint.
+    int dirtyLayers = _dirtyLayers;
+    if(_videoPlayer->updateFrame(&_stateCache))
+        dirtyLayers |= DirtyLayer_Video;
+
+    // A planar software frame is converted in its own pass, which leaves the viewport at the frame size
+    if(_videoPlayer->isSoftwareFrames())
+    {
+        qreal pixelRatio = _targetWidget->devicePixelRatioF();
+        f->glViewport(0, 0, qRound(_targetSize.width() * pixelRatio), qRound(_targetSize.height() * pixelRatio));
+        f->glEnable(GL_BLEND);
+    }
+
+    QRectF tokenRect = getPartyTokenRect();
+    if(tokenRect != _paintedTokenRect)
+        dirtyLayers |= DirtyLayer_Token;
+
+    if((_fogLayer) && (_fogLayer->isDirty()))
+        dirtyLayers |= DirtyLayer_Fog;
+
+    if(dirtyLayers == DirtyLayer_None)
+    {
+        // Nothing changed, the widget keeps the previous frame
+        ++_paintsSkipped;
+        return;
+    }
+
+    // Only the token moved, so only redraw the area it left and the area it entered
+    bool partialPaint = (dirtyLayers == DirtyLayer_Token);
+    if(partialPaint)
+    {
+        QRect scissorRect = sceneToWindow(tokenRect.united(_paintedTokenRect));
+        f->glEnable(GL_SCISSOR_TEST);
+        f->glScissor(scissorRect.x(), scissorRect.y(), scissorRect.width(), scissorRect.height());
+        ++_paintsPartial;
+    }
+
     // Draw the scene:
     f->glClearColor(_color.redF(), _color.greenF(), _color.blueF(), 1.0f);
     f->glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    f->glUseProgram(_shaderProgram);
-    f->glActiveTexture(GL_TEXTURE0); // activate the texture unit first before binding texture
+    // Rasterize and upload the fog changes, only the rectangle they touched
+    if(_fogLayer)
+        _fogLayer->update(_targetWidget->context());
 
-    QMatrix4x4 modelMatrix;
-    f->glUniformMatrix4fv(f->glGetUniformLocation(_shaderProgram, "model"), 1, GL_FALSE, modelMatrix.constData());
-    _videoPlayer->paintGL();
+    // The fog upload binds its texture directly
+    _stateCache.invalidate();
+    _stateCache.useProgram(_shaderProgram);
+    e->glBindBufferBase(GL_UNIFORM_BUFFER, SCENE_BLOCK_BINDING, _sceneBlock);
+    setFogUniforms(f);
+    _stateCache.activeTexture(GL_TEXTURE0); // activate the texture unit first before binding texture
+
+    paintBackground(f);
+
+    f->glUniformMatrix4fv(_modelLocation, 1, GL_FALSE, _videoPlayer->getMatrixData());
+    _videoPlayer->paintGL(&_stateCache);
 
-    if(_partyToken)
+    // The token position depends on the video size, which is only final once the video was painted
+    QRectF paintedTokenRect = getPartyTokenRect();
+    _spriteBatch.begin();
+    if((_textureAtlas) && (_partyImageId > 0))
     {
-        QSize sceneSize = _videoPlayer->getSize();
-        _partyToken->setPosition(_map->getPartyIconPos().x() - (sceneSize.width() / 2), (sceneSize.height() / 2) - _map->getPartyIconPos().y());
-        f->glUniformMatrix4fv(f->glGetUniformLocation(_shaderProgram, "model"), 1, GL_FALSE, _partyToken->getMatrixData());
-        _partyToken->paintGL();
+        _textureAtlas->touch(_partyImageId);
+        _spriteBatch.addSprite(_textureAtlas->getTexture(_partyImageId), paintedTokenRect.center(), paintedTokenRect.size(),
+                               0.f, QColor(Qt::white), _textureAtlas->getTextureRect(_partyImageId));
     }
-    /*
-    if(_backgroundObject)
+    _spriteBatch.end(&_stateCache);
+    if(partialPaint)
+        f->glDisable(GL_SCISSOR_TEST);
+
+    _paintedTokenRect = paintedTokenRect;
+    _dirtyLayers = DirtyLayer_None;
+
+    // Decoded tiles beyond the per frame upload limit go up in the next paint
+    if((_tiledBackground) && (_tiledBackground->hasPendingUploads()))
+        backgroundTileReady();
+
+    // Keep painting until the screenshot readback has been collected
+    if(_videoPlayer->isScreenshotPending())
+        scheduleRedraw();
+}
+
+quint64 PublishGLMapRenderer::getPaintsAvoided() const
+{
+    return _paintsSkipped;
+}
+
+quint64 PublishGLMapRenderer::getPaintsPartial() const
+{
+    return _paintsPartial;
+}
+
+PublishGLFogLayer* PublishGLMapRenderer::getFogLayer() const
+{
+    return _fogLayer;
+}
+
+// Cover the map with fog, the mask size sets the coordinates of the reveal and hide calls
+void PublishGLMapRenderer::enableFog(const QSize& maskSize)
+{
+    if((_fogLayer) && (_fogLayer->getMaskSize() == maskSize))
+        return;
+
+    disableFog();
+    if(maskSize.isEmpty())
+        return;
+
+    _fogLayer = new PublishGLFogLayer(maskSize);
+    fogChanged();
+}
+
+void PublishGLMapRenderer::disableFog()
+{
+    if(!_fogLayer)
+        return;
+
+    if((_targetWidget) && (_targetWidget->context()))
     {
-        f->glUniformMatrix4fv(f->glGetUniformLocation(_shaderProgram, "model"), 1, GL_FALSE, _backgroundObject->getMatrixData());
-        _backgroundObject->paintGL();
+        _targetWidget->makeCurrent();
+        _fogLayer->cleanup();
+        _targetWidget->doneCurrent();
     }
-    */
 
+    delete _fogLayer;
+    _fogLayer = nullptr;
+    fogChanged();
+}
+
+void PublishGLMapRenderer::setFogColor(const QColor& color)
+{
+    _fogColor = color;
+    fogChanged();
+}
+
+void PublishGLMapRenderer::revealFog(const QVector<QPointF>& points, qreal radius)
+{
+    if(_fogLayer)
+    {
+        _fogLayer->revealStroke(points, radius);
+        fogChanged();
+    }
+}
+
+void PublishGLMapRenderer::hideFog(const QVector<QPointF>& points, qreal radius)
+{
+    if(_fogLayer)
+    {
+        _fogLayer->hideStroke(points, radius);
+        fogChanged();
+    }
+}
+
+void PublishGLMapRenderer::revealFogPolygon(const QPolygonF& polygon)
+{
+    if(_fogLayer)
+    {
+        _fogLayer->revealPolygon(polygon);
+        fogChanged();
+    }
+}
+
+void PublishGLMapRenderer::hideFogPolygon(const QPolygonF& polygon)
+{
+    if(_fogLayer)
+    {
+        _fogLayer->hidePolygon(polygon);
+        fogChanged();
+    }
+}
+
+void PublishGLMapRenderer::revealAllFog()
+{
+    if(_fogLayer)
+    {
+        _fogLayer->revealAll();
+        fogChanged();
+    }
+}
+
+void PublishGLMapRenderer::hideAllFog()
+{
+    if(_fogLayer)
+    {
+        _fogLayer->hideAll();
+        fogChanged();
+    }
+}
+
+quint64 PublishGLMapRenderer::getBackgroundBytesUploaded() const
+{
+    return _backgroundBytesUploaded;
+}
+
+VideoPlayerGLLoopCache::Storage PublishGLMapRenderer::getVideoLoopCache() const
+{
+    return _videoLoopCache;
+}
+
+void PublishGLMapRenderer::setVideoLoopCache(VideoPlayerGLLoopCache::Storage storage)
+{
+    _videoLoopCache = storage;
 }
 
 QImage PublishGLMapRenderer::getLastScreenshot()
@@ -240,6 +588,16 @@ QImage PublishGLMapRenderer::getLastScreenshot()
     return _videoPlayer->getLastScreenshot();
 }
 
+// Asynchronous alternative to getLastScreenshot, the image arrives through screenshotReady
+void PublishGLMapRenderer::requestScreenshot()
+{
+    if(_videoPlayer)
+        _videoPlayer->requestScreenshot();
+    else
+        _screenshotRequested = true;
+}
+
+// Null while the background is shown straight from a cached mip chain of the file
 const QImage& PublishGLMapRenderer::getImage() const
 {
     return _image;
@@ -250,22 +608,48 @@ QColor PublishGLMapRenderer::getColor() const
     return _color;
 }
 
+// Only the changed parts of the image are uploaded on the next paint
 void PublishGLMapRenderer::setImage(const QImage& image)
 {
-    if(image != _image)
+    // Any image set from outside may be edited, only the loader's results come with a mip chain.
+    // A load still in flight would overwrite this image, so its result is dropped.
+    ++_backgroundGeneration;
+    _backgroundChainFile.clear();
+
+    // Unmodified copies of the same image share their data and cache key
+    if(image.cacheKey() == _image.cacheKey())
+        return;
+
+    // Tiles are streamed from the file, so the image is never uploaded and there is nothing to compare
+    if(_tiledBackground)
     {
         _image = image;
+        return;
+    }
 
-        // TBD
-        /*
-        if(_backgroundObject)
-        {
-            _backgroundObject->setImage(image);
-            setOrthoProjection();
-            emit updateWidget();
-        }
-        */
+    // An edited image has a new cache key, the changes are found by comparing it tile by tile
+    const bool fullUpload = isBackgroundFullUploadNeeded(image);
+    updateBackground(image, fullUpload ? QVector<QRect>() : ImageKernels::findChangedRects(_image, image, BACKGROUND_DIFF_TILE_SIZE), fullUpload);
+}
+
+// For callers that know what they changed, the image is not compared at all
+void PublishGLMapRenderer::setImage(const QImage& image, const QRect& dirtyRect)
+{
+    ++_backgroundGeneration;
+    _backgroundChainFile.clear();
+
+    if(_tiledBackground)
+    {
+        _image = image;
+        return;
     }
+
+    QVector<QRect> changedRects;
+    const QRect changedRect = dirtyRect.intersected(image.rect());
+    if(!changedRect.isEmpty())
+        changedRects.append(changedRect);
+
+    updateBackground(image, changedRects, isBackgroundFullUploadNeeded(image));
 }
 /*
 void PublishGLMapRenderer::setColor(QColor color)
@@ -276,7 +660,7 @@ void PublishGLMapRenderer::setColor(QColor color)
 
 void PublishGLMapRenderer::setOrthoProjection()
 {
-    if((_shaderProgram == 0) || (!_targetWidget) || (!_targetWidget->context()))
+    if((_sceneBlock == 0) || (!_targetWidget) || (!_targetWidget->context()))
         return;
 
     QOpenGLFunctions *f = _targetWidget->context()->functions();
@@ -293,5 +677,290 @@ void PublishGLMapRenderer::setOrthoProjection()
 
     QMatrix4x4 projectionMatrix;
     projectionMatrix.ortho(-_targetSize.width() / 2, _targetSize.width() / 2, -_targetSize.height() / 2, _targetSize.height() / 2, 0.1f, 1000.f);
-    f->glUniformMatrix4fv(f->glGetUniformLocation(_shaderProgram, "projection"), 1, GL_FALSE, projectionMatrix.constData());
+    f->glBindBuffer(GL_UNIFORM_BUFFER, _sceneBlock);
+    f->glBufferSubData(GL_UNIFORM_BUFFER, SCENE_BLOCK_PROJECTION_OFFSET, SCENE_BLOCK_MATRIX_SIZE, projectionMatrix.constData());
+}
+
+// Scene area covered by the party token, which is centered on the party position
+QRectF PublishGLMapRenderer::getPartyTokenRect() const
+{
+    if((_partyImageId <= 0) || (!_map) || (!_videoPlayer))
+        return QRectF();
+
+    QSize sceneSize = _videoPlayer->getSize();
+    QPointF tokenPos(_map->getPartyIconPos().x() - (sceneSize.width() / 2), (sceneSize.height() / 2) - _map->getPartyIconPos().y());
+    return QRectF(tokenPos.x() - (_partyTokenSize.width() / 2.0), tokenPos.y() - (_partyTokenSize.height() / 2.0),
+                  _partyTokenSize.width(), _partyTokenSize.height());
+}
+
+// The decoded background replaces the placeholder on the next paint
+void PublishGLMapRenderer::backgroundLoaded(const QString& fileName, const QImage& image, const QString& chainFileName)
+{
+    if((_backgroundRequest != _backgroundGeneration) || (fileName != _backgroundFile) || (image.isNull()))
+        return;
+
+    setImage(image);
+    _backgroundChainFile = chainFileName;
+}
+
+// A cached chain of the background was found, it is uploaded on the next paint without decoding the file
+void PublishGLMapRenderer::backgroundChainLoaded(const QString& fileName, const QString& chainFileName, const QSize& imageSize)
+{
+    if((_backgroundRequest != _backgroundGeneration) || (fileName != _backgroundFile) || (chainFileName.isEmpty()))
+        return;
+
+    _image = QImage();
+    _backgroundChainFile = chainFileName;
+    _backgroundChainSize = imageSize;
+    _backgroundFullUpload = true;
+    _backgroundDirtyRects.clear();
+    _dirtyLayers |= DirtyLayer_Background;
+    scheduleRedraw();
+}
+
+void PublishGLMapRenderer::backgroundTileReady()
+{
+    _dirtyLayers |= DirtyLayer_Background;
+    scheduleRedraw();
+}
+
+// Upload a placeholder drawn at the size of the full image until the background is decoded
+void PublishGLMapRenderer::createPlaceholder(const QImage& placeholder, const QSize& fullSize)
+{
+    if((placeholder.isNull()) || (fullSize.isEmpty()) || (!_targetWidget) || (!_targetWidget->context()))
+        return;
+
+    QOpenGLFunctions *f = _targetWidget->context()->functions();
+    if(!f)
+        return;
+
+    QImage textureImage = ImageKernels::prepareForUpload(placeholder);
+    f->glGenTextures(1, &_placeholderTexture);
+    f->glBindTexture(GL_TEXTURE_2D, _placeholderTexture);
+    f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    f->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, textureImage.width(), textureImage.height(), 0, GL_RGBA, GL_UNSIGNED_BYTE, textureImage.constBits());
+    f->glBindTexture(GL_TEXTURE_2D, 0);
+    _placeholderSize = fullSize;
+}
+
+void PublishGLMapRenderer::cleanupPlaceholder()
+{
+    if((_placeholderTexture > 0) && (_targetWidget) && (_targetWidget->context()))
+    {
+        QOpenGLFunctions *f = _targetWidget->context()->functions();
+        if(f)
+            f->glDeleteTextures(1, &_placeholderTexture);
+    }
+
+    _placeholderTexture = 0;
+    _placeholderSize = QSize();
+}
+
+// Draw the background, or its placeholder while it is still being decoded
+void PublishGLMapRenderer::paintBackground(QOpenGLFunctions* f)
+{
+    if(_tiledBackground)
+    {
+        // The map is fit into the target like the video, so the level of detail follows the image to screen ratio.
+        // The projection spans the target size in scene units, one scene unit per logical pixel.
+        QSizeF sceneSize = QSizeF(_tiledBackground->getImageSize()).scaled(QSizeF(_targetSize), Qt::KeepAspectRatio);
+        _tiledBackground->setSceneRect(QRectF(-sceneSize.width() / 2.0, -sceneSize.height() / 2.0, sceneSize.width(), sceneSize.height()));
+
+        QRectF visibleRect(-_targetSize.width() / 2.0, -_targetSize.height() / 2.0, _targetSize.width(), _targetSize.height());
+        _tiledBackground->paintGL(_spriteBatch, &_stateCache, visibleRect, _targetWidget->devicePixelRatioF());
+        _stateCache.useProgram(_shaderProgram);
+        return;
+    }
+
+    uploadBackground(f);
+
+    GLuint texture = _backgroundTexture;
+    QSize textureSize = _backgroundTextureSize;
+    if(texture == 0)
+    {
+        texture = _placeholderTexture;
+        textureSize = _placeholderSize;
+    }
+
+    if((texture == 0) || (!_quad))
+        return;
+
+    QMatrix4x4 backgroundMatrix;
+    backgroundMatrix.scale(static_cast<float>(textureSize.width()), static_cast<float>(textureSize.height()), 1.f);
+    f->glUniformMatrix4fv(_modelLocation, 1, GL_FALSE, backgroundMatrix.constData());
+    _stateCache.bindVertexArray(_quad->getVAO());
+    _stateCache.bindTexture(GL_TEXTURE_2D, texture);
+    _quad->draw(f);
+}
+
+// Decode the background file, or find its mip chain, on the loader. Anything that changes the
+// background afterwards, including a newer request, makes the result of this one stale.
+void PublishGLMapRenderer::requestBackground(int maxTextureSize)
+{
+    _backgroundRequest = ++_backgroundGeneration;
+    _assetLoader->requestImage(_backgroundFile, QSize(maxTextureSize, maxTextureSize), true);
+}
+
+// Push the image to the background texture, either whole or only the rectangles changed since the last paint
+void PublishGLMapRenderer::uploadBackground(QOpenGLFunctions* f)
+{
+    if((!_backgroundFullUpload) && (_backgroundDirtyRects.isEmpty()))
+        return;
+
+    if((_image.isNull()) && (_backgroundChainFile.isEmpty()))
+    {
+        _backgroundFullUpload = false;
+        _backgroundDirtyRects.clear();
+        return;
+    }
+
+    if(_backgroundTexture == 0)
+    {
+        f->glGenTextures(1, &_backgroundTexture);
+        _stateCache.bindTexture(GL_TEXTURE_2D, _backgroundTexture);
+        f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+    else
+    {
+        _stateCache.bindTexture(GL_TEXTURE_2D, _backgroundTexture);
+    }
+
+    f->glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    const QSize imageSize = _image.isNull() ? _backgroundChainSize : _image.size();
+    if((_backgroundFullUpload) || (imageSize != _backgroundTextureSize))
+    {
+        // The unedited file comes with its mip chain, built on the loader thread and mapped from the cache file
+        if((!_backgroundChainFile.isEmpty()) && (PublishGLMipCache::uploadCached(f, _backgroundChainFile)))
+        {
+            f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+            _backgroundMipmapped = true;
+            _backgroundBytesUploaded += static_cast<quint64>(imageSize.width()) * static_cast<quint64>(imageSize.height()) * 4;
+        }
+        else if(_image.isNull())
+        {
+            // The chain was evicted since it was found, decode the file after all
+            qDebug() << "[PublishGLMapRenderer] Mip chain " << _backgroundChainFile << " is gone, decoding " << _backgroundFile;
+            _backgroundChainFile.clear();
+            _backgroundFullUpload = false;
+            GLint maxTextureSize = 0;
+            f->glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+            requestBackground(maxTextureSize);
+            return;
+        }
+        else
+        {
+            QImage textureImage = ImageKernels::prepareForUpload(_image);
+            f->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, textureImage.width(), textureImage.height(), 0, GL_RGBA, GL_UNSIGNED_BYTE, textureImage.constBits());
+            // Levels of an earlier chain no longer match level 0
+            f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+            f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            _backgroundMipmapped = false;
+            _backgroundBytesUploaded += textureImage.sizeInBytes();
+        }
+        _backgroundTextureSize = imageSize;
+        ++_backgroundUploadsFull;
+        cleanupPlaceholder();
+    }
+    else
+    {
+        // The texture rows are bottom up, so each rectangle is flipped into place
+        for(const QRect& dirtyRect : qAsConst(_backgroundDirtyRects))
+        {
+            QImage rectImage = ImageKernels::prepareForUpload(_image.copy(dirtyRect));
+            f->glTexSubImage2D(GL_TEXTURE_2D, 0, dirtyRect.x(), _backgroundTextureSize.height() - dirtyRect.y() - dirtyRect.height(),
+                               rectImage.width(), rectImage.height(), GL_RGBA, GL_UNSIGNED_BYTE, rectImage.constBits());
+            _backgroundBytesUploaded += rectImage.sizeInBytes();
+        }
+
+        // Edits only reach level 0, rebuild the smaller levels on the GPU
+        if(_backgroundMipmapped)
+            f->glGenerateMipmap(GL_TEXTURE_2D);
+        ++_backgroundUploadsPartial;
+    }
+
+    _backgroundFullUpload = false;
+    _backgroundDirtyRects.clear();
+}
+
+// Only images of the same size and format as the uploaded one can be updated by rects
+bool PublishGLMapRenderer::isBackgroundFullUploadNeeded(const QImage& image) const
+{
+    return (_image.isNull()) || (image.isNull()) || (_backgroundFullUpload) ||
+           (image.size() != _image.size()) || (image.format() != _image.format());
+}
+
+// Queue the changed rects of the new image for the next paint, or a full upload when there are too many
+void PublishGLMapRenderer::updateBackground(const QImage& image, const QVector<QRect>& changedRects, bool fullUpload)
+{
+    if((!fullUpload) && (changedRects.isEmpty()))
+    {
+        _image = image;
+        return;
+    }
+
+    if(fullUpload)
+    {
+        _backgroundFullUpload = true;
+    }
+    else
+    {
+        _backgroundDirtyRects.append(changedRects);
+        if(_backgroundDirtyRects.count() > BACKGROUND_MAX_DIRTY_RECTS)
+            _backgroundFullUpload = true;
+    }
+
+    _image = image;
+    _dirtyLayers |= DirtyLayer_Background;
+    scheduleRedraw();
+}
+
+// Fog changes are batched until the next paint
+void PublishGLMapRenderer::fogChanged()
+{
+    _dirtyLayers |= DirtyLayer_Fog;
+    scheduleRedraw();
+}
+
+// The fog mask covers the displayed map, centered like the video and the background
+QRectF PublishGLMapRenderer::getFogSceneRect() const
+{
+    QSize sceneSize = _videoPlayer ? _videoPlayer->getSize() : QSize();
+    if(sceneSize.isEmpty())
+        sceneSize = _backgroundTextureSize;
+
+    if(sceneSize.isEmpty())
+        return QRectF();
+
+    return QRectF(-sceneSize.width() / 2.0, -sceneSize.height() / 2.0, sceneSize.width(), sceneSize.height());
+}
+
+void PublishGLMapRenderer::setFogUniforms(QOpenGLFunctions* f)
+{
+    QRectF fogRect = getFogSceneRect();
+    bool fogEnabled = ((_fogLayer) && (_fogLayer->getTexture() > 0) && (!fogRect.isEmpty()));
+    f->glUniform1i(_fogEnabledLocation, fogEnabled ? 1 : 0);
+    if(!fogEnabled)
+        return;
+
+    f->glUniform4f(_fogRectLocation, static_cast<GLfloat>(fogRect.x()), static_cast<GLfloat>(fogRect.y()),
+                   static_cast<GLfloat>(fogRect.width()), static_cast<GLfloat>(fogRect.height()));
+    f->glUniform4f(_fogColorLocation, static_cast<GLfloat>(_fogColor.redF()), static_cast<GLfloat>(_fogColor.greenF()),
+                   static_cast<GLfloat>(_fogColor.blueF()), static_cast<GLfloat>(_fogColor.alphaF()));
+    _stateCache.activeTexture(GL_TEXTURE0 + FOG_TEXTURE_UNIT);
+    _stateCache.bindTexture(GL_TEXTURE_2D, _fogLayer->getTexture());
+}
+
+// Convert a scene rect (origin in the center, y up) into window pixels for glScissor
+QRect PublishGLMapRenderer::sceneToWindow(const QRectF& sceneRect) const
+{
+    qreal pixelRatio = _targetWidget ? _targetWidget->devicePixelRatioF() : 1.0;
+    QRectF windowRect(sceneRect.x() + (_targetSize.width() / 2), sceneRect.y() + (_targetSize.height() / 2),
+                      sceneRect.width(), sceneRect.height());
+    return QRectF(windowRect.topLeft() * pixelRatio, windowRect.size() * pixelRatio).toAlignedRect();
 }
@@ -2,18 +2,38 @@
 #define PUBLISHGLMAPRENDERER_H
 
 #include "publishglrenderer.h"
+#include "publishglspritebatch.h"
+#include "publishgltextureatlas.h"
+#include "videoplayerglloopcache.h"
 #include <QColor>
 #include <QImage>
+#include <QRectF>
+#include <QVector>
+#include <QPolygonF>
+
+class QOpenGLFunctions;
 
 class Map;
 class VideoPlayerGLPlayer;
-class BattleGLBackground;
-class PublishGLImage;
+class PublishGLAssetLoader;
+class PublishGLUnitQuad;
+class PublishGLTiledBackground;
+class PublishGLFogLayer;
 
 class PublishGLMapRenderer : public PublishGLRenderer
 {
     Q_OBJECT
 public:
+    enum DirtyLayer
+    {
+        DirtyLayer_None = 0x00,
+        DirtyLayer_Background = 0x01,
+        DirtyLayer_Video = 0x02,
+        DirtyLayer_Token = 0x04,
+        DirtyLayer_Fog = 0x08,
+        DirtyLayer_All = DirtyLayer_Background | DirtyLayer_Video | DirtyLayer_Token | DirtyLayer_Fog
+    };
+
     PublishGLMapRenderer(Map* map, QObject *parent = nullptr);
     virtual ~PublishGLMapRenderer() override;
 
@@ -31,23 +51,106 @@ public:
     const QImage& getImage() const;
     QColor getColor() const;
 
+    quint64 getPaintsAvoided() const;
+    quint64 getPaintsPartial() const;
+    quint64 getBackgroundBytesUploaded() const;
+
+    // Opt-in decoded frame cache for short looping videos, applies to players created after the call
+    VideoPlayerGLLoopCache::Storage getVideoLoopCache() const;
+    void setVideoLoopCache(VideoPlayerGLLoopCache::Storage storage);
+
+    // Fog of war, in mask pixel coordinates
+    PublishGLFogLayer* getFogLayer() const;
+    void enableFog(const QSize& maskSize);
+    void disableFog();
+    void setFogColor(const QColor& color);
+
+signals:
+    void screenshotReady(const QImage& image);
+
 public slots:
     void setImage(const QImage& image);
+    void setImage(const QImage& image, const QRect& dirtyRect);
+    void requestScreenshot();
+
+    void revealFog(const QVector<QPointF>& points, qreal radius);
+    void hideFog(const QVector<QPointF>& points, qreal radius);
+    void revealFogPolygon(const QPolygonF& polygon);
+    void hideFogPolygon(const QPolygonF& polygon);
+    void revealAllFog();
+    void hideAllFog();
+
+protected slots:
+    void backgroundLoaded(const QString& fileName, const QImage& image, const QString& chainFileName);
+    void backgroundChainLoaded(const QString& fileName, const QString& chainFileName, const QSize& imageSize);
+    void backgroundTileReady();
 //    void setColor(QColor color);
 
 protected:
     void setOrthoProjection();
+    QRectF getPartyTokenRect() const;
+    QRect sceneToWindow(const QRectF& sceneRect) const;
+    void createPlaceholder(const QImage& placeholder, const QSize& fullSize);
+    void cleanupPlaceholder();
+    void paintBackground(QOpenGLFunctions* f);
+    void requestBackground(int maxTextureSize);
+    void uploadBackground(QOpenGLFunctions* f);
+    bool isBackgroundFullUploadNeeded(const QImage& image) const;
+    void updateBackground(const QImage& image, const QVector<QRect>& changedRects, bool fullUpload);
+    void fogChanged();
+    QRectF getFogSceneRect() const;
+    void setFogUniforms(QOpenGLFunctions* f);
 
 private:
     Map* _map;
     QImage _image;
     VideoPlayerGLPlayer* _videoPlayer;
+    VideoPlayerGLLoopCache::Storage _videoLoopCache;
     QSize _targetSize;
     QColor _color;
     bool _initialized;
     unsigned int _shaderProgram;
-    BattleGLBackground* _backgroundObject;
-    PublishGLImage* _partyToken;
+    int _modelLocation;
+    int _fogRectLocation;
+    int _fogColorLocation;
+    int _fogEnabledLocation;
+    unsigned int _sceneBlock;
+    GLuint _backgroundTexture;
+    QSize _backgroundTextureSize;
+    bool _backgroundFullUpload;
+    QString _backgroundChainFile;
+    QSize _backgroundChainSize;
+    bool _backgroundMipmapped;
+    QVector<QRect> _backgroundDirtyRects;
+    quint64 _backgroundUploadsFull;
+    quint64 _backgroundUploadsPartial;
+    quint64 _backgroundBytesUploaded;
+    PublishGLTiledBackground* _tiledBackground;
+    PublishGLAssetLoader* _assetLoader;
+    quint64 _backgroundGeneration;
+    quint64 _backgroundRequest;
+    QString _backgroundFile;
+    PublishGLUnitQuad* _quad;
+    GLuint _placeholderTexture;
+    QSize _placeholderSize;
+    int _partyImageId;
+    QSizeF _partyTokenSize;
+
+    // Dirty tracking
+    int _dirtyLayers;
+    QRectF _paintedTokenRect;
+    quint64 _paintsTotal;
+    quint64 _paintsSkipped;
+    quint64 _paintsPartial;
+    bool _screenshotRequested;
+
+    // All tokens are drawn through one batch, sampling from the atlas of the share group
+    PublishGLSpriteBatch _spriteBatch;
+    PublishGLTextureAtlas* _textureAtlas;
+
+    // Fog of war mask, blended in the map shader
+    PublishGLFogLayer* _fogLayer;
+    QColor _fogColor;
 };
 
 #endif // PUBLISHGLMAPRENDERER_H
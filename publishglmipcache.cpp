@@ -0,0 +1,308 @@
+#include "publishglmipcache.h"
+#include "imagekernels.h"
+#include <QOpenGLFunctions>
+#include <QCryptographicHash>
+#include <QStandardPaths>
+#include <QImage>
+#include <QVector>
+#include <QDataStream>
+#include <QSaveFile>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QDirIterator>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QDebug>
+
+#ifndef GL_TEXTURE_MAX_LEVEL
+#define GL_TEXTURE_MAX_LEVEL 0x813D
+#endif
+
+// File layout: magic, version, format, level count, the SHA-1 of the source contents, then per level
+// width, height, data offset and data size, all through QDataStream, followed by the raw level data at
+// 16 byte aligned offsets
+const quint32 MIP_CACHE_MAGIC = 0x444D484D; // "DMHM"
+const quint32 MIP_CACHE_VERSION = 2;
+const int MIP_CACHE_HASH_SIZE = 20;
+const qint64 MIP_CACHE_HEADER_SIZE = (5 * sizeof(quint32)) + MIP_CACHE_HASH_SIZE;
+const qint64 MIP_CACHE_LEVEL_SIZE = (2 * sizeof(quint32)) + (2 * sizeof(quint64));
+const qint64 MIP_CACHE_ALIGNMENT = 16;
+const int MIP_CACHE_MAX_LEVELS = 32;
+const qint64 MIP_CACHE_DEFAULT_LIMIT = 4LL * 1024 * 1024 * 1024;
+
+QAtomicInteger<qint64> PublishGLMipCache::_cacheLimit(MIP_CACHE_DEFAULT_LIMIT);
+QMutex PublishGLMipCache::_trimLock;
+
+// Name of the cache file holding the chain of the file decoded to fit maxSize, empty if there is none yet.
+// imageSize returns the size of the first level.
+QString PublishGLMipCache::findCachedChain(const QString& fileName, const QSize& maxSize, QSize* imageSize)
+{
+    QByteArray cacheKey = getCacheKey(fileName, maxSize);
+    if(cacheKey.isEmpty())
+        return QString();
+
+    QString cacheFileName = getCacheFile(cacheKey);
+    QFile cacheFile(cacheFileName);
+    if(!cacheFile.open(QIODevice::ReadOnly))
+        return QString();
+
+    ChainHeader header;
+    if(!readHeader(cacheFile, header))
+        return QString();
+
+    if(imageSize)
+        *imageSize = QSize(static_cast<int>(header._widths.first()), static_cast<int>(header._heights.first()));
+
+    cacheFile.close();
+    touchCacheFile(cacheFileName);
+    return cacheFileName;
+}
+
+// Check the chain against the current contents of the source, a stale chain is deleted.
+// Reads the whole source, so keep it off the GUI thread.
+bool PublishGLMipCache::verifyCachedChain(const QString& fileName, const QString& cacheFileName)
+{
+    QFile cacheFile(cacheFileName);
+    if(!cacheFile.open(QIODevice::ReadOnly))
+        return false;
+
+    ChainHeader header;
+    if(!readHeader(cacheFile, header))
+        return false;
+
+    cacheFile.close();
+    if(header._contentHash == getContentHash(fileName))
+        return true;
+
+    qDebug() << "[PublishGLMipCache] Discarding the stale cache file " << cacheFileName << " of " << fileName;
+    QFile::remove(cacheFileName);
+    return false;
+}
+
+// Build the chain of the decoded file on the CPU and write it to the cache, returns the cache file name
+// or an empty string if it could not be written. Meant for the loader thread.
+QString PublishGLMipCache::storeChain(const QString& fileName, const QSize& maxSize, const QImage& image)
+{
+    QByteArray cacheKey = getCacheKey(fileName, maxSize);
+    QByteArray contentHash = getContentHash(fileName);
+    if((cacheKey.isEmpty()) || (contentHash.isEmpty()) || (image.isNull()))
+        return QString();
+
+    QElapsedTimer storeTimer;
+    storeTimer.start();
+
+    // Levels stop once a side reaches one pixel, GL_TEXTURE_MAX_LEVEL keeps the chain complete
+    QVector<QImage> levels;
+    levels.append(ImageKernels::prepareForUpload(image));
+    while(levels.count() < MIP_CACHE_MAX_LEVELS)
+    {
+        QImage nextLevel = ImageKernels::downscaleImage(levels.last());
+        if(nextLevel.isNull())
+            break;
+        levels.append(nextLevel);
+    }
+
+    QString cacheFileName = getCacheFile(cacheKey);
+    QDir().mkpath(QFileInfo(cacheFileName).absolutePath());
+    QSaveFile cacheFile(cacheFileName);
+    if(!cacheFile.open(QIODevice::WriteOnly))
+    {
+        qDebug() << "[PublishGLMipCache] Unable to write cache file " << cacheFileName;
+        return QString();
+    }
+
+    const qint64 headerSize = MIP_CACHE_HEADER_SIZE + (levels.count() * MIP_CACHE_LEVEL_SIZE);
+    qint64 offset = (headerSize + MIP_CACHE_ALIGNMENT - 1) & ~(MIP_CACHE_ALIGNMENT - 1);
+
+    QDataStream stream(&cacheFile);
+    stream << MIP_CACHE_MAGIC << MIP_CACHE_VERSION << static_cast<quint32>(GL_RGBA) << static_cast<quint32>(levels.count()) << contentHash;
+    QVector<qint64> levelOffsets;
+    for(const QImage& level : levels)
+    {
+        const qint64 levelSize = level.sizeInBytes();
+        stream << static_cast<quint32>(level.width()) << static_cast<quint32>(level.height()) << static_cast<quint64>(offset) << static_cast<quint64>(levelSize);
+        levelOffsets.append(offset);
+        offset = (offset + levelSize + MIP_CACHE_ALIGNMENT - 1) & ~(MIP_CACHE_ALIGNMENT - 1);
+    }
+
+    for(int i = 0; i < levels.count(); ++i)
+    {
+        cacheFile.write(QByteArray(static_cast<int>(levelOffsets.at(i) - cacheFile.pos()), '\0'));
+        const QImage& level = levels.at(i);
+        cacheFile.write(reinterpret_cast<const char*>(level.constBits()), level.sizeInBytes());
+    }
+
+    if(!cacheFile.commit())
+    {
+        qDebug() << "[PublishGLMipCache] Unable to write cache file " << cacheFileName;
+        return QString();
+    }
+
+    trimCache(cacheFileName);
+    qDebug() << "[PublishGLMipCache] Stored the mip chain of " << fileName << " in " << storeTimer.elapsed() << " ms";
+    return cacheFileName;
+}
+
+// Upload a cached chain to the bound GL_TEXTURE_2D straight from the mapped file
+bool PublishGLMipCache::uploadCached(QOpenGLFunctions* f, const QString& cacheFileName)
+{
+    if(!f)
+        return false;
+
+    QFile cacheFile(cacheFileName);
+    if(!cacheFile.open(QIODevice::ReadOnly))
+        return false;
+
+    ChainHeader header;
+    if(!readHeader(cacheFile, header))
+        return false;
+
+    uchar* mapping = cacheFile.map(0, cacheFile.size());
+    if(!mapping)
+        return false;
+
+    // The pages are faulted in level by level
+    const int levelCount = header._widths.count();
+    f->glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    for(int i = 0; i < levelCount; ++i)
+    {
+        f->glTexImage2D(GL_TEXTURE_2D, i, GL_RGBA, static_cast<GLsizei>(header._widths.at(i)), static_cast<GLsizei>(header._heights.at(i)),
+                        0, GL_RGBA, GL_UNSIGNED_BYTE, mapping + header._offsets.at(i));
+    }
+    f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levelCount - 1);
+
+    cacheFile.unmap(mapping);
+    cacheFile.close();
+    touchCacheFile(cacheFileName);
+    return true;
+}
+
+// The key only looks at the file system entry so it never reads the file, the chains carry a
+// content hash for verifyCachedChain. maxSize separates chains of the same file decoded smaller.
+QByteArray PublishGLMipCache::getCacheKey(const QString& fileName, const QSize& maxSize)
+{
+    QFileInfo sourceInfo(fileName);
+    if(!sourceInfo.isFile())
+        return QByteArray();
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(sourceInfo.absoluteFilePath().toUtf8());
+    hash.addData(QByteArray::number(sourceInfo.size()));
+    hash.addData(QByteArray::number(sourceInfo.lastModified().toMSecsSinceEpoch()));
+    if(maxSize.isValid())
+        hash.addData(QByteArray::number(maxSize.width()) + 'x' + QByteArray::number(maxSize.height()));
+
+    return hash.result().toHex();
+}
+
+// Directory for the mip chains and the background tile caches
+QString PublishGLMipCache::getCacheDirectory()
+{
+    return QDir(QStandardPaths::writableLocation(QStandardPaths::CacheLocation)).filePath(QString("textures"));
+}
+
+qint64 PublishGLMipCache::getCacheLimit()
+{
+    return _cacheLimit.loadAcquire();
+}
+
+void PublishGLMipCache::setCacheLimit(qint64 bytes)
+{
+    _cacheLimit.storeRelease(bytes);
+    trimCache(QString());
+}
+
+// Mark a cache file as used, the modification time orders the files for eviction
+void PublishGLMipCache::touchCacheFile(const QString& cacheFileName)
+{
+    QFile cacheFile(cacheFileName);
+    if(cacheFile.open(QIODevice::ReadWrite))
+        cacheFile.setFileTime(QDateTime::currentDateTimeUtc(), QFileDevice::FileModificationTime);
+}
+
+// Delete the least recently used cache files until the directory is under the limit. The given
+// file was just written or used and is never deleted.
+void PublishGLMipCache::trimCache(const QString& keepFileName)
+{
+    QMutexLocker trimLocker(&_trimLock);
+
+    QFileInfoList cacheFiles = QDir(getCacheDirectory()).entryInfoList(QDir::Files, QDir::Time | QDir::Reversed);
+    qint64 totalSize = 0;
+    for(const QFileInfo& cacheFile : qAsConst(cacheFiles))
+        totalSize += cacheFile.size();
+
+    const qint64 cacheLimit = getCacheLimit();
+    for(const QFileInfo& cacheFile : qAsConst(cacheFiles))
+    {
+        if(totalSize <= cacheLimit)
+            break;
+
+        if(cacheFile.absoluteFilePath() == QFileInfo(keepFileName).absoluteFilePath())
+            continue;
+
+        if(QFile::remove(cacheFile.absoluteFilePath()))
+        {
+            qDebug() << "[PublishGLMipCache] Evicted " << cacheFile.fileName() << " (" << cacheFile.size() << " bytes)";
+            totalSize -= cacheFile.size();
+        }
+    }
+}
+
+QString PublishGLMipCache::getCacheFile(const QByteArray& cacheKey)
+{
+    return QDir(getCacheDirectory()).filePath(QString::fromLatin1(cacheKey) + QString(".mip"));
+}
+
+QByteArray PublishGLMipCache::getContentHash(const QString& fileName)
+{
+    QFile sourceFile(fileName);
+    if(!sourceFile.open(QIODevice::ReadOnly))
+        return QByteArray();
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    if(!hash.addData(&sourceFile))
+        return QByteArray();
+
+    return hash.result();
+}
+
+// Read and check the header of an open cache file, a file that does not match is deleted
+bool PublishGLMipCache::readHeader(QFile& cacheFile, ChainHeader& header)
+{
+    QDataStream stream(&cacheFile);
+    quint32 magic = 0;
+    quint32 version = 0;
+    quint32 format = 0;
+    quint32 levelCount = 0;
+    stream >> magic >> version >> format >> levelCount >> header._contentHash;
+    if((stream.status() != QDataStream::Ok) || (magic != MIP_CACHE_MAGIC) || (version != MIP_CACHE_VERSION) ||
+       (format != GL_RGBA) || (levelCount == 0) || (levelCount > static_cast<quint32>(MIP_CACHE_MAX_LEVELS)) ||
+       (header._contentHash.size() != MIP_CACHE_HASH_SIZE))
+    {
+        qDebug() << "[PublishGLMipCache] Discarding incompatible cache file " << cacheFile.fileName();
+        cacheFile.close();
+        QFile::remove(cacheFile.fileName());
+        return false;
+    }
+
+    header._widths.resize(static_cast<int>(levelCount));
+    header._heights.resize(static_cast<int>(levelCount));
+    header._offsets.resize(static_cast<int>(levelCount));
+    header._sizes.resize(static_cast<int>(levelCount));
+    for(int i = 0; i < static_cast<int>(levelCount); ++i)
+    {
+        stream >> header._widths[i] >> header._heights[i] >> header._offsets[i] >> header._sizes[i];
+        if((stream.status() != QDataStream::Ok) ||
+           (header._offsets.at(i) + header._sizes.at(i) > static_cast<quint64>(cacheFile.size())) ||
+           (header._sizes.at(i) != static_cast<quint64>(header._widths.at(i)) * header._heights.at(i) * 4))
+        {
+            qDebug() << "[PublishGLMipCache] Discarding truncated cache file " << cacheFile.fileName();
+            cacheFile.close();
+            QFile::remove(cacheFile.fileName());
+            return false;
+        }
+    }
+
+    return true;
+}
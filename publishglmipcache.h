@@ -0,0 +1,56 @@
+#ifndef PUBLISHGLMIPCACHE_H
+#define PUBLISHGLMIPCACHE_H
+
+#include <QByteArray>
+#include <QString>
+#include <QMutex>
+#include <QAtomicInteger>
+#include <QImage>
+#include <QVector>
+
+class QOpenGLFunctions;
+class QFile;
+
+// Persistent cache of upload ready RGBA mip chains, keyed by the path, size
+// and modification time of the source file. The chains are looked up, built
+// and written on a loader thread, and each one records a hash of the source
+// contents so the loader can catch a file changed behind an unchanged time
+// stamp. A cached chain is memory mapped and uploaded level by level straight
+// from the mapping, so reopening a known image skips the decode, the format
+// conversion and the mipmap generation. The cache directory is shared with
+// the background tile caches and kept under a size limit, dropping the least
+// recently used files first.
+class PublishGLMipCache
+{
+public:
+    static QString findCachedChain(const QString& fileName, const QSize& maxSize, QSize* imageSize = nullptr);
+    static bool verifyCachedChain(const QString& fileName, const QString& cacheFileName);
+    static QString storeChain(const QString& fileName, const QSize& maxSize, const QImage& image);
+    static bool uploadCached(QOpenGLFunctions* f, const QString& cacheFileName);
+    static QByteArray getCacheKey(const QString& fileName, const QSize& maxSize = QSize());
+
+    static QString getCacheDirectory();
+    static qint64 getCacheLimit();
+    static void setCacheLimit(qint64 bytes);
+    static void touchCacheFile(const QString& cacheFileName);
+    static void trimCache(const QString& keepFileName);
+
+private:
+    struct ChainHeader
+    {
+        QByteArray _contentHash;
+        QVector<quint32> _widths;
+        QVector<quint32> _heights;
+        QVector<quint64> _offsets;
+        QVector<quint64> _sizes;
+    };
+
+    static QString getCacheFile(const QByteArray& cacheKey);
+    static QByteArray getContentHash(const QString& fileName);
+    static bool readHeader(QFile& cacheFile, ChainHeader& header);
+
+    static QAtomicInteger<qint64> _cacheLimit;
+    static QMutex _trimLock;
+};
+
+#endif // PUBLISHGLMIPCACHE_H
@@ -1,10 +1,27 @@
 #include "publishglrenderer.h"
+#include "publishglshadermanager.h"
+#include "publishgltextureatlas.h"
 #include <QOpenGLWidget>
 #include <QOpenGLContext>
+#include <QGuiApplication>
+#include <QScreen>
+#include <QWindow>
+#include <QTimer>
+#include <QDebug>
+
+// Log the redraw counters every REDRAW_STATS_INTERVAL requests
+//#define PUBLISHGL_REDRAW_STATS
+
+const int REDRAW_STATS_INTERVAL = 600;
 
 PublishGLRenderer::PublishGLRenderer(QObject *parent) :
     QObject(parent),
-    _targetWidget(nullptr)
+    _targetWidget(nullptr),
+    _stateCache(),
+    _redrawPending(0),
+    _redrawsRequested(0),
+    _redrawsCoalesced(0),
+    _lastRedraw()
 {
 }
 
@@ -43,3 +60,87 @@ void PublishGLRenderer::setBackgroundColor(const QColor& color)
 {
     Q_UNUSED(color);
 }
+
+quint64 PublishGLRenderer::getRedrawsRequested() const
+{
+    return static_cast<quint64>(_redrawsRequested.loadAcquire());
+}
+
+// Number of redraw requests merged into an already pending update
+quint64 PublishGLRenderer::getRedrawsCoalesced() const
+{
+    return static_cast<quint64>(_redrawsCoalesced.loadAcquire());
+}
+
+void PublishGLRenderer::scheduleRedraw()
+{
+    _redrawsRequested.fetchAndAddRelaxed(1);
+
+    if(!_redrawPending.testAndSetOrdered(0, 1))
+    {
+        _redrawsCoalesced.fetchAndAddRelaxed(1);
+        return;
+    }
+
+    QMetaObject::invokeMethod(this, "flushRedraw", Qt::QueuedConnection);
+}
+
+void PublishGLRenderer::flushRedraw()
+{
+    // Pace updates to the refresh rate of the display
+    int refreshInterval = getRefreshInterval();
+    if(_lastRedraw.isValid())
+    {
+        qint64 elapsed = _lastRedraw.elapsed();
+        if(elapsed < refreshInterval)
+        {
+            QTimer::singleShot(refreshInterval - static_cast<int>(elapsed), Qt::PreciseTimer, this, &PublishGLRenderer::flushRedraw);
+            return;
+        }
+    }
+
+    _lastRedraw.start();
+    _redrawPending.storeRelease(0);
+
+#ifdef PUBLISHGL_REDRAW_STATS
+    int requested = _redrawsRequested.loadAcquire();
+    if((requested > 0) && ((requested % REDRAW_STATS_INTERVAL) == 0))
+        qDebug() << "[PublishGLRenderer] Redraws requested: " << requested << ", coalesced: " << _redrawsCoalesced.loadAcquire();
+#endif
+
+    emit updateWidget();
+}
+
+// Milliseconds between two refreshes of the screen showing the target widget
+int PublishGLRenderer::getRefreshInterval() const
+{
+    QScreen* screen = nullptr;
+    if((_targetWidget) && (_targetWidget->window()) && (_targetWidget->window()->windowHandle()))
+        screen = _targetWidget->window()->windowHandle()->screen();
+    if(!screen)
+        screen = QGuiApplication::primaryScreen();
+
+    qreal refreshRate = screen ? screen->refreshRate() : 60.0;
+    if(refreshRate <= 0.0)
+        refreshRate = 60.0;
+
+    return qMax(1, static_cast<int>(1000.0 / refreshRate));
+}
+
+// Shader programs shared by all renderers of the target widget's share group
+PublishGLShaderManager* PublishGLRenderer::getShaderManager() const
+{
+    if(!_targetWidget)
+        return nullptr;
+
+    return PublishGLShaderManager::getManager(_targetWidget->context());
+}
+
+// Token and icon atlas shared by all renderers of the target widget's share group
+PublishGLTextureAtlas* PublishGLRenderer::getTextureAtlas() const
+{
+    if(!_targetWidget)
+        return nullptr;
+
+    return PublishGLTextureAtlas::getAtlas(_targetWidget->context());
+}
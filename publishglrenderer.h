@@ -2,8 +2,13 @@
 #define PUBLISHGLRENDERER_H
 
 #include <QObject>
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include "publishglstatecache.h"
 
 class QOpenGLWidget;
+class PublishGLShaderManager;
+class PublishGLTextureAtlas;
 
 class PublishGLRenderer : public QObject
 {
@@ -22,6 +27,9 @@ public:
     virtual void updateRender();
     virtual void setBackgroundColor(const QColor& color);
 
+    quint64 getRedrawsRequested() const;
+    quint64 getRedrawsCoalesced() const;
+
     // Standard OpenGL calls
     virtual void initializeGL() = 0;
     virtual void resizeGL(int w, int h) = 0;
@@ -31,8 +39,26 @@ signals:
     void updateWidget();
     void deactivated();
 
+public slots:
+    // Thread safe, collapses pending requests into at most one update per display refresh
+    void scheduleRedraw();
+
+protected slots:
+    void flushRedraw();
+
 protected:
+    int getRefreshInterval() const;
+    PublishGLShaderManager* getShaderManager() const;
+    PublishGLTextureAtlas* getTextureAtlas() const;
+
     QOpenGLWidget* _targetWidget;
+    PublishGLStateCache _stateCache;
+
+    // Redraw scheduling
+    QAtomicInt _redrawPending;
+    QAtomicInt _redrawsRequested;
+    QAtomicInt _redrawsCoalesced;
+    QElapsedTimer _lastRedraw;
 
 };
 
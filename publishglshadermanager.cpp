@@ -0,0 +1,326 @@
+#include "publishglshadermanager.h"
+#include <QOpenGLContext>
+#include <QOpenGLExtraFunctions>
+#include <QCryptographicHash>
+#include <QStandardPaths>
+#include <QDataStream>
+#include <QFile>
+#include <QSaveFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QDebug>
+
+#ifndef GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#endif
+#ifndef GL_PROGRAM_BINARY_LENGTH
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#endif
+#ifndef GL_NUM_PROGRAM_BINARY_FORMATS
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#endif
+
+const quint32 SHADER_CACHE_MAGIC = 0x444D4853; // "DMHS"
+const quint32 SHADER_CACHE_VERSION = 1;
+
+typedef void (QOPENGLF_APIENTRYP MaxShaderCompilerThreadsFunction)(GLuint count);
+
+QHash<QOpenGLContextGroup*, PublishGLShaderManager*> PublishGLShaderManager::_managers;
+
+PublishGLShaderManager::PublishGLShaderManager(QOpenGLContextGroup* group) :
+    QObject(group),
+    _group(group),
+    _programs(),
+    _parallelCompileChecked(false),
+    _binaryFormatCount(-1)
+{
+    qDebug() << "[PublishGLShaderManager] Creating shader manager for share group " << group;
+}
+
+PublishGLShaderManager::~PublishGLShaderManager()
+{
+    // The programs themselves are destroyed together with the share group
+    _managers.remove(_group);
+}
+
+// The manager shared by all contexts of the context's share group
+PublishGLShaderManager* PublishGLShaderManager::getManager(QOpenGLContext* context)
+{
+    if((!context) || (!context->shareGroup()))
+        return nullptr;
+
+    PublishGLShaderManager* manager = _managers.value(context->shareGroup(), nullptr);
+    if(!manager)
+    {
+        manager = new PublishGLShaderManager(context->shareGroup());
+        _managers.insert(context->shareGroup(), manager);
+    }
+
+    return manager;
+}
+
+// Start building a program without waiting for the result, so drivers with parallel compilation
+// can work on several programs at once. A context of the share group must be current.
+void PublishGLShaderManager::requestProgram(const QString& name, const QByteArray& vertexSource, const QByteArray& fragmentSource)
+{
+    if(_programs.contains(name))
+        return;
+
+    QOpenGLContext* context = QOpenGLContext::currentContext();
+    QOpenGLExtraFunctions* e = context ? context->extraFunctions() : nullptr;
+    if(!e)
+        return;
+
+    enableParallelCompile();
+
+    ProgramEntry entry;
+    entry._program = e->glCreateProgram();
+    entry._vertexShader = 0;
+    entry._fragmentShader = 0;
+    entry._cacheKey = getCacheKey(vertexSource, fragmentSource);
+    entry._pending = false;
+
+    if(loadBinary(entry))
+    {
+        qDebug() << "[PublishGLShaderManager] Program " << name << " loaded from the binary cache";
+        _programs.insert(name, entry);
+        return;
+    }
+
+    const char* vertexData = vertexSource.constData();
+    entry._vertexShader = e->glCreateShader(GL_VERTEX_SHADER);
+    e->glShaderSource(entry._vertexShader, 1, &vertexData, nullptr);
+    e->glCompileShader(entry._vertexShader);
+
+    const char* fragmentData = fragmentSource.constData();
+    entry._fragmentShader = e->glCreateShader(GL_FRAGMENT_SHADER);
+    e->glShaderSource(entry._fragmentShader, 1, &fragmentData, nullptr);
+    e->glCompileShader(entry._fragmentShader);
+
+    e->glAttachShader(entry._program, entry._vertexShader);
+    e->glAttachShader(entry._program, entry._fragmentShader);
+    if(isBinaryCacheSupported())
+        e->glProgramParameteri(entry._program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    e->glLinkProgram(entry._program);
+
+    // Status is only queried in getProgram, which is where the driver may block
+    entry._pending = true;
+    _programs.insert(name, entry);
+}
+
+// The linked program, or 0 if it is unknown or failed to build
+GLuint PublishGLShaderManager::getProgram(const QString& name)
+{
+    if(!_programs.contains(name))
+        return 0;
+
+    ProgramEntry& entry = _programs[name];
+    if((entry._pending) && (!finalizeProgram(name, entry)))
+    {
+        _programs.remove(name);
+        return 0;
+    }
+
+    return entry._program;
+}
+
+GLuint PublishGLShaderManager::getProgram(const QString& name, const QByteArray& vertexSource, const QByteArray& fragmentSource)
+{
+    requestProgram(name, vertexSource, fragmentSource);
+    return getProgram(name);
+}
+
+void PublishGLShaderManager::enableParallelCompile()
+{
+    if(_parallelCompileChecked)
+        return;
+
+    _parallelCompileChecked = true;
+
+    QOpenGLContext* context = QOpenGLContext::currentContext();
+    if(!context)
+        return;
+
+    MaxShaderCompilerThreadsFunction maxThreads = nullptr;
+    if(context->hasExtension(QByteArrayLiteral("GL_KHR_parallel_shader_compile")))
+        maxThreads = reinterpret_cast<MaxShaderCompilerThreadsFunction>(context->getProcAddress("glMaxShaderCompilerThreadsKHR"));
+    else if(context->hasExtension(QByteArrayLiteral("GL_ARB_parallel_shader_compile")))
+        maxThreads = reinterpret_cast<MaxShaderCompilerThreadsFunction>(context->getProcAddress("glMaxShaderCompilerThreadsARB"));
+
+    if(maxThreads)
+    {
+        qDebug() << "[PublishGLShaderManager] Enabling parallel shader compilation";
+        maxThreads(0xFFFFFFFF);
+    }
+}
+
+// Binaries are only valid for the same driver and the same sources
+QByteArray PublishGLShaderManager::getCacheKey(const QByteArray& vertexSource, const QByteArray& fragmentSource) const
+{
+    QOpenGLContext* context = QOpenGLContext::currentContext();
+    QOpenGLFunctions* f = context ? context->functions() : nullptr;
+    if(!f)
+        return QByteArray();
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(reinterpret_cast<const char*>(f->glGetString(GL_VENDOR)));
+    hash.addData(reinterpret_cast<const char*>(f->glGetString(GL_RENDERER)));
+    hash.addData(reinterpret_cast<const char*>(f->glGetString(GL_VERSION)));
+    hash.addData(vertexSource);
+    hash.addData(fragmentSource);
+    return hash.result().toHex();
+}
+
+// Program binaries need GL 4.1, GLES 3.0 or ARB_get_program_binary. Without a binary format the
+// binary entry points may not be resolved at all, so none of them may be called.
+bool PublishGLShaderManager::isBinaryCacheSupported()
+{
+    if(_binaryFormatCount < 0)
+    {
+        QOpenGLContext* context = QOpenGLContext::currentContext();
+        if(!context)
+            return false;
+
+        GLint formatCount = 0;
+        if((context->hasExtension(QByteArrayLiteral("GL_ARB_get_program_binary"))) ||
+           (context->format().version() >= (context->isOpenGLES() ? qMakePair(3, 0) : qMakePair(4, 1))))
+        {
+            context->functions()->glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+        }
+
+        _binaryFormatCount = formatCount;
+        qDebug() << "[PublishGLShaderManager] Program binary formats: " << _binaryFormatCount;
+    }
+
+    return _binaryFormatCount > 0;
+}
+
+QString PublishGLShaderManager::getCacheFile(const QByteArray& cacheKey) const
+{
+    QDir cacheDir(QStandardPaths::writableLocation(QStandardPaths::CacheLocation));
+    return cacheDir.filePath(QString("shaders/") + QString::fromLatin1(cacheKey) + QString(".bin"));
+}
+
+bool PublishGLShaderManager::loadBinary(ProgramEntry& entry)
+{
+    QOpenGLContext* context = QOpenGLContext::currentContext();
+    QOpenGLExtraFunctions* e = context ? context->extraFunctions() : nullptr;
+    if((!e) || (entry._cacheKey.isEmpty()) || (!isBinaryCacheSupported()))
+        return false;
+
+    QFile cacheFile(getCacheFile(entry._cacheKey));
+    if(!cacheFile.open(QIODevice::ReadOnly))
+        return false;
+
+    QDataStream stream(&cacheFile);
+    quint32 magic = 0;
+    quint32 version = 0;
+    quint32 binaryFormat = 0;
+    QByteArray binary;
+    stream >> magic >> version >> binaryFormat >> binary;
+    cacheFile.close();
+
+    if((stream.status() != QDataStream::Ok) || (magic != SHADER_CACHE_MAGIC) || (version != SHADER_CACHE_VERSION) || (binary.isEmpty()))
+        return false;
+
+    e->glProgramBinary(entry._program, static_cast<GLenum>(binaryFormat), binary.constData(), binary.size());
+
+    GLint success = 0;
+    e->glGetProgramiv(entry._program, GL_LINK_STATUS, &success);
+    if(!success)
+    {
+        // Stale binary, e.g. after a driver update that kept the version string
+        qDebug() << "[PublishGLShaderManager] Discarding rejected program binary " << cacheFile.fileName();
+        QFile::remove(cacheFile.fileName());
+        return false;
+    }
+
+    return true;
+}
+
+void PublishGLShaderManager::saveBinary(const ProgramEntry& entry)
+{
+    QOpenGLContext* context = QOpenGLContext::currentContext();
+    QOpenGLExtraFunctions* e = context ? context->extraFunctions() : nullptr;
+    if((!e) || (entry._cacheKey.isEmpty()) || (!isBinaryCacheSupported()))
+        return;
+
+    GLint binaryLength = 0;
+    e->glGetProgramiv(entry._program, GL_PROGRAM_BINARY_LENGTH, &binaryLength);
+    if(binaryLength <= 0)
+        return;
+
+    QByteArray binary(binaryLength, Qt::Uninitialized);
+    GLenum binaryFormat = 0;
+    e->glGetProgramBinary(entry._program, binaryLength, nullptr, &binaryFormat, binary.data());
+
+    QString cacheFileName = getCacheFile(entry._cacheKey);
+    QDir().mkpath(QFileInfo(cacheFileName).absolutePath());
+
+    // Written to a temporary file first, so a crash or a second instance never leaves a truncated binary behind
+    QSaveFile cacheFile(cacheFileName);
+    if(!cacheFile.open(QIODevice::WriteOnly))
+    {
+        qDebug() << "[PublishGLShaderManager] Unable to write program binary " << cacheFileName;
+        return;
+    }
+
+    QDataStream stream(&cacheFile);
+    stream << SHADER_CACHE_MAGIC << SHADER_CACHE_VERSION << static_cast<quint32>(binaryFormat) << binary;
+    if(!cacheFile.commit())
+        qDebug() << "[PublishGLShaderManager] Unable to write program binary " << cacheFileName;
+}
+
+// Check the results of a compile started in requestProgram
+bool PublishGLShaderManager::finalizeProgram(const QString& name, ProgramEntry& entry)
+{
+    QOpenGLContext* context = QOpenGLContext::currentContext();
+    QOpenGLExtraFunctions* e = context ? context->extraFunctions() : nullptr;
+    if(!e)
+        return false;
+
+    entry._pending = false;
+
+    int success;
+    char infoLog[512];
+    e->glGetShaderiv(entry._vertexShader, GL_COMPILE_STATUS, &success);
+    if(!success)
+    {
+        e->glGetShaderInfoLog(entry._vertexShader, 512, NULL, infoLog);
+        qDebug() << "[PublishGLShaderManager] ERROR::SHADER::VERTEX::COMPILATION_FAILED for " << name << ": " << infoLog;
+    }
+    else
+    {
+        e->glGetShaderiv(entry._fragmentShader, GL_COMPILE_STATUS, &success);
+        if(!success)
+        {
+            e->glGetShaderInfoLog(entry._fragmentShader, 512, NULL, infoLog);
+            qDebug() << "[PublishGLShaderManager] ERROR::SHADER::FRAGMENT::COMPILATION_FAILED for " << name << ": " << infoLog;
+        }
+        else
+        {
+            e->glGetProgramiv(entry._program, GL_LINK_STATUS, &success);
+            if(!success)
+            {
+                e->glGetProgramInfoLog(entry._program, 512, NULL, infoLog);
+                qDebug() << "[PublishGLShaderManager] ERROR::SHADER::PROGRAM::COMPILATION_FAILED for " << name << ": " << infoLog;
+            }
+        }
+    }
+
+    e->glDeleteShader(entry._vertexShader);
+    e->glDeleteShader(entry._fragmentShader);
+    entry._vertexShader = 0;
+    entry._fragmentShader = 0;
+
+    if(!success)
+    {
+        e->glDeleteProgram(entry._program);
+        entry._program = 0;
+        return false;
+    }
+
+    qDebug() << "[PublishGLShaderManager] Program " << name << " compiled and linked";
+    saveBinary(entry);
+    return true;
+}
@@ -0,0 +1,55 @@
+#ifndef PUBLISHGLSHADERMANAGER_H
+#define PUBLISHGLSHADERMANAGER_H
+
+#include <QObject>
+#include <QHash>
+#include <QByteArray>
+#include <qopengl.h>
+
+class QOpenGLContext;
+class QOpenGLContextGroup;
+
+// Compiles each shader program once per context share group and keeps the
+// program binaries in an on-disk cache keyed by driver and source, so
+// renderers that are recreated on every activation do not pay for shader
+// compilation again.
+class PublishGLShaderManager : public QObject
+{
+    Q_OBJECT
+public:
+    static PublishGLShaderManager* getManager(QOpenGLContext* context);
+
+    void requestProgram(const QString& name, const QByteArray& vertexSource, const QByteArray& fragmentSource);
+    GLuint getProgram(const QString& name);
+    GLuint getProgram(const QString& name, const QByteArray& vertexSource, const QByteArray& fragmentSource);
+
+protected:
+    explicit PublishGLShaderManager(QOpenGLContextGroup* group);
+    virtual ~PublishGLShaderManager() override;
+
+    struct ProgramEntry
+    {
+        GLuint _program;
+        GLuint _vertexShader;
+        GLuint _fragmentShader;
+        QByteArray _cacheKey;
+        bool _pending;
+    };
+
+    void enableParallelCompile();
+    bool isBinaryCacheSupported();
+    QByteArray getCacheKey(const QByteArray& vertexSource, const QByteArray& fragmentSource) const;
+    QString getCacheFile(const QByteArray& cacheKey) const;
+    bool loadBinary(ProgramEntry& entry);
+    void saveBinary(const ProgramEntry& entry);
+    bool finalizeProgram(const QString& name, ProgramEntry& entry);
+
+    QOpenGLContextGroup* _group;
+    QHash<QString, ProgramEntry> _programs;
+    bool _parallelCompileChecked;
+    int _binaryFormatCount;
+
+    static QHash<QOpenGLContextGroup*, PublishGLShaderManager*> _managers;
+};
+
+#endif // PUBLISHGLSHADERMANAGER_H
@@ -0,0 +1,275 @@
+#include "publishglspritebatch.h"
+#include "publishglshadermanager.h"
+#include "publishglstatecache.h"
+#include "publishglunitquad.h"
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#include <QOpenGLExtraFunctions>
+#include <QDebug>
+#include <cstddef>
+
+const GLuint SPRITE_POSITION_ATTRIBUTE = 3;
+const GLuint SPRITE_SCALE_ATTRIBUTE = 4;
+const GLuint SPRITE_ROTATION_ATTRIBUTE = 5;
+const GLuint SPRITE_TINT_ATTRIBUTE = 6;
+const GLuint SPRITE_TEXTURERECT_ATTRIBUTE = 7;
+const int SPRITE_INITIAL_CAPACITY = 64;
+
+const char* const SPRITE_VERTEX_SHADER = "#version 330 core\n"
+    "layout (location = 0) in vec2 aPos;\n"
+    "layout (location = 2) in vec2 aTexCoord;\n"
+    "layout (location = 3) in vec2 iPosition;\n"
+    "layout (location = 4) in vec2 iScale;\n"
+    "layout (location = 5) in float iRotation;\n"
+    "layout (location = 6) in vec4 iTint;\n"
+    "layout (location = 7) in vec4 iTextureRect;\n"
+    "layout (std140) uniform SceneBlock\n"
+    "{\n"
+    "    mat4 view;\n"
+    "    mat4 projection;\n"
+    "};\n"
+    "out vec2 TexCoord;\n"
+    "out vec4 Tint;\n"
+    "void main()\n"
+    "{\n"
+    "   vec2 scaled = aPos * iScale;\n"
+    "   float s = sin(iRotation);\n"
+    "   float c = cos(iRotation);\n"
+    "   vec2 rotated = vec2(c * scaled.x - s * scaled.y, s * scaled.x + c * scaled.y);\n"
+    "   gl_Position = projection * view * vec4(rotated + iPosition, 0.0, 1.0);\n"
+    "   TexCoord = iTextureRect.xy + aTexCoord * iTextureRect.zw;\n"
+    "   Tint = iTint;\n"
+    "}\0";
+
+const char* const SPRITE_FRAGMENT_SHADER = "#version 330 core\n"
+    "out vec4 FragColor;\n"
+    "in vec2 TexCoord;\n"
+    "in vec4 Tint;\n"
+    "uniform sampler2D texture1;\n"
+    "void main()\n"
+    "{\n"
+    "    FragColor = texture(texture1, TexCoord) * Tint;\n"
+    "}\0";
+
+PublishGLSpriteBatch::PublishGLSpriteBatch() :
+    _context(nullptr),
+    _quad(nullptr),
+    _program(0),
+    _VAO(0),
+    _instanceBuffer(0),
+    _instanceCapacity(0),
+    _instances(),
+    _textures(),
+    _drawCalls(0)
+{
+}
+
+PublishGLSpriteBatch::~PublishGLSpriteBatch()
+{
+    cleanup();
+}
+
+// Start compiling the sprite program ahead of initialize, a context of the share group must be current
+void PublishGLSpriteBatch::requestProgram(PublishGLShaderManager* shaderManager)
+{
+    if(shaderManager)
+        shaderManager->requestProgram(QString("sprite"), SPRITE_VERTEX_SHADER, SPRITE_FRAGMENT_SHADER);
+}
+
+// Set up the program and vertex arrays, the context must be current
+bool PublishGLSpriteBatch::initialize(QOpenGLContext* context, PublishGLShaderManager* shaderManager, GLuint sceneBlockBinding)
+{
+    if(isInitialized())
+        return true;
+
+    if((!context) || (!shaderManager))
+        return false;
+
+    QOpenGLFunctions *f = context->functions();
+    QOpenGLExtraFunctions *e = context->extraFunctions();
+    if((!f) || (!e))
+        return false;
+
+    _program = shaderManager->getProgram(QString("sprite"), SPRITE_VERTEX_SHADER, SPRITE_FRAGMENT_SHADER);
+    if(_program == 0)
+    {
+        qDebug() << "[PublishGLSpriteBatch] ERROR: sprite shader program not available";
+        return false;
+    }
+
+    f->glUseProgram(_program);
+    f->glUniform1i(f->glGetUniformLocation(_program, "texture1"), 0);
+    e->glUniformBlockBinding(_program, e->glGetUniformBlockIndex(_program, "SceneBlock"), sceneBlockBinding);
+
+    _context = context;
+    _quad = PublishGLUnitQuad::acquire(context);
+    if(!_quad)
+        return false;
+
+    f->glGenBuffers(1, &_instanceBuffer);
+    f->glBindBuffer(GL_ARRAY_BUFFER, _instanceBuffer);
+    _instanceCapacity = SPRITE_INITIAL_CAPACITY;
+    f->glBufferData(GL_ARRAY_BUFFER, _instanceCapacity * static_cast<GLsizeiptr>(sizeof(SpriteInstance)), nullptr, GL_STREAM_DRAW);
+
+    e->glGenVertexArrays(1, &_VAO);
+    e->glBindVertexArray(_VAO);
+    _quad->setupAttributes(f);
+
+    f->glEnableVertexAttribArray(SPRITE_POSITION_ATTRIBUTE);
+    f->glEnableVertexAttribArray(SPRITE_SCALE_ATTRIBUTE);
+    f->glEnableVertexAttribArray(SPRITE_ROTATION_ATTRIBUTE);
+    f->glEnableVertexAttribArray(SPRITE_TINT_ATTRIBUTE);
+    f->glEnableVertexAttribArray(SPRITE_TEXTURERECT_ATTRIBUTE);
+    e->glVertexAttribDivisor(SPRITE_POSITION_ATTRIBUTE, 1);
+    e->glVertexAttribDivisor(SPRITE_SCALE_ATTRIBUTE, 1);
+    e->glVertexAttribDivisor(SPRITE_ROTATION_ATTRIBUTE, 1);
+    e->glVertexAttribDivisor(SPRITE_TINT_ATTRIBUTE, 1);
+    e->glVertexAttribDivisor(SPRITE_TEXTURERECT_ATTRIBUTE, 1);
+    setInstanceAttributes(0);
+
+    e->glBindVertexArray(0);
+
+    return true;
+}
+
+// Release the GL objects, the context must be current
+void PublishGLSpriteBatch::cleanup()
+{
+    if(!_context)
+        return;
+
+    QOpenGLFunctions *f = _context->functions();
+    QOpenGLExtraFunctions *e = _context->extraFunctions();
+    if((f) && (e))
+    {
+        if(_VAO > 0)
+            e->glDeleteVertexArrays(1, &_VAO);
+
+        if(_instanceBuffer > 0)
+            f->glDeleteBuffers(1, &_instanceBuffer);
+    }
+
+    _VAO = 0;
+    _instanceBuffer = 0;
+    _instanceCapacity = 0;
+    _program = 0;
+
+    if(_quad)
+    {
+        PublishGLUnitQuad::release(_context);
+        _quad = nullptr;
+    }
+
+    _context = nullptr;
+}
+
+bool PublishGLSpriteBatch::isInitialized() const
+{
+    return _VAO > 0;
+}
+
+void PublishGLSpriteBatch::begin()
+{
+    _instances.clear();
+    _textures.clear();
+}
+
+// Queue a sprite centered on the given scene position, textureRect is in normalized texture coordinates
+void PublishGLSpriteBatch::addSprite(GLuint texture, const QPointF& position, const QSizeF& size, float rotation,
+                                     const QColor& tint, const QRectF& textureRect)
+{
+    SpriteInstance instance;
+    instance._position[0] = static_cast<GLfloat>(position.x());
+    instance._position[1] = static_cast<GLfloat>(position.y());
+    instance._scale[0] = static_cast<GLfloat>(size.width());
+    instance._scale[1] = static_cast<GLfloat>(size.height());
+    instance._rotation = rotation;
+    instance._tint[0] = static_cast<GLfloat>(tint.redF());
+    instance._tint[1] = static_cast<GLfloat>(tint.greenF());
+    instance._tint[2] = static_cast<GLfloat>(tint.blueF());
+    instance._tint[3] = static_cast<GLfloat>(tint.alphaF());
+    instance._textureRect[0] = static_cast<GLfloat>(textureRect.x());
+    instance._textureRect[1] = static_cast<GLfloat>(textureRect.y());
+    instance._textureRect[2] = static_cast<GLfloat>(textureRect.width());
+    instance._textureRect[3] = static_cast<GLfloat>(textureRect.height());
+
+    _instances.append(instance);
+    _textures.append(texture);
+}
+
+// Upload all queued sprites at once and draw them in submission order, with one instanced call per run of sprites sharing a texture
+void PublishGLSpriteBatch::end(PublishGLStateCache* stateCache)
+{
+    _drawCalls = 0;
+
+    if((!isInitialized()) || (!stateCache) || (_instances.isEmpty()))
+        return;
+
+    QOpenGLFunctions *f = _context->functions();
+    QOpenGLExtraFunctions *e = _context->extraFunctions();
+    if((!f) || (!e))
+        return;
+
+    // Sprites are never reordered, overlapping sprites have to draw in the order they were added.
+    // Only neighbouring sprites with the same texture share a draw call, such as tokens in the atlas.
+    QVector<SpriteGroup> groups;
+    for(int i = 0; i < _instances.count(); ++i)
+    {
+        GLuint texture = _textures.at(i);
+        if((groups.isEmpty()) || (groups.last()._texture != texture))
+            groups.append(SpriteGroup{texture, i, 0});
+        ++groups.last()._count;
+    }
+
+    // Stream the instance data, orphaning the previous frame's storage
+    f->glBindBuffer(GL_ARRAY_BUFFER, _instanceBuffer);
+    if(_instances.count() > _instanceCapacity)
+    {
+        while(_instanceCapacity < _instances.count())
+            _instanceCapacity *= 2;
+    }
+    f->glBufferData(GL_ARRAY_BUFFER, _instanceCapacity * static_cast<GLsizeiptr>(sizeof(SpriteInstance)), nullptr, GL_STREAM_DRAW);
+    f->glBufferSubData(GL_ARRAY_BUFFER, 0, _instances.count() * static_cast<GLsizeiptr>(sizeof(SpriteInstance)), _instances.constData());
+
+    stateCache->useProgram(_program);
+    stateCache->activeTexture(GL_TEXTURE0);
+    stateCache->bindVertexArray(_VAO);
+
+    for(const SpriteGroup& group : groups)
+    {
+        // Without base instance support, point the instance attributes at the start of the group
+        setInstanceAttributes(group._first);
+        stateCache->bindTexture(GL_TEXTURE_2D, group._texture);
+        e->glDrawElementsInstanced(GL_TRIANGLES, PublishGLUnitQuad::INDEX_COUNT, GL_UNSIGNED_INT, 0, group._count);
+        ++_drawCalls;
+    }
+}
+
+int PublishGLSpriteBatch::getSpriteCount() const
+{
+    return _instances.count();
+}
+
+// Draw calls issued by the last end()
+int PublishGLSpriteBatch::getDrawCalls() const
+{
+    return _drawCalls;
+}
+
+// Point the instance attributes of the bound VAO at the given instance in the instance buffer
+void PublishGLSpriteBatch::setInstanceAttributes(int firstInstance)
+{
+    QOpenGLFunctions *f = _context ? _context->functions() : nullptr;
+    if(!f)
+        return;
+
+    const GLsizei stride = sizeof(SpriteInstance);
+    const size_t base = static_cast<size_t>(firstInstance) * sizeof(SpriteInstance);
+
+    f->glBindBuffer(GL_ARRAY_BUFFER, _instanceBuffer);
+    f->glVertexAttribPointer(SPRITE_POSITION_ATTRIBUTE, 2, GL_FLOAT, GL_FALSE, stride, (void*)(base + offsetof(SpriteInstance, _position)));
+    f->glVertexAttribPointer(SPRITE_SCALE_ATTRIBUTE, 2, GL_FLOAT, GL_FALSE, stride, (void*)(base + offsetof(SpriteInstance, _scale)));
+    f->glVertexAttribPointer(SPRITE_ROTATION_ATTRIBUTE, 1, GL_FLOAT, GL_FALSE, stride, (void*)(base + offsetof(SpriteInstance, _rotation)));
+    f->glVertexAttribPointer(SPRITE_TINT_ATTRIBUTE, 4, GL_FLOAT, GL_FALSE, stride, (void*)(base + offsetof(SpriteInstance, _tint)));
+    f->glVertexAttribPointer(SPRITE_TEXTURERECT_ATTRIBUTE, 4, GL_FLOAT, GL_FALSE, stride, (void*)(base + offsetof(SpriteInstance, _textureRect)));
+}
@@ -0,0 +1,72 @@
+#ifndef PUBLISHGLSPRITEBATCH_H
+#define PUBLISHGLSPRITEBATCH_H
+
+#include <QVector>
+#include <QPointF>
+#include <QSizeF>
+#include <QRectF>
+#include <QColor>
+#include <qopengl.h>
+
+class QOpenGLContext;
+class PublishGLShaderManager;
+class PublishGLStateCache;
+class PublishGLUnitQuad;
+
+// Collects textured sprites such as tokens during a frame and draws them in the
+// order they were added, with one instanced draw call per run of sprites that
+// share a texture. Position, scale, rotation, tint and
+// texture rectangle of each sprite are streamed as per-instance attributes
+// on top of the shared unit quad.
+class PublishGLSpriteBatch
+{
+public:
+    PublishGLSpriteBatch();
+    ~PublishGLSpriteBatch();
+
+    static void requestProgram(PublishGLShaderManager* shaderManager);
+    bool initialize(QOpenGLContext* context, PublishGLShaderManager* shaderManager, GLuint sceneBlockBinding);
+    void cleanup();
+    bool isInitialized() const;
+
+    void begin();
+    void addSprite(GLuint texture, const QPointF& position, const QSizeF& size, float rotation = 0.f,
+                   const QColor& tint = QColor(Qt::white), const QRectF& textureRect = QRectF(0.0, 0.0, 1.0, 1.0));
+    void end(PublishGLStateCache* stateCache);
+
+    int getSpriteCount() const;
+    int getDrawCalls() const;
+
+private:
+    struct SpriteInstance
+    {
+        GLfloat _position[2];
+        GLfloat _scale[2];
+        GLfloat _rotation;
+        GLfloat _tint[4];
+        GLfloat _textureRect[4];
+    };
+
+    struct SpriteGroup
+    {
+        GLuint _texture;
+        int _first;
+        int _count;
+    };
+
+    void setInstanceAttributes(int firstInstance);
+
+    QOpenGLContext* _context;
+    PublishGLUnitQuad* _quad;
+    GLuint _program;
+    GLuint _VAO;
+    GLuint _instanceBuffer;
+    int _instanceCapacity;
+
+    QVector<SpriteInstance> _instances;
+    QVector<GLuint> _textures;
+
+    int _drawCalls;
+};
+
+#endif // PUBLISHGLSPRITEBATCH_H
@@ -0,0 +1,115 @@
+#include "publishglstatecache.h"
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#include <QOpenGLExtraFunctions>
+
+PublishGLStateCache::PublishGLStateCache() :
+    _f(nullptr),
+    _e(nullptr),
+    _program(UNKNOWN_STATE),
+    _activeUnit(UNKNOWN_STATE),
+    _vao(UNKNOWN_STATE),
+    _textures(),
+    _callsIssued(0),
+    _callsAvoided(0)
+{
+    invalidate();
+}
+
+// Start tracking the given context, nothing is known about its state yet
+void PublishGLStateCache::reset(QOpenGLContext* context)
+{
+    _f = context ? context->functions() : nullptr;
+    _e = context ? context->extraFunctions() : nullptr;
+    invalidate();
+}
+
+// Forget the shadowed state, e.g. after GL calls that did not go through the cache
+void PublishGLStateCache::invalidate()
+{
+    _program = UNKNOWN_STATE;
+    _activeUnit = UNKNOWN_STATE;
+    _vao = UNKNOWN_STATE;
+    for(int i = 0; i < TEXTURE_UNIT_COUNT; ++i)
+        _textures[i] = UNKNOWN_STATE;
+}
+
+void PublishGLStateCache::useProgram(GLuint program)
+{
+    if(!_f)
+        return;
+
+    if(_program == program)
+    {
+        ++_callsAvoided;
+        return;
+    }
+
+    _f->glUseProgram(program);
+    _program = program;
+    ++_callsIssued;
+}
+
+void PublishGLStateCache::activeTexture(GLenum unit)
+{
+    if(!_f)
+        return;
+
+    if(_activeUnit == unit)
+    {
+        ++_callsAvoided;
+        return;
+    }
+
+    _f->glActiveTexture(unit);
+    _activeUnit = unit;
+    ++_callsIssued;
+}
+
+void PublishGLStateCache::bindVertexArray(GLuint vao)
+{
+    if(!_e)
+        return;
+
+    if(_vao == vao)
+    {
+        ++_callsAvoided;
+        return;
+    }
+
+    _e->glBindVertexArray(vao);
+    _vao = vao;
+    ++_callsIssued;
+}
+
+// Only GL_TEXTURE_2D bindings on the first texture units are shadowed, anything else is passed through
+void PublishGLStateCache::bindTexture(GLenum target, GLuint texture)
+{
+    if(!_f)
+        return;
+
+    int unitIndex = (_activeUnit == UNKNOWN_STATE) ? -1 : static_cast<int>(_activeUnit - GL_TEXTURE0);
+    bool tracked = ((target == GL_TEXTURE_2D) && (unitIndex >= 0) && (unitIndex < TEXTURE_UNIT_COUNT));
+
+    if((tracked) && (_textures[unitIndex] == texture))
+    {
+        ++_callsAvoided;
+        return;
+    }
+
+    _f->glBindTexture(target, texture);
+    if(tracked)
+        _textures[unitIndex] = texture;
+    ++_callsIssued;
+}
+
+quint64 PublishGLStateCache::getCallsIssued() const
+{
+    return _callsIssued;
+}
+
+// Number of state changes dropped because the state was already set
+quint64 PublishGLStateCache::getCallsAvoided() const
+{
+    return _callsAvoided;
+}
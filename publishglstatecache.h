@@ -0,0 +1,46 @@
+#ifndef PUBLISHGLSTATECACHE_H
+#define PUBLISHGLSTATECACHE_H
+
+#include <qopengl.h>
+
+class QOpenGLContext;
+class QOpenGLFunctions;
+class QOpenGLExtraFunctions;
+
+// Shadows the GL binding state a renderer touches while drawing, so state
+// changes that would not change anything are dropped instead of being sent
+// to the driver. Any GL code that bypasses the cache must be followed by
+// invalidate().
+class PublishGLStateCache
+{
+public:
+    PublishGLStateCache();
+
+    void reset(QOpenGLContext* context);
+    void invalidate();
+
+    void useProgram(GLuint program);
+    void activeTexture(GLenum unit);
+    void bindVertexArray(GLuint vao);
+    void bindTexture(GLenum target, GLuint texture);
+
+    quint64 getCallsIssued() const;
+    quint64 getCallsAvoided() const;
+
+private:
+    static const int TEXTURE_UNIT_COUNT = 16;
+    static const GLuint UNKNOWN_STATE = 0xFFFFFFFF;
+
+    QOpenGLFunctions* _f;
+    QOpenGLExtraFunctions* _e;
+
+    GLuint _program;
+    GLenum _activeUnit;
+    GLuint _vao;
+    GLuint _textures[TEXTURE_UNIT_COUNT];
+
+    quint64 _callsIssued;
+    quint64 _callsAvoided;
+};
+
+#endif // PUBLISHGLSTATECACHE_H
@@ -0,0 +1,352 @@
+#include "publishgltextureatlas.h"
+#include "imagekernels.h"
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#include <QImage>
+#include <QSet>
+#include <QDebug>
+
+// Transparent gutter around each entry so linear filtering does not pick up the neighbours
+const int ATLAS_PADDING = 1;
+const qint64 ATLAS_PAGE_BYTES = static_cast<qint64>(PublishGLTextureAtlas::PAGE_SIZE) * PublishGLTextureAtlas::PAGE_SIZE * 4;
+const qint64 ATLAS_DEFAULT_BUDGET = 4 * ATLAS_PAGE_BYTES;
+
+QHash<QOpenGLContextGroup*, PublishGLTextureAtlas*> PublishGLTextureAtlas::_atlases;
+
+PublishGLTextureAtlas::PublishGLTextureAtlas(QOpenGLContextGroup* group) :
+    QObject(group),
+    _group(group),
+    _pages(),
+    _entries(),
+    _keys(),
+    _nextId(1),
+    _useCounter(0),
+    _memoryBudget(ATLAS_DEFAULT_BUDGET),
+    _evictions(0)
+{
+    qDebug() << "[PublishGLTextureAtlas] Creating texture atlas for share group " << group;
+}
+
+PublishGLTextureAtlas::~PublishGLTextureAtlas()
+{
+    // The page textures are destroyed together with the share group
+    _atlases.remove(_group);
+}
+
+// The atlas shared by all contexts of the context's share group
+PublishGLTextureAtlas* PublishGLTextureAtlas::getAtlas(QOpenGLContext* context)
+{
+    if((!context) || (!context->shareGroup()))
+        return nullptr;
+
+    PublishGLTextureAtlas* atlas = _atlases.value(context->shareGroup(), nullptr);
+    if(!atlas)
+    {
+        atlas = new PublishGLTextureAtlas(context->shareGroup());
+        _atlases.insert(context->shareGroup(), atlas);
+    }
+
+    return atlas;
+}
+
+// Get a reference to the image stored under the key, adding it to the atlas if needed. Returns -1 if the image cannot be stored.
+int PublishGLTextureAtlas::acquireImage(const QString& key, const QImage& image)
+{
+    int id = _keys.value(key, -1);
+    if(id > 0)
+    {
+        AtlasEntry& entry = _entries[id];
+        ++entry._refCount;
+        entry._lastUsed = ++_useCounter;
+        return id;
+    }
+
+    QOpenGLContext* context = QOpenGLContext::currentContext();
+    QOpenGLFunctions *f = ((context) && (context->shareGroup() == _group)) ? context->functions() : nullptr;
+    if((!f) || (image.isNull()))
+        return -1;
+
+    // Images larger than a page are scaled down to fit
+    QImage atlasImage = image;
+    const int maxSize = PAGE_SIZE - (2 * ATLAS_PADDING);
+    if((atlasImage.width() > maxSize) || (atlasImage.height() > maxSize))
+        atlasImage = atlasImage.scaled(maxSize, maxSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+
+    int page = -1;
+    int shelf = -1;
+    QRect rect;
+    if(!allocate(atlasImage.size(), page, shelf, rect))
+    {
+        qDebug() << "[PublishGLTextureAtlas] ERROR: no space for image " << key << ", size: " << atlasImage.size();
+        return -1;
+    }
+
+    // Rows are flipped to match the y-up texture coordinates of the scene
+    QImage textureImage = ImageKernels::prepareForUpload(atlasImage);
+    f->glBindTexture(GL_TEXTURE_2D, _pages.at(page)._texture);
+    f->glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    f->glTexSubImage2D(GL_TEXTURE_2D, 0, rect.x(), rect.y(), rect.width(), rect.height(), GL_RGBA, GL_UNSIGNED_BYTE, textureImage.constBits());
+    f->glBindTexture(GL_TEXTURE_2D, 0);
+
+    id = _nextId++;
+    AtlasEntry entry;
+    entry._key = key;
+    entry._page = page;
+    entry._shelf = shelf;
+    entry._rect = rect;
+    entry._refCount = 1;
+    entry._lastUsed = ++_useCounter;
+    _entries.insert(id, entry);
+    _keys.insert(key, id);
+
+    return id;
+}
+
+// Drop a reference, the image stays in the atlas until its space is needed
+void PublishGLTextureAtlas::releaseImage(int id)
+{
+    auto it = _entries.find(id);
+    if((it == _entries.end()) || (it->_refCount <= 0))
+        return;
+
+    --it->_refCount;
+}
+
+// Mark the entry as used for the eviction order, call this when drawing it
+void PublishGLTextureAtlas::touch(int id)
+{
+    auto it = _entries.find(id);
+    if(it != _entries.end())
+        it->_lastUsed = ++_useCounter;
+}
+
+GLuint PublishGLTextureAtlas::getTexture(int id) const
+{
+    auto it = _entries.constFind(id);
+    if(it == _entries.constEnd())
+        return 0;
+
+    return _pages.at(it->_page)._texture;
+}
+
+// Normalized rectangle of the entry in its page
+QRectF PublishGLTextureAtlas::getTextureRect(int id) const
+{
+    auto it = _entries.constFind(id);
+    if(it == _entries.constEnd())
+        return QRectF();
+
+    const qreal pageSize = PAGE_SIZE;
+    return QRectF(it->_rect.x() / pageSize, it->_rect.y() / pageSize, it->_rect.width() / pageSize, it->_rect.height() / pageSize);
+}
+
+qint64 PublishGLTextureAtlas::getMemoryBudget() const
+{
+    return _memoryBudget;
+}
+
+// The budget is applied when pages are added, existing pages are kept
+void PublishGLTextureAtlas::setMemoryBudget(qint64 bytes)
+{
+    _memoryBudget = bytes;
+}
+
+qint64 PublishGLTextureAtlas::getMemoryUsed() const
+{
+    return _pages.count() * ATLAS_PAGE_BYTES;
+}
+
+int PublishGLTextureAtlas::getPageCount() const
+{
+    return _pages.count();
+}
+
+int PublishGLTextureAtlas::getEntryCount() const
+{
+    return _entries.count();
+}
+
+quint64 PublishGLTextureAtlas::getEvictions() const
+{
+    return _evictions;
+}
+
+// Find space in the existing pages, then in a new page, then by evicting unused shelves
+bool PublishGLTextureAtlas::allocate(const QSize& size, int& page, int& shelf, QRect& rect)
+{
+    // Every pass either finds space, adds a page or evicts a shelf, so the loop ends
+    // once the budget is used up and no shelf is free of referenced entries
+    forever
+    {
+        for(int i = 0; i < _pages.count(); ++i)
+        {
+            if(allocateInPage(i, size, shelf, rect))
+            {
+                page = i;
+                return true;
+            }
+        }
+
+        if((getMemoryUsed() + ATLAS_PAGE_BYTES <= _memoryBudget) || (_pages.isEmpty()))
+        {
+            if(!addPage())
+                return false;
+        }
+        else if(!evictShelf(size.height() + (2 * ATLAS_PADDING)))
+        {
+            return false;
+        }
+    }
+}
+
+// Best-fit shelf packing: use the shelf wasting the least height, or open a new shelf at the top of the page
+bool PublishGLTextureAtlas::allocateInPage(int pageIndex, const QSize& size, int& shelf, QRect& rect)
+{
+    AtlasPage& page = _pages[pageIndex];
+    const int paddedWidth = size.width() + (2 * ATLAS_PADDING);
+    const int paddedHeight = size.height() + (2 * ATLAS_PADDING);
+
+    int bestShelf = -1;
+    for(int i = 0; i < page._shelves.count(); ++i)
+    {
+        const AtlasShelf& candidate = page._shelves.at(i);
+        if((candidate._height >= paddedHeight) && (candidate._x + paddedWidth <= PAGE_SIZE))
+        {
+            if((bestShelf < 0) || (candidate._height < page._shelves.at(bestShelf)._height))
+                bestShelf = i;
+        }
+    }
+
+    if(bestShelf < 0)
+    {
+        if(page._top + paddedHeight > PAGE_SIZE)
+            return false;
+
+        page._shelves.append(AtlasShelf{page._top, paddedHeight, 0, 0});
+        page._top += paddedHeight;
+        bestShelf = page._shelves.count() - 1;
+    }
+
+    AtlasShelf& target = page._shelves[bestShelf];
+    rect = QRect(target._x + ATLAS_PADDING, target._y + ATLAS_PADDING, size.width(), size.height());
+    target._x += paddedWidth;
+    ++target._liveCount;
+    shelf = bestShelf;
+
+    return true;
+}
+
+bool PublishGLTextureAtlas::addPage()
+{
+    QOpenGLContext* context = QOpenGLContext::currentContext();
+    QOpenGLFunctions *f = context ? context->functions() : nullptr;
+    if(!f)
+        return false;
+
+    // Start from a transparent page so the gutters stay clear
+    QByteArray clearData(static_cast<int>(ATLAS_PAGE_BYTES), 0);
+
+    AtlasPage page;
+    page._texture = 0;
+    page._top = 0;
+    f->glGenTextures(1, &page._texture);
+    f->glBindTexture(GL_TEXTURE_2D, page._texture);
+    f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    f->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, PAGE_SIZE, PAGE_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, clearData.constData());
+    f->glBindTexture(GL_TEXTURE_2D, 0);
+
+    _pages.append(page);
+    qDebug() << "[PublishGLTextureAtlas] Added atlas page " << _pages.count() << ", memory used: " << getMemoryUsed();
+
+    return true;
+}
+
+// Evict the least recently used shelf without referenced entries. Evicting single entries
+// would leave their space unusable until the rest of the shelf goes, so whole shelves are
+// evicted, preferring shelves tall enough for the requested height.
+bool PublishGLTextureAtlas::evictShelf(int height)
+{
+    // A shelf is as recent as its most recently used entry, and blocked by any referenced entry
+    QHash<quint64, quint64> shelfLastUsed;
+    QSet<quint64> blocked;
+    for(auto it = _entries.constBegin(); it != _entries.constEnd(); ++it)
+    {
+        quint64 shelfKey = (static_cast<quint64>(it->_page) << 32) | static_cast<quint32>(it->_shelf);
+        if(it->_refCount > 0)
+            blocked.insert(shelfKey);
+        shelfLastUsed[shelfKey] = qMax(shelfLastUsed.value(shelfKey, 0), it->_lastUsed);
+    }
+
+    quint64 victim = 0;
+    bool victimFits = false;
+    quint64 victimLastUsed = 0;
+    bool found = false;
+    for(auto it = shelfLastUsed.constBegin(); it != shelfLastUsed.constEnd(); ++it)
+    {
+        if(blocked.contains(it.key()))
+            continue;
+
+        const AtlasPage& page = _pages.at(static_cast<int>(it.key() >> 32));
+        bool fits = (page._shelves.at(static_cast<int>(it.key() & 0xFFFFFFFF))._height >= height);
+        if((!found) || ((fits) && (!victimFits)) || ((fits == victimFits) && (it.value() < victimLastUsed)))
+        {
+            victim = it.key();
+            victimFits = fits;
+            victimLastUsed = it.value();
+            found = true;
+        }
+    }
+
+    if(!found)
+        return false;
+
+    const int pageIndex = static_cast<int>(victim >> 32);
+    const int shelfIndex = static_cast<int>(victim & 0xFFFFFFFF);
+    for(auto it = _entries.begin(); it != _entries.end();)
+    {
+        if((it->_page == pageIndex) && (it->_shelf == shelfIndex))
+        {
+            _keys.remove(it->_key);
+            it = _entries.erase(it);
+            ++_evictions;
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    clearShelf(pageIndex, shelfIndex);
+
+    // Empty shelves at the top of the page give their height back for shelves of any size
+    AtlasPage& page = _pages[pageIndex];
+    while((!page._shelves.isEmpty()) && (page._shelves.last()._liveCount == 0))
+    {
+        page._top = page._shelves.last()._y;
+        page._shelves.removeLast();
+    }
+
+    return true;
+}
+
+// Make the shelf empty and transparent again, so new entries and their gutters never show old texels
+void PublishGLTextureAtlas::clearShelf(int pageIndex, int shelfIndex)
+{
+    AtlasShelf& shelf = _pages[pageIndex]._shelves[shelfIndex];
+    shelf._x = 0;
+    shelf._liveCount = 0;
+
+    QOpenGLContext* context = QOpenGLContext::currentContext();
+    QOpenGLFunctions *f = context ? context->functions() : nullptr;
+    if(!f)
+        return;
+
+    QByteArray clearData(PAGE_SIZE * shelf._height * 4, 0);
+    f->glBindTexture(GL_TEXTURE_2D, _pages.at(pageIndex)._texture);
+    f->glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    f->glTexSubImage2D(GL_TEXTURE_2D, 0, 0, shelf._y, PAGE_SIZE, shelf._height, GL_RGBA, GL_UNSIGNED_BYTE, clearData.constData());
+    f->glBindTexture(GL_TEXTURE_2D, 0);
+}
@@ -0,0 +1,93 @@
+#ifndef PUBLISHGLTEXTUREATLAS_H
+#define PUBLISHGLTEXTUREATLAS_H
+
+#include <QObject>
+#include <QHash>
+#include <QVector>
+#include <QString>
+#include <QRect>
+#include <QRectF>
+#include <qopengl.h>
+
+class QOpenGLContext;
+class QOpenGLContextGroup;
+class QImage;
+
+// Packs small images such as tokens and icons into a few large textures
+// using shelf packing. There is one atlas per context share group, so images
+// stay resident while renderers come and go. Entries are refcounted;
+// unreferenced entries stay in the atlas until space is needed and are then
+// evicted a whole shelf at a time, least recently used shelf first. The
+// number of pages is bounded by the memory budget.
+class PublishGLTextureAtlas : public QObject
+{
+    Q_OBJECT
+public:
+    static PublishGLTextureAtlas* getAtlas(QOpenGLContext* context);
+
+    // A context of the share group must be current
+    int acquireImage(const QString& key, const QImage& image);
+    void releaseImage(int id);
+    void touch(int id);
+
+    GLuint getTexture(int id) const;
+    QRectF getTextureRect(int id) const;
+
+    qint64 getMemoryBudget() const;
+    void setMemoryBudget(qint64 bytes);
+    qint64 getMemoryUsed() const;
+    int getPageCount() const;
+    int getEntryCount() const;
+    quint64 getEvictions() const;
+
+    static const int PAGE_SIZE = 2048;
+
+protected:
+    explicit PublishGLTextureAtlas(QOpenGLContextGroup* group);
+    virtual ~PublishGLTextureAtlas() override;
+
+private:
+    struct AtlasShelf
+    {
+        int _y;
+        int _height;
+        int _x;
+        int _liveCount;
+    };
+
+    struct AtlasPage
+    {
+        GLuint _texture;
+        int _top;
+        QVector<AtlasShelf> _shelves;
+    };
+
+    struct AtlasEntry
+    {
+        QString _key;
+        int _page;
+        int _shelf;
+        QRect _rect;
+        int _refCount;
+        quint64 _lastUsed;
+    };
+
+    bool allocate(const QSize& size, int& page, int& shelf, QRect& rect);
+    bool allocateInPage(int pageIndex, const QSize& size, int& shelf, QRect& rect);
+    bool addPage();
+    bool evictShelf(int height);
+    void clearShelf(int pageIndex, int shelfIndex);
+
+    QOpenGLContextGroup* _group;
+    QVector<AtlasPage> _pages;
+    QHash<int, AtlasEntry> _entries;
+    QHash<QString, int> _keys;
+    int _nextId;
+    quint64 _useCounter;
+    qint64 _memoryBudget;
+    quint64 _evictions;
+
+    static QHash<QOpenGLContextGroup*, PublishGLTextureAtlas*> _atlases;
+};
+
+#endif // PUBLISHGLTEXTUREATLAS_H
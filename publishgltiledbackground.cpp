@@ -0,0 +1,692 @@
+#include "publishgltiledbackground.h"
+#include "publishglspritebatch.h"
+#include "publishglstatecache.h"
+#include "imagekernels.h"
+#include "publishglmipcache.h"
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#include <QImageReader>
+#include <QImageIOHandler>
+#include <QDataStream>
+#include <QSaveFile>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QVector>
+#include <QtMath>
+#include <QDebug>
+#include <functional>
+#include <cstring>
+
+const int TILED_THREAD_COUNT = 2;
+const int TILED_UPLOADS_PER_FRAME = 4;
+const qint64 TILED_DEFAULT_BUDGET = 256 * 1024 * 1024;
+const qint64 TILED_FULL_DECODE_BYTES = 1024LL * 1024LL * 1024LL;
+const qint64 TILED_SOURCE_BAND_BYTES = 512LL * 1024LL * 1024LL;
+
+// Tile cache layout: magic, version, tile size, width, height and level count through QDataStream,
+// the raw upload ready tiles, then the tile count with a key and offset per tile, and last the
+// offset of that index
+const quint32 TILE_CACHE_MAGIC = 0x444D4854; // "DMHT"
+const quint32 TILE_CACHE_VERSION = 1;
+
+namespace
+{
+
+// Add rows below the image, the row formats must match
+void appendRows(QImage& image, const QImage& rows)
+{
+    if(image.isNull())
+    {
+        image = rows;
+        return;
+    }
+
+    QImage combined(image.width(), image.height() + rows.height(), image.format());
+    for(int y = 0; y < image.height(); ++y)
+        memcpy(combined.scanLine(y), image.constScanLine(y), static_cast<size_t>(image.width()) * 4);
+    for(int y = 0; y < rows.height(); ++y)
+        memcpy(combined.scanLine(image.height() + y), rows.constScanLine(y), static_cast<size_t>(rows.width()) * 4);
+    image = combined;
+}
+
+// Half size copy rounding the size up like the tile levels, odd edges are repeated before the box filter
+QImage downscaleBand(const QImage& band)
+{
+    if(((band.width() % 2) == 0) && ((band.height() % 2) == 0))
+        return ImageKernels::downscaleImage(band);
+
+    QImage padded((band.width() + 1) & ~1, (band.height() + 1) & ~1, band.format());
+    for(int y = 0; y < padded.height(); ++y)
+    {
+        uchar* dstRow = padded.scanLine(y);
+        memcpy(dstRow, band.constScanLine(qMin(y, band.height() - 1)), static_cast<size_t>(band.width()) * 4);
+        if(padded.width() != band.width())
+            memcpy(dstRow + (static_cast<size_t>(band.width()) * 4), dstRow + (static_cast<size_t>(band.width() - 1) * 4), 4);
+    }
+
+    return ImageKernels::downscaleImage(padded);
+}
+
+}
+
+PublishGLTiledBackground::PublishGLTiledBackground(const QString& fileName, QObject *parent) :
+    QObject(parent),
+    _fileName(fileName),
+    _imageSize(),
+    _levelCount(0),
+    _sceneRect(),
+    _context(nullptr),
+    _clipRectSupported(false),
+    _preparing(false),
+    _stopping(0),
+    _tileCacheFile(),
+    _tileOffsets(),
+    _pool(),
+    _tiles(),
+    _decodedTiles(),
+    _clock(),
+    _frame(0),
+    _memoryBudget(TILED_DEFAULT_BUDGET),
+    _memoryUsed(0),
+    _tilesLoaded(0),
+    _tilesEvicted(0),
+    _tilesCancelled(0),
+    _totalTileLatency(0)
+{
+    _pool.setMaxThreadCount(TILED_THREAD_COUNT);
+    _clock.start();
+
+    // Only the header is read here, the pixels are decoded tile by tile
+    QImageReader reader(_fileName);
+    _imageSize = reader.size();
+    if(_imageSize.isEmpty())
+    {
+        qDebug() << "[PublishGLTiledBackground] ERROR: unable to read the size of " << _fileName << ": " << reader.errorString();
+        return;
+    }
+
+    // Without clip rect support a region read decodes the whole image, so the source is only read in bands when possible
+    _clipRectSupported = reader.supportsOption(QImageIOHandler::ClipRect);
+
+    // Halve the image until the whole level fits in a single tile
+    _levelCount = 1;
+    while((qMax(_imageSize.width(), _imageSize.height()) >> (_levelCount - 1)) > TILE_SIZE)
+        ++_levelCount;
+
+    _sceneRect = QRectF(-_imageSize.width() / 2.0, -_imageSize.height() / 2.0, _imageSize.width(), _imageSize.height());
+    prepareTiles();
+}
+
+PublishGLTiledBackground::~PublishGLTiledBackground()
+{
+    // Stops a running cut at the next band instead of waiting for the whole pyramid
+    _stopping.storeRelease(1);
+    _pool.clear();
+    _pool.waitForDone();
+    cleanup();
+}
+
+void PublishGLTiledBackground::initialize(QOpenGLContext* context)
+{
+    _context = context;
+}
+
+// Delete all tile textures, the context must be current
+void PublishGLTiledBackground::cleanup()
+{
+    for(Tile& tile : _tiles)
+        deleteTile(tile);
+
+    _tiles.clear();
+    _decodedTiles.clear();
+    _memoryUsed = 0;
+    _context = nullptr;
+}
+
+QSize PublishGLTiledBackground::getImageSize() const
+{
+    return _imageSize;
+}
+
+int PublishGLTiledBackground::getLevelCount() const
+{
+    return _levelCount;
+}
+
+// Scene area covered by the whole image, by default centered at one scene unit per pixel
+void PublishGLTiledBackground::setSceneRect(const QRectF& sceneRect)
+{
+    _sceneRect = sceneRect;
+}
+
+QRectF PublishGLTiledBackground::getSceneRect() const
+{
+    return _sceneRect;
+}
+
+// Upload finished tiles, request missing ones and draw the visible tiles. The coarsest tile and the
+// tiles of the current level go through separate batches, so the finer tiles always end up on top.
+void PublishGLTiledBackground::paintGL(PublishGLSpriteBatch& spriteBatch, PublishGLStateCache* stateCache, const QRectF& visibleSceneRect, qreal pixelsPerSceneUnit)
+{
+    if((!_context) || (_levelCount == 0) || (_sceneRect.isEmpty()))
+        return;
+
+    ++_frame;
+    uploadTiles();
+
+    // The coarsest level is a single tile that is always kept
+    const int coarsestLevel = _levelCount - 1;
+    requestTile(coarsestLevel, 0, 0);
+
+    const int level = getLevelForScale(pixelsPerSceneUnit);
+    QRectF visibleRect = visibleSceneRect.intersected(_sceneRect);
+    if(visibleRect.isEmpty())
+        return;
+
+    // Visible area in image pixels of the level, the image y axis points down
+    const qreal scaleX = _imageSize.width() / _sceneRect.width();
+    const qreal scaleY = _imageSize.height() / _sceneRect.height();
+    const qreal levelTileSpan = static_cast<qreal>(TILE_SIZE << level);
+    const int firstX = qFloor((visibleRect.left() - _sceneRect.left()) * scaleX / levelTileSpan);
+    const int lastX = qCeil((visibleRect.right() - _sceneRect.left()) * scaleX / levelTileSpan) - 1;
+    const int firstY = qFloor((_sceneRect.bottom() - visibleRect.bottom()) * scaleY / levelTileSpan);
+    const int lastY = qCeil((_sceneRect.bottom() - visibleRect.top()) * scaleY / levelTileSpan) - 1;
+
+    const Tile coarsestTile = _tiles.value(getTileKey(coarsestLevel, 0, 0));
+    if(coarsestTile._texture > 0)
+    {
+        spriteBatch.begin();
+        spriteBatch.addSprite(coarsestTile._texture, _sceneRect.center(), _sceneRect.size());
+        spriteBatch.end(stateCache);
+    }
+
+    if(level == coarsestLevel)
+    {
+        cancelTiles();
+        evictTiles();
+        return;
+    }
+
+    spriteBatch.begin();
+    for(int y = firstY; y <= lastY; ++y)
+    {
+        for(int x = firstX; x <= lastX; ++x)
+        {
+            requestTile(level, x, y);
+            const Tile tile = _tiles.value(getTileKey(level, x, y));
+            if(tile._texture > 0)
+            {
+                QRectF tileRect = getTileSceneRect(level, x, y);
+                spriteBatch.addSprite(tile._texture, tileRect.center(), tileRect.size());
+            }
+        }
+    }
+    spriteBatch.end(stateCache);
+
+    cancelTiles();
+    evictTiles();
+}
+
+bool PublishGLTiledBackground::hasPendingUploads() const
+{
+    return !_decodedTiles.isEmpty();
+}
+
+qint64 PublishGLTiledBackground::getMemoryBudget() const
+{
+    return _memoryBudget;
+}
+
+void PublishGLTiledBackground::setMemoryBudget(qint64 bytes)
+{
+    _memoryBudget = bytes;
+}
+
+qint64 PublishGLTiledBackground::getMemoryUsed() const
+{
+    return _memoryUsed;
+}
+
+int PublishGLTiledBackground::getResidentTiles() const
+{
+    int resident = 0;
+    for(const Tile& tile : _tiles)
+    {
+        if(tile._texture > 0)
+            ++resident;
+    }
+    return resident;
+}
+
+quint64 PublishGLTiledBackground::getTilesLoaded() const
+{
+    return _tilesLoaded;
+}
+
+quint64 PublishGLTiledBackground::getTilesEvicted() const
+{
+    return _tilesEvicted;
+}
+
+quint64 PublishGLTiledBackground::getTilesCancelled() const
+{
+    return _tilesCancelled;
+}
+
+// Average time from requesting a tile to its upload, in ms
+qint64 PublishGLTiledBackground::getAverageTileLatency() const
+{
+    return (_tilesLoaded > 0) ? (_totalTileLatency / static_cast<qint64>(_tilesLoaded)) : 0;
+}
+
+void PublishGLTiledBackground::tileDecoded(quint64 key, const QImage& image)
+{
+    auto it = _tiles.find(key);
+    if((it == _tiles.end()) || (!it->_loading))
+        return;
+
+    if(image.isNull())
+    {
+        // Keep the empty entry so the tile is not requested again
+        qDebug() << "[PublishGLTiledBackground] ERROR: unable to decode tile " << key << " of " << _fileName;
+        it->_loading = false;
+        return;
+    }
+
+    _decodedTiles.insert(key, image);
+    emit tileReady();
+}
+
+void PublishGLTiledBackground::tilesPrepared(const QString& cacheFileName)
+{
+    _preparing = false;
+    if((!cacheFileName.isEmpty()) && (readTileIndex(cacheFileName, _tileOffsets)))
+    {
+        _tileCacheFile = cacheFileName;
+    }
+    else if(_clipRectSupported)
+    {
+        qDebug() << "[PublishGLTiledBackground] No tile cache for " << _fileName << ", decoding tiles from the source";
+    }
+    else
+    {
+        qDebug() << "[PublishGLTiledBackground] ERROR: no tile cache for " << _fileName << " and its format can't be read by region";
+        _levelCount = 0;
+        return;
+    }
+
+    emit tileReady();
+}
+
+quint64 PublishGLTiledBackground::getTileKey(int level, int x, int y)
+{
+    return (static_cast<quint64>(level) << 48) | (static_cast<quint64>(y) << 24) | static_cast<quint64>(x);
+}
+
+// Tile area in the pixels of its level
+QRect PublishGLTiledBackground::getTileImageRect(int level, int x, int y) const
+{
+    const QSize levelSize((_imageSize.width() + (1 << level) - 1) >> level, (_imageSize.height() + (1 << level) - 1) >> level);
+    return QRect(x * TILE_SIZE, y * TILE_SIZE, TILE_SIZE, TILE_SIZE).intersected(QRect(QPoint(0, 0), levelSize));
+}
+
+QRectF PublishGLTiledBackground::getTileSceneRect(int level, int x, int y) const
+{
+    const QRect imageRect = getTileImageRect(level, x, y);
+    const qreal unitsX = (_sceneRect.width() / _imageSize.width()) * (1 << level);
+    const qreal unitsY = (_sceneRect.height() / _imageSize.height()) * (1 << level);
+    return QRectF(_sceneRect.left() + (imageRect.left() * unitsX),
+                  _sceneRect.bottom() - ((imageRect.top() + imageRect.height()) * unitsY),
+                  imageRect.width() * unitsX,
+                  imageRect.height() * unitsY);
+}
+
+// Finest level with at most one image pixel per screen pixel
+int PublishGLTiledBackground::getLevelForScale(qreal pixelsPerSceneUnit) const
+{
+    const qreal screenPixelsPerImagePixel = pixelsPerSceneUnit * (_sceneRect.width() / _imageSize.width());
+    if(screenPixelsPerImagePixel <= 0.0)
+        return _levelCount - 1;
+
+    const int level = qFloor(std::log2(1.0 / screenPixelsPerImagePixel));
+    return qBound(0, level, _levelCount - 1);
+}
+
+// Find the tile cache of an earlier run or cut the pyramid into a new one, on the pool
+void PublishGLTiledBackground::prepareTiles()
+{
+    _preparing = true;
+
+    const QString fileName = _fileName;
+    const QSize imageSize = _imageSize;
+    const int levelCount = _levelCount;
+    const bool clipRectSupported = _clipRectSupported;
+    _pool.start([this, fileName, imageSize, levelCount, clipRectSupported]()
+    {
+        QString cacheFileName;
+        QByteArray cacheKey = PublishGLMipCache::getCacheKey(fileName);
+        if(!cacheKey.isEmpty())
+        {
+            cacheFileName = QDir(PublishGLMipCache::getCacheDirectory()).filePath(QString::fromLatin1(cacheKey) + QString(".tiles"));
+
+            QHash<quint64, qint64> tileOffsets;
+            if(readTileIndex(cacheFileName, tileOffsets))
+                PublishGLMipCache::touchCacheFile(cacheFileName);
+            else if(buildTileCache(fileName, cacheFileName, imageSize, levelCount, clipRectSupported, _stopping))
+                PublishGLMipCache::trimCache(cacheFileName);
+            else
+                cacheFileName.clear();
+        }
+
+        QMetaObject::invokeMethod(this, "tilesPrepared", Qt::QueuedConnection, Q_ARG(QString, cacheFileName));
+    });
+}
+
+// Decode the source and write every tile of every level. The source is fed through in bands of a
+// tile row, each band is cut into tiles and its half size copy is added to the band of the next
+// level, so only one band per level is held at a time.
+bool PublishGLTiledBackground::buildTileCache(const QString& fileName, const QString& cacheFileName, const QSize& imageSize, int levelCount,
+                                              bool clipRectSupported, const QAtomicInt& stopping)
+{
+    QElapsedTimer buildTimer;
+    buildTimer.start();
+
+    QDir().mkpath(QFileInfo(cacheFileName).absolutePath());
+    QSaveFile cacheFile(cacheFileName);
+    if(!cacheFile.open(QIODevice::WriteOnly))
+        return false;
+
+    QDataStream stream(&cacheFile);
+    stream << TILE_CACHE_MAGIC << TILE_CACHE_VERSION << static_cast<quint32>(TILE_SIZE)
+           << static_cast<quint32>(imageSize.width()) << static_cast<quint32>(imageSize.height()) << static_cast<quint32>(levelCount);
+
+    QHash<quint64, qint64> tileOffsets;
+    QVector<QImage> bands(levelCount);
+    QVector<int> bandTops(levelCount, 0);
+    std::function<bool(int, const QImage&)> addRows = [&](int level, const QImage& rows) -> bool
+    {
+        appendRows(bands[level], rows);
+        const int levelHeight = (imageSize.height() + (1 << level) - 1) >> level;
+        if((bands.at(level).height() < TILE_SIZE) && (bandTops.at(level) + bands.at(level).height() < levelHeight))
+            return true;
+
+        const QImage band = bands.at(level);
+        const int tileY = bandTops.at(level) / TILE_SIZE;
+        for(int x = 0; x * TILE_SIZE < band.width(); ++x)
+        {
+            QImage tile = ImageKernels::prepareForUpload(band.copy(x * TILE_SIZE, 0, qMin(TILE_SIZE, band.width() - (x * TILE_SIZE)), band.height()));
+            tileOffsets.insert(getTileKey(level, x, tileY), cacheFile.pos());
+            if(cacheFile.write(reinterpret_cast<const char*>(tile.constBits()), tile.sizeInBytes()) != tile.sizeInBytes())
+                return false;
+        }
+
+        bandTops[level] += band.height();
+        bands[level] = QImage();
+        return (level + 1 >= levelCount) || (addRows(level + 1, downscaleBand(band)));
+    };
+
+    // A Qt image reader can't resume a decode, so every region read decodes the source from the top
+    // again. The source is read in as few pieces as the memory allows: whole when it fits, otherwise
+    // in the tallest runs of tile rows that fit. Formats that can't be read by region have to fit whole.
+    const qint64 rowBytes = static_cast<qint64>(imageSize.width()) * 4;
+    int sourceBandHeight = imageSize.height();
+    if(rowBytes * imageSize.height() > TILED_FULL_DECODE_BYTES)
+    {
+        if(!clipRectSupported)
+        {
+            qDebug() << "[PublishGLTiledBackground] ERROR: " << fileName << " is too large to decode at once (" << ((rowBytes * imageSize.height()) / (1024 * 1024))
+                     << " MB) and its format can't be read by region, convert it to JPEG to use it as a map";
+            return false;
+        }
+
+        sourceBandHeight = qMax(static_cast<int>(TILED_SOURCE_BAND_BYTES / rowBytes) / TILE_SIZE, 1) * TILE_SIZE;
+    }
+
+    for(int y = 0; y < imageSize.height(); y += sourceBandHeight)
+    {
+        if(stopping.loadAcquire() != 0)
+            return false;
+
+        const QRect sourceRect(0, y, imageSize.width(), qMin(sourceBandHeight, imageSize.height() - y));
+        QImageReader reader(fileName);
+        if(sourceRect.height() != imageSize.height())
+            reader.setClipRect(sourceRect);
+
+        QImage source = reader.read();
+        if(source.size() != sourceRect.size())
+        {
+            qDebug() << "[PublishGLTiledBackground] ERROR: unable to decode rows " << sourceRect.top() << " to " << sourceRect.bottom() << " of " << fileName << ": " << reader.errorString();
+            return false;
+        }
+
+        source = source.convertToFormat(QImage::Format_ARGB32);
+        for(int row = 0; row < source.height(); row += TILE_SIZE)
+        {
+            if(stopping.loadAcquire() != 0)
+                return false;
+
+            if(!addRows(0, source.copy(0, row, source.width(), qMin(TILE_SIZE, source.height() - row))))
+                return false;
+        }
+    }
+
+    const qint64 indexOffset = cacheFile.pos();
+    stream << static_cast<quint32>(tileOffsets.count());
+    for(auto it = tileOffsets.constBegin(); it != tileOffsets.constEnd(); ++it)
+        stream << it.key() << static_cast<quint64>(it.value());
+    stream << static_cast<quint64>(indexOffset);
+
+    if((stream.status() != QDataStream::Ok) || (!cacheFile.commit()))
+        return false;
+
+    qDebug() << "[PublishGLTiledBackground] Cut " << fileName << " into " << tileOffsets.count() << " tiles in " << buildTimer.elapsed() << " ms";
+    return true;
+}
+
+bool PublishGLTiledBackground::readTileIndex(const QString& cacheFileName, QHash<quint64, qint64>& tileOffsets)
+{
+    QFile cacheFile(cacheFileName);
+    if(!cacheFile.open(QIODevice::ReadOnly))
+        return false;
+
+    QDataStream stream(&cacheFile);
+    quint32 magic = 0;
+    quint32 version = 0;
+    quint32 tileSize = 0;
+    quint32 width = 0;
+    quint32 height = 0;
+    quint32 levelCount = 0;
+    stream >> magic >> version >> tileSize >> width >> height >> levelCount;
+    if((stream.status() != QDataStream::Ok) || (magic != TILE_CACHE_MAGIC) || (version != TILE_CACHE_VERSION) ||
+       (tileSize != static_cast<quint32>(TILE_SIZE)) || (!cacheFile.seek(cacheFile.size() - static_cast<qint64>(sizeof(quint64)))))
+        return false;
+
+    quint64 indexOffset = 0;
+    stream >> indexOffset;
+    if((stream.status() != QDataStream::Ok) || (indexOffset >= static_cast<quint64>(cacheFile.size())) ||
+       (!cacheFile.seek(static_cast<qint64>(indexOffset))))
+        return false;
+
+    quint32 tileCount = 0;
+    stream >> tileCount;
+    QHash<quint64, qint64> offsets;
+    for(quint32 i = 0; (i < tileCount) && (stream.status() == QDataStream::Ok); ++i)
+    {
+        quint64 key = 0;
+        quint64 offset = 0;
+        stream >> key >> offset;
+        if(offset >= indexOffset)
+            return false;
+        offsets.insert(key, static_cast<qint64>(offset));
+    }
+
+    if(stream.status() != QDataStream::Ok)
+        return false;
+
+    tileOffsets = offsets;
+    return true;
+}
+
+void PublishGLTiledBackground::requestTile(int level, int x, int y)
+{
+    // Tiles are requested again on the next paint once the cache is ready
+    if(_preparing)
+        return;
+
+    const quint64 key = getTileKey(level, x, y);
+    auto it = _tiles.find(key);
+    if(it != _tiles.end())
+    {
+        it->_lastUsed = _frame;
+        return;
+    }
+
+    const QRect imageRect = getTileImageRect(level, x, y);
+    if(imageRect.isEmpty())
+        return;
+
+    // The flag lets a request that left the view be skipped by the worker
+    QSharedPointer<QAtomicInt> cancelled(new QAtomicInt(0));
+    _tiles.insert(key, Tile{0, imageRect.size(), 0, _frame, _clock.elapsed(), true, cancelled});
+
+    const QSize tileSize = imageRect.size();
+    if(!_tileCacheFile.isEmpty())
+    {
+        // Read the upload ready tile straight from the cache
+        const QString cacheFileName = _tileCacheFile;
+        const qint64 offset = _tileOffsets.value(key, -1);
+        _pool.start([this, key, cacheFileName, offset, tileSize, cancelled]()
+        {
+            if(cancelled->loadAcquire() != 0)
+                return;
+
+            QImage image;
+            QFile cacheFile(cacheFileName);
+            if((offset >= 0) && (cacheFile.open(QIODevice::ReadOnly)) && (cacheFile.seek(offset)))
+            {
+                image = QImage(tileSize, QImage::Format_RGBA8888);
+                if(cacheFile.read(reinterpret_cast<char*>(image.bits()), image.sizeInBytes()) != image.sizeInBytes())
+                    image = QImage();
+            }
+
+            if(cancelled->loadAcquire() == 0)
+                QMetaObject::invokeMethod(this, "tileDecoded", Qt::QueuedConnection, Q_ARG(quint64, key), Q_ARG(QImage, image));
+        });
+        return;
+    }
+
+    // Without a cache, decode only the source area of the tile, directly at the size of its level
+    const QRect sourceRect = QRect(imageRect.topLeft() * (1 << level), imageRect.size() * (1 << level)).intersected(QRect(QPoint(0, 0), _imageSize));
+    const QString fileName = _fileName;
+    _pool.start([this, key, fileName, sourceRect, tileSize, cancelled]()
+    {
+        if(cancelled->loadAcquire() != 0)
+            return;
+
+        QImageReader reader(fileName);
+        reader.setClipRect(sourceRect);
+        if(sourceRect.size() != tileSize)
+            reader.setScaledSize(tileSize);
+
+        QImage image = ImageKernels::prepareForUpload(reader.read());
+        if(cancelled->loadAcquire() == 0)
+            QMetaObject::invokeMethod(this, "tileDecoded", Qt::QueuedConnection, Q_ARG(quint64, key), Q_ARG(QImage, image));
+    });
+}
+
+// Drop requests for tiles that left the view before they were loaded, their queued work returns at once
+void PublishGLTiledBackground::cancelTiles()
+{
+    for(auto it = _tiles.begin(); it != _tiles.end();)
+    {
+        if((it->_loading) && (it->_lastUsed < _frame))
+        {
+            it->_cancelled->storeRelease(1);
+            _decodedTiles.remove(it.key());
+            it = _tiles.erase(it);
+            ++_tilesCancelled;
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+// Upload a limited number of decoded tiles per frame to bound the frame time
+void PublishGLTiledBackground::uploadTiles()
+{
+    QOpenGLFunctions *f = _context ? _context->functions() : nullptr;
+    if(!f)
+        return;
+
+    int uploads = 0;
+    auto decoded = _decodedTiles.begin();
+    while((decoded != _decodedTiles.end()) && (uploads < TILED_UPLOADS_PER_FRAME))
+    {
+        auto it = _tiles.find(decoded.key());
+        if((it != _tiles.end()) && (it->_loading))
+        {
+            const QImage& image = decoded.value();
+            f->glGenTextures(1, &it->_texture);
+            f->glBindTexture(GL_TEXTURE_2D, it->_texture);
+            f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            f->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image.width(), image.height(), 0, GL_RGBA, GL_UNSIGNED_BYTE, image.constBits());
+
+            it->_size = image.size();
+            it->_bytes = image.sizeInBytes();
+            it->_loading = false;
+            _memoryUsed += it->_bytes;
+            _totalTileLatency += _clock.elapsed() - it->_requestTime;
+            ++_tilesLoaded;
+            ++uploads;
+        }
+        decoded = _decodedTiles.erase(decoded);
+    }
+
+    if(uploads > 0)
+        f->glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Drop the least recently used tiles over the budget, never the coarsest tile or tiles used this frame
+void PublishGLTiledBackground::evictTiles()
+{
+    const quint64 coarsestKey = getTileKey(_levelCount - 1, 0, 0);
+    while(_memoryUsed > _memoryBudget)
+    {
+        auto victim = _tiles.end();
+        for(auto it = _tiles.begin(); it != _tiles.end(); ++it)
+        {
+            if((it->_texture > 0) && (it.key() != coarsestKey) && (it->_lastUsed < _frame) &&
+               ((victim == _tiles.end()) || (it->_lastUsed < victim->_lastUsed)))
+            {
+                victim = it;
+            }
+        }
+
+        if(victim == _tiles.end())
+            return;
+
+        deleteTile(*victim);
+        _tiles.erase(victim);
+        ++_tilesEvicted;
+    }
+}
+
+void PublishGLTiledBackground::deleteTile(Tile& tile)
+{
+    if(tile._texture == 0)
+        return;
+
+    QOpenGLFunctions *f = _context ? _context->functions() : nullptr;
+    if(f)
+        f->glDeleteTextures(1, &tile._texture);
+
+    tile._texture = 0;
+    _memoryUsed -= tile._bytes;
+    tile._bytes = 0;
+}
@@ -0,0 +1,117 @@
+#ifndef PUBLISHGLTILEDBACKGROUND_H
+#define PUBLISHGLTILEDBACKGROUND_H
+
+#include <QObject>
+#include <QThreadPool>
+#include <QHash>
+#include <QImage>
+#include <QRectF>
+#include <QSize>
+#include <QElapsedTimer>
+#include <QSharedPointer>
+#include <QAtomicInt>
+#include <qopengl.h>
+
+class QOpenGLContext;
+class PublishGLSpriteBatch;
+class PublishGLStateCache;
+
+// Background for images too large to upload as one texture. The image is
+// split into fixed size tiles over a mip pyramid; only the tiles visible at
+// the current view and level of detail are loaded, on a worker pool, and
+// kept resident under a memory budget. The single tile of the coarsest level
+// stays resident and covers the gaps while finer tiles stream in.
+// The pyramid is cut once into an upload ready tile cache file, so loading a
+// tile never decodes more than the tile itself. Sources too large to decode
+// at once are read in large bands, which needs a format that can be read by
+// region such as JPEG.
+class PublishGLTiledBackground : public QObject
+{
+    Q_OBJECT
+public:
+    PublishGLTiledBackground(const QString& fileName, QObject *parent = nullptr);
+    virtual ~PublishGLTiledBackground() override;
+
+    void initialize(QOpenGLContext* context);
+    void cleanup();
+
+    QSize getImageSize() const;
+    int getLevelCount() const;
+    void setSceneRect(const QRectF& sceneRect);
+    QRectF getSceneRect() const;
+
+    void paintGL(PublishGLSpriteBatch& spriteBatch, PublishGLStateCache* stateCache, const QRectF& visibleSceneRect, qreal pixelsPerSceneUnit);
+    bool hasPendingUploads() const;
+
+    qint64 getMemoryBudget() const;
+    void setMemoryBudget(qint64 bytes);
+    qint64 getMemoryUsed() const;
+    int getResidentTiles() const;
+    quint64 getTilesLoaded() const;
+    quint64 getTilesEvicted() const;
+    quint64 getTilesCancelled() const;
+    qint64 getAverageTileLatency() const;
+
+    static const int TILE_SIZE = 512;
+
+signals:
+    void tileReady();
+
+protected slots:
+    void tileDecoded(quint64 key, const QImage& image);
+    void tilesPrepared(const QString& cacheFileName);
+
+private:
+    struct Tile
+    {
+        GLuint _texture;
+        QSize _size;
+        qint64 _bytes;
+        quint64 _lastUsed;
+        qint64 _requestTime;
+        bool _loading;
+        QSharedPointer<QAtomicInt> _cancelled;
+    };
+
+    static quint64 getTileKey(int level, int x, int y);
+    QRect getTileImageRect(int level, int x, int y) const;
+    QRectF getTileSceneRect(int level, int x, int y) const;
+    int getLevelForScale(qreal pixelsPerSceneUnit) const;
+
+    void prepareTiles();
+    static bool buildTileCache(const QString& fileName, const QString& cacheFileName, const QSize& imageSize, int levelCount,
+                               bool clipRectSupported, const QAtomicInt& stopping);
+    static bool readTileIndex(const QString& cacheFileName, QHash<quint64, qint64>& tileOffsets);
+
+    void requestTile(int level, int x, int y);
+    void cancelTiles();
+    void uploadTiles();
+    void evictTiles();
+    void deleteTile(Tile& tile);
+
+    QString _fileName;
+    QSize _imageSize;
+    int _levelCount;
+    QRectF _sceneRect;
+    QOpenGLContext* _context;
+    bool _clipRectSupported;
+    bool _preparing;
+    QAtomicInt _stopping;
+    QString _tileCacheFile;
+    QHash<quint64, qint64> _tileOffsets;
+
+    QThreadPool _pool;
+    QHash<quint64, Tile> _tiles;
+    QHash<quint64, QImage> _decodedTiles;
+    QElapsedTimer _clock;
+    quint64 _frame;
+
+    qint64 _memoryBudget;
+    qint64 _memoryUsed;
+    quint64 _tilesLoaded;
+    quint64 _tilesEvicted;
+    quint64 _tilesCancelled;
+    qint64 _totalTileLatency;
+};
+
+#endif // PUBLISHGLTILEDBACKGROUND_H
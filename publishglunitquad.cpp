@@ -0,0 +1,139 @@
+#include "publishglunitquad.h"
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#include <QOpenGLExtraFunctions>
+#include <QDebug>
+
+const GLuint UNITQUAD_POSITION_ATTRIBUTE = 0;
+const GLuint UNITQUAD_TEXCOORD_ATTRIBUTE = 2;
+
+QHash<QOpenGLContext*, PublishGLUnitQuad*> PublishGLUnitQuad::_quads;
+
+PublishGLUnitQuad::PublishGLUnitQuad(QOpenGLContext* context) :
+    _context(context),
+    _refCount(0),
+    _VAO(0),
+    _VBO(0),
+    _EBO(0)
+{
+    QOpenGLFunctions *f = _context->functions();
+    QOpenGLExtraFunctions *e = _context->extraFunctions();
+    if((!f) || (!e))
+        return;
+
+    qDebug() << "[PublishGLUnitQuad] Creating unit quad for context " << context;
+
+    float vertices[] = {
+        // positions      // texture coords
+         0.5f,  0.5f,     1.0f, 1.0f,   // top right
+         0.5f, -0.5f,     1.0f, 0.0f,   // bottom right
+        -0.5f, -0.5f,     0.0f, 0.0f,   // bottom left
+        -0.5f,  0.5f,     0.0f, 1.0f    // top left
+    };
+
+    unsigned int indices[] = {
+        0, 1, 3,   // first triangle
+        1, 2, 3    // second triangle
+    };
+
+    f->glGenBuffers(1, &_VBO);
+    f->glBindBuffer(GL_ARRAY_BUFFER, _VBO);
+    f->glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+
+    f->glGenBuffers(1, &_EBO);
+
+    e->glGenVertexArrays(1, &_VAO);
+    e->glBindVertexArray(_VAO);
+    f->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _EBO);
+    f->glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+    setupAttributes(f);
+}
+
+PublishGLUnitQuad::~PublishGLUnitQuad()
+{
+    QOpenGLFunctions *f = _context->functions();
+    QOpenGLExtraFunctions *e = _context->extraFunctions();
+    if((!f) || (!e))
+        return;
+
+    qDebug() << "[PublishGLUnitQuad] Destroying unit quad for context " << _context;
+
+    if(_VAO > 0)
+        e->glDeleteVertexArrays(1, &_VAO);
+
+    if(_VBO > 0)
+        f->glDeleteBuffers(1, &_VBO);
+
+    if(_EBO > 0)
+        f->glDeleteBuffers(1, &_EBO);
+}
+
+// Get the quad of the context, creating it if needed. The context must be current.
+PublishGLUnitQuad* PublishGLUnitQuad::acquire(QOpenGLContext* context)
+{
+    if(!context)
+        return nullptr;
+
+    PublishGLUnitQuad* quad = _quads.value(context, nullptr);
+    if(!quad)
+    {
+        quad = new PublishGLUnitQuad(context);
+        _quads.insert(context, quad);
+    }
+
+    ++quad->_refCount;
+    return quad;
+}
+
+// Release a quad taken with acquire, the last release deletes it. The context must be current.
+void PublishGLUnitQuad::release(QOpenGLContext* context)
+{
+    PublishGLUnitQuad* quad = _quads.value(context, nullptr);
+    if(!quad)
+        return;
+
+    if(--quad->_refCount > 0)
+        return;
+
+    _quads.remove(context);
+    delete quad;
+}
+
+GLuint PublishGLUnitQuad::getVAO() const
+{
+    return _VAO;
+}
+
+GLuint PublishGLUnitQuad::getVertexBuffer() const
+{
+    return _VBO;
+}
+
+GLuint PublishGLUnitQuad::getIndexBuffer() const
+{
+    return _EBO;
+}
+
+// Set up the quad's buffers and vertex attributes in the currently bound VAO, e.g. for a VAO that adds instance data
+void PublishGLUnitQuad::setupAttributes(QOpenGLFunctions* f) const
+{
+    if(!f)
+        return;
+
+    f->glBindBuffer(GL_ARRAY_BUFFER, _VBO);
+    f->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _EBO);
+
+    // position attribute
+    f->glVertexAttribPointer(UNITQUAD_POSITION_ATTRIBUTE, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
+    f->glEnableVertexAttribArray(UNITQUAD_POSITION_ATTRIBUTE);
+    // texture attribute
+    f->glVertexAttribPointer(UNITQUAD_TEXCOORD_ATTRIBUTE, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)(2 * sizeof(float)));
+    f->glEnableVertexAttribArray(UNITQUAD_TEXCOORD_ATTRIBUTE);
+}
+
+// Draw the quad, the VAO must be bound
+void PublishGLUnitQuad::draw(QOpenGLFunctions* f) const
+{
+    if(f)
+        f->glDrawElements(GL_TRIANGLES, INDEX_COUNT, GL_UNSIGNED_INT, 0);
+}
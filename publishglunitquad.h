@@ -0,0 +1,40 @@
+#ifndef PUBLISHGLUNITQUAD_H
+#define PUBLISHGLUNITQUAD_H
+
+#include <QHash>
+#include <qopengl.h>
+
+class QOpenGLContext;
+class QOpenGLFunctions;
+
+// A single textured quad from -0.5 to 0.5, shared by every textured quad
+// drawn in a context and sized through the model matrix. Vertices carry only
+// a 2D position (attribute 0) and a texture coordinate (attribute 2).
+class PublishGLUnitQuad
+{
+public:
+    static PublishGLUnitQuad* acquire(QOpenGLContext* context);
+    static void release(QOpenGLContext* context);
+
+    GLuint getVAO() const;
+    GLuint getVertexBuffer() const;
+    GLuint getIndexBuffer() const;
+    void setupAttributes(QOpenGLFunctions* f) const;
+    void draw(QOpenGLFunctions* f) const;
+
+    static const int INDEX_COUNT = 6;
+
+private:
+    explicit PublishGLUnitQuad(QOpenGLContext* context);
+    ~PublishGLUnitQuad();
+
+    QOpenGLContext* _context;
+    int _refCount;
+    GLuint _VAO;
+    GLuint _VBO;
+    GLuint _EBO;
+
+    static QHash<QOpenGLContext*, PublishGLUnitQuad*> _quads;
+};
+
+#endif // PUBLISHGLUNITQUAD_H
@@ -0,0 +1,64 @@
+#include "triplebuffer.h"
+
+const int TRIPLEBUFFER_INDEX_MASK = 0x03;
+const int TRIPLEBUFFER_FRESH_BIT = 0x04;
+
+TripleBuffer::TripleBuffer() :
+    _shared(1),
+    _writeIndex(0),
+    _readIndex(2)
+{
+}
+
+// Index of the buffer the producer is currently filling
+int TripleBuffer::getWriteIndex() const
+{
+    return _writeIndex;
+}
+
+// Hand the filled buffer over to the consumer and take back the parked one.
+// Returns true if a frame the consumer never read has been overwritten.
+bool TripleBuffer::publish()
+{
+    int previous = _shared.fetchAndStoreOrdered(_writeIndex | TRIPLEBUFFER_FRESH_BIT);
+    _writeIndex = previous & TRIPLEBUFFER_INDEX_MASK;
+    return (previous & TRIPLEBUFFER_FRESH_BIT) != 0;
+}
+
+// Drop a published buffer the consumer has not taken yet, for example after the
+// buffers have been reallocated. Only the fresh bit is cleared, so the indices
+// stay distinct and the consumer can keep running.
+void TripleBuffer::reset()
+{
+    _shared.fetchAndAndOrdered(TRIPLEBUFFER_INDEX_MASK);
+}
+
+// Is there a published buffer newer than the one being read
+bool TripleBuffer::isFresh() const
+{
+    return (_shared.loadAcquire() & TRIPLEBUFFER_FRESH_BIT) != 0;
+}
+
+// Index of the buffer the consumer is currently reading
+int TripleBuffer::getReadIndex() const
+{
+    return _readIndex;
+}
+
+// Swap the read buffer for the most recently published one, if any.
+// The exchange only succeeds on a fresh word, so a reset by the producer in
+// between is never mistaken for a new frame.
+bool TripleBuffer::acquire()
+{
+    int current = _shared.loadAcquire();
+    while(current & TRIPLEBUFFER_FRESH_BIT)
+    {
+        if(_shared.testAndSetOrdered(current, _readIndex, current))
+        {
+            _readIndex = current & TRIPLEBUFFER_INDEX_MASK;
+            return true;
+        }
+    }
+
+    return false;
+}
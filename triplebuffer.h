@@ -0,0 +1,32 @@
+#ifndef TRIPLEBUFFER_H
+#define TRIPLEBUFFER_H
+
+#include <QAtomicInt>
+
+// Lock-free index rotation for a triple buffer shared by exactly one producer
+// and one consumer thread. The producer owns the write index and the consumer
+// owns the read index. The third index is parked in one atomic word together
+// with a "fresh" bit marking it as newer than the one being read, so neither
+// side ever blocks on the other.
+class TripleBuffer
+{
+public:
+    TripleBuffer();
+
+    // Producer side
+    int getWriteIndex() const;
+    bool publish();
+    void reset();
+
+    // Consumer side
+    bool isFresh() const;
+    int getReadIndex() const;
+    bool acquire();
+
+private:
+    QAtomicInt _shared;
+    int _writeIndex;
+    int _readIndex;
+};
+
+#endif // TRIPLEBUFFER_H
@@ -0,0 +1,263 @@
+#include "imagekernels.h"
+#include <QtTest>
+#include <QElapsedTimer>
+#include <QRandomGenerator>
+
+const int BENCHMARK_IMAGE_WIDTH = 4096;
+const int BENCHMARK_IMAGE_HEIGHT = 4096;
+
+// Checks every kernel path against the scalar fallback and measures the throughput of each
+// path on a map sized image. The paths are switched with ImageKernels::setInstructionSet, so
+// each row of data runs the same call the texture upload and readback code makes.
+class TestImageKernels : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanup();
+
+    void matchesScalar_data();
+    void matchesScalar();
+
+    void benchmarkSwizzle_data();
+    void benchmarkSwizzle();
+    void benchmarkPremultiply_data();
+    void benchmarkPremultiply();
+    void benchmarkDownscale_data();
+    void benchmarkDownscale();
+    void benchmarkFlip_data();
+    void benchmarkFlip();
+    void benchmarkPrepareForUpload_data();
+    void benchmarkPrepareForUpload();
+
+private:
+    void addInstructionSets();
+    void selectInstructionSet();
+    void reportThroughput(qint64 bytes, qint64 nanoseconds);
+
+    ImageKernels::InstructionSet _defaultInstructionSet = ImageKernels::InstructionSet_Scalar;
+    QImage _image;
+};
+
+const char* getInstructionSetName(ImageKernels::InstructionSet instructionSet)
+{
+    switch(instructionSet)
+    {
+        case ImageKernels::InstructionSet_SSE2:
+            return "SSE2";
+        case ImageKernels::InstructionSet_AVX2:
+            return "AVX2";
+        case ImageKernels::InstructionSet_NEON:
+            return "NEON";
+        default:
+            return "scalar";
+    }
+}
+
+void TestImageKernels::initTestCase()
+{
+    _defaultInstructionSet = ImageKernels::getInstructionSet();
+    qDebug() << "[TestImageKernels] Default path: " << getInstructionSetName(_defaultInstructionSet);
+
+    // Random pixels, so the premultiply sees every alpha and the compiler can't shortcut anything
+    _image = QImage(BENCHMARK_IMAGE_WIDTH, BENCHMARK_IMAGE_HEIGHT, QImage::Format_ARGB32);
+    QRandomGenerator random(1234);
+    for(int y = 0; y < _image.height(); ++y)
+        random.fillRange(reinterpret_cast<quint32*>(_image.scanLine(y)), _image.width());
+}
+
+void TestImageKernels::cleanup()
+{
+    ImageKernels::setInstructionSet(_defaultInstructionSet);
+}
+
+void TestImageKernels::addInstructionSets()
+{
+    QTest::addColumn<int>("instructionSet");
+
+    const ImageKernels::InstructionSet instructionSets[] = {ImageKernels::InstructionSet_Scalar, ImageKernels::InstructionSet_SSE2,
+                                                            ImageKernels::InstructionSet_AVX2, ImageKernels::InstructionSet_NEON};
+    for(ImageKernels::InstructionSet instructionSet : instructionSets)
+    {
+        if(ImageKernels::isInstructionSetAvailable(instructionSet))
+            QTest::newRow(getInstructionSetName(instructionSet)) << static_cast<int>(instructionSet);
+    }
+}
+
+void TestImageKernels::selectInstructionSet()
+{
+    QFETCH(int, instructionSet);
+    QVERIFY(ImageKernels::setInstructionSet(static_cast<ImageKernels::InstructionSet>(instructionSet)));
+}
+
+void TestImageKernels::reportThroughput(qint64 bytes, qint64 nanoseconds)
+{
+    if(nanoseconds <= 0)
+        return;
+
+    const double megabytesPerSecond = (static_cast<double>(bytes) / (1024.0 * 1024.0)) / (static_cast<double>(nanoseconds) / 1000000000.0);
+    qDebug() << "[TestImageKernels] " << QTest::currentTestFunction() << " " << QTest::currentDataTag() << ": " << qRound(megabytesPerSecond) << " MB/s";
+}
+
+void TestImageKernels::matchesScalar_data()
+{
+    addInstructionSets();
+}
+
+// Odd sizes so every path also runs its scalar tail
+void TestImageKernels::matchesScalar()
+{
+    const QImage source = _image.copy(0, 0, 1023, 517);
+    const int pixelCount = source.width();
+
+    QVERIFY(ImageKernels::setInstructionSet(ImageKernels::InstructionSet_Scalar));
+    QImage swizzled(source.size(), source.format());
+    QImage premultiplied(source.size(), source.format());
+    for(int y = 0; y < source.height(); ++y)
+    {
+        ImageKernels::swizzleRedBlue(source.constScanLine(y), swizzled.scanLine(y), pixelCount);
+        ImageKernels::premultiplyAlpha(source.constScanLine(y), premultiplied.scanLine(y), pixelCount);
+    }
+    const QImage downscaled = ImageKernels::downscaleImage(source);
+    const QImage uploaded = ImageKernels::prepareForUpload(source);
+    const QImage readback = ImageKernels::convertReadback(uploaded);
+
+    selectInstructionSet();
+    QImage result(source.size(), source.format());
+    for(int y = 0; y < source.height(); ++y)
+        ImageKernels::swizzleRedBlue(source.constScanLine(y), result.scanLine(y), pixelCount);
+    QCOMPARE(result, swizzled);
+
+    for(int y = 0; y < source.height(); ++y)
+        ImageKernels::premultiplyAlpha(source.constScanLine(y), result.scanLine(y), pixelCount);
+    QCOMPARE(result, premultiplied);
+
+    QCOMPARE(ImageKernels::downscaleImage(source), downscaled);
+    QCOMPARE(ImageKernels::prepareForUpload(source), uploaded);
+    QCOMPARE(ImageKernels::convertReadback(uploaded), readback);
+}
+
+void TestImageKernels::benchmarkSwizzle_data()
+{
+    addInstructionSets();
+}
+
+void TestImageKernels::benchmarkSwizzle()
+{
+    selectInstructionSet();
+
+    QImage result(_image.size(), _image.format());
+    const qint64 bytes = _image.sizeInBytes();
+    qint64 processed = 0;
+    QElapsedTimer timer;
+    timer.start();
+    QBENCHMARK
+    {
+        ImageKernels::swizzleRedBlue(_image.constBits(), result.bits(), _image.width() * _image.height());
+        processed += bytes;
+    }
+    reportThroughput(processed, timer.nsecsElapsed());
+}
+
+void TestImageKernels::benchmarkPremultiply_data()
+{
+    addInstructionSets();
+}
+
+void TestImageKernels::benchmarkPremultiply()
+{
+    selectInstructionSet();
+
+    QImage result(_image.size(), _image.format());
+    const qint64 bytes = _image.sizeInBytes();
+    qint64 processed = 0;
+    QElapsedTimer timer;
+    timer.start();
+    QBENCHMARK
+    {
+        ImageKernels::premultiplyAlpha(_image.constBits(), result.bits(), _image.width() * _image.height());
+        processed += bytes;
+    }
+    reportThroughput(processed, timer.nsecsElapsed());
+}
+
+void TestImageKernels::benchmarkDownscale_data()
+{
+    addInstructionSets();
+}
+
+// Throughput counts the source bytes read
+void TestImageKernels::benchmarkDownscale()
+{
+    selectInstructionSet();
+
+    QImage result(_image.width() / 2, _image.height() / 2, _image.format());
+    const qint64 bytes = _image.sizeInBytes();
+    qint64 processed = 0;
+    QElapsedTimer timer;
+    timer.start();
+    QBENCHMARK
+    {
+        ImageKernels::downscaleByTwo(_image.constBits(), _image.bytesPerLine(), result.bits(), result.bytesPerLine(), result.width(), result.height());
+        processed += bytes;
+    }
+    reportThroughput(processed, timer.nsecsElapsed());
+}
+
+void TestImageKernels::benchmarkFlip_data()
+{
+    addInstructionSets();
+}
+
+// The flip is plain memcpy on every path, the rows show it does not depend on the dispatch
+void TestImageKernels::benchmarkFlip()
+{
+    selectInstructionSet();
+
+    QImage result = _image.copy();
+    const qint64 bytes = result.sizeInBytes();
+    qint64 processed = 0;
+    QElapsedTimer timer;
+    timer.start();
+    QBENCHMARK
+    {
+        ImageKernels::flipVertical(result.bits(), result.bytesPerLine(), result.height());
+        processed += bytes;
+    }
+    reportThroughput(processed, timer.nsecsElapsed());
+}
+
+void TestImageKernels::benchmarkPrepareForUpload_data()
+{
+    addInstructionSets();
+    QTest::newRow("convertToFormat + mirrored") << -1;
+}
+
+// The full upload preparation of a map image, against the Qt conversion it replaced
+void TestImageKernels::benchmarkPrepareForUpload()
+{
+    QFETCH(int, instructionSet);
+    if(instructionSet >= 0)
+        selectInstructionSet();
+
+    const qint64 bytes = _image.sizeInBytes();
+    qint64 processed = 0;
+    QImage result;
+    QElapsedTimer timer;
+    timer.start();
+    QBENCHMARK
+    {
+        if(instructionSet >= 0)
+            result = ImageKernels::prepareForUpload(_image);
+        else
+            result = _image.convertToFormat(QImage::Format_RGBA8888).mirrored();
+        processed += bytes;
+    }
+    reportThroughput(processed, timer.nsecsElapsed());
+    QCOMPARE(result.size(), _image.size());
+}
+
+QTEST_APPLESS_MAIN(TestImageKernels)
+
+#include "tst_imagekernels.moc"
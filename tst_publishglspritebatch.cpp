@@ -0,0 +1,232 @@
+#include "publishglspritebatch.h"
+#include "publishglshadermanager.h"
+#include "publishglstatecache.h"
+#include <QtTest>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#include <QOpenGLExtraFunctions>
+#include <QOpenGLFramebufferObject>
+#include <QMatrix4x4>
+#include <QtMath>
+
+const GLuint BENCHMARK_SCENE_BLOCK_BINDING = 0;
+const int BENCHMARK_TARGET_SIZE = 1024;
+const int BENCHMARK_TEXTURE_SIZE = 64;
+
+// Frame time and draw calls of the sprite batch at 10, 100 and 1000 tokens.
+// "batched" draws every token of a frame through one begin/end, the way the
+// map renderer does with all tokens in the atlas. "per token" ends the batch
+// after every token, which issues one draw call per token like the separate
+// PublishGLImage draws the batch replaced. drawOrder checks that overlapping
+// sprites with different textures draw in the order they were added.
+class TestPublishGLSpriteBatch : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+    void drawOrder_data();
+    void drawOrder();
+    void benchmarkTokens_data();
+    void benchmarkTokens();
+
+private:
+    GLuint createTexture(const QColor& color);
+
+    QOffscreenSurface* _surface = nullptr;
+    QOpenGLContext* _context = nullptr;
+    QOpenGLFramebufferObject* _target = nullptr;
+    GLuint _sceneBlock = 0;
+    GLuint _texture = 0;
+    PublishGLSpriteBatch _spriteBatch;
+    PublishGLStateCache _stateCache;
+};
+
+void TestPublishGLSpriteBatch::initTestCase()
+{
+    QSurfaceFormat format;
+    format.setVersion(3, 3);
+    format.setProfile(QSurfaceFormat::CoreProfile);
+
+    _context = new QOpenGLContext();
+    _context->setFormat(format);
+    if(!_context->create())
+        QSKIP("No OpenGL 3.3 context available");
+
+    _surface = new QOffscreenSurface();
+    _surface->setFormat(_context->format());
+    _surface->create();
+    QVERIFY(_context->makeCurrent(_surface));
+
+    QOpenGLFunctions* f = _context->functions();
+    QOpenGLExtraFunctions* e = _context->extraFunctions();
+
+    _target = new QOpenGLFramebufferObject(BENCHMARK_TARGET_SIZE, BENCHMARK_TARGET_SIZE);
+    _target->bind();
+    f->glViewport(0, 0, BENCHMARK_TARGET_SIZE, BENCHMARK_TARGET_SIZE);
+    f->glEnable(GL_BLEND);
+    f->glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+    // View and projection as the map renderer sets them up, one scene unit per pixel
+    QMatrix4x4 matrices[2];
+    matrices[0].lookAt(QVector3D(0.f, 0.f, 500.f), QVector3D(0.f, 0.f, 0.f), QVector3D(0.f, 1.f, 0.f));
+    matrices[1].ortho(0.f, BENCHMARK_TARGET_SIZE, 0.f, BENCHMARK_TARGET_SIZE, 0.1f, 1000.f);
+    f->glGenBuffers(1, &_sceneBlock);
+    f->glBindBuffer(GL_UNIFORM_BUFFER, _sceneBlock);
+    f->glBufferData(GL_UNIFORM_BUFFER, 2 * 16 * sizeof(GLfloat), nullptr, GL_DYNAMIC_DRAW);
+    f->glBufferSubData(GL_UNIFORM_BUFFER, 0, 16 * sizeof(GLfloat), matrices[0].constData());
+    f->glBufferSubData(GL_UNIFORM_BUFFER, 16 * sizeof(GLfloat), 16 * sizeof(GLfloat), matrices[1].constData());
+    e->glBindBufferBase(GL_UNIFORM_BUFFER, BENCHMARK_SCENE_BLOCK_BINDING, _sceneBlock);
+
+    _texture = createTexture(Qt::white);
+
+    QVERIFY(_spriteBatch.initialize(_context, PublishGLShaderManager::getManager(_context), BENCHMARK_SCENE_BLOCK_BINDING));
+    _stateCache.reset(_context);
+}
+
+void TestPublishGLSpriteBatch::cleanupTestCase()
+{
+    if((!_context) || (!_context->makeCurrent(_surface)))
+        return;
+
+    _spriteBatch.cleanup();
+    _context->functions()->glDeleteTextures(1, &_texture);
+    _context->functions()->glDeleteBuffers(1, &_sceneBlock);
+    delete _target;
+    _context->doneCurrent();
+
+    delete _context;
+    delete _surface;
+}
+
+void TestPublishGLSpriteBatch::drawOrder_data()
+{
+    QTest::addColumn<bool>("lowerNameFirst");
+
+    QTest::newRow("lower texture name first") << true;
+    QTest::newRow("higher texture name first") << false;
+}
+
+// Two overlapping sprites with different textures, the one added last has to end up on top
+// whichever texture name GL handed out first
+void TestPublishGLSpriteBatch::drawOrder()
+{
+    QFETCH(bool, lowerNameFirst);
+
+    QOpenGLFunctions* f = _context->functions();
+    GLuint redTexture = createTexture(Qt::red);
+    GLuint greenTexture = createTexture(Qt::green);
+    _stateCache.invalidate();
+
+    GLuint lowerTexture = qMin(redTexture, greenTexture);
+    GLuint higherTexture = qMax(redTexture, greenTexture);
+    GLuint bottomTexture = lowerNameFirst ? lowerTexture : higherTexture;
+    GLuint topTexture = lowerNameFirst ? higherTexture : lowerTexture;
+    const QPointF center(BENCHMARK_TARGET_SIZE / 2, BENCHMARK_TARGET_SIZE / 2);
+    const QSizeF size(BENCHMARK_TEXTURE_SIZE, BENCHMARK_TEXTURE_SIZE);
+
+    f->glClear(GL_COLOR_BUFFER_BIT);
+    _spriteBatch.begin();
+    _spriteBatch.addSprite(bottomTexture, center, size);
+    _spriteBatch.addSprite(topTexture, center + QPointF(BENCHMARK_TEXTURE_SIZE / 4, 0.0), size);
+    _spriteBatch.end(&_stateCache);
+    QCOMPARE(_spriteBatch.getDrawCalls(), 2);
+
+    QImage result = _target->toImage();
+    _stateCache.invalidate();
+    f->glDeleteTextures(1, &redTexture);
+    f->glDeleteTextures(1, &greenTexture);
+
+    // Inside both sprites, and only inside the first one as a check that it was drawn at all
+    QColor expectedTop = (topTexture == redTexture) ? QColor(Qt::red) : QColor(Qt::green);
+    QColor expectedBottom = (bottomTexture == redTexture) ? QColor(Qt::red) : QColor(Qt::green);
+    QCOMPARE(result.pixelColor(result.width() / 2, result.height() / 2), expectedTop);
+    QCOMPARE(result.pixelColor(result.width() / 2 - (BENCHMARK_TEXTURE_SIZE * 3) / 8, result.height() / 2), expectedBottom);
+}
+
+void TestPublishGLSpriteBatch::benchmarkTokens_data()
+{
+    QTest::addColumn<int>("tokenCount");
+    QTest::addColumn<bool>("batched");
+
+    const int tokenCounts[] = { 10, 100, 1000 };
+    for(int tokenCount : tokenCounts)
+    {
+        QTest::addRow("%d tokens, batched", tokenCount) << tokenCount << true;
+        QTest::addRow("%d tokens, per token", tokenCount) << tokenCount << false;
+    }
+}
+
+void TestPublishGLSpriteBatch::benchmarkTokens()
+{
+    QFETCH(int, tokenCount);
+    QFETCH(bool, batched);
+
+    QOpenGLFunctions* f = _context->functions();
+
+    // Tokens on a grid across the target, each with its own rotation and tint
+    QVector<QPointF> positions(tokenCount);
+    const int columns = qCeil(qSqrt(tokenCount));
+    const qreal spacing = static_cast<qreal>(BENCHMARK_TARGET_SIZE) / columns;
+    for(int i = 0; i < tokenCount; ++i)
+        positions[i] = QPointF((i % columns + 0.5) * spacing, (i / columns + 0.5) * spacing);
+
+    int drawCalls = 0;
+    QBENCHMARK
+    {
+        f->glClear(GL_COLOR_BUFFER_BIT);
+        drawCalls = 0;
+        if(batched)
+            _spriteBatch.begin();
+
+        for(int i = 0; i < tokenCount; ++i)
+        {
+            if(!batched)
+                _spriteBatch.begin();
+
+            _spriteBatch.addSprite(_texture, positions.at(i), QSizeF(spacing * 0.8, spacing * 0.8),
+                                   static_cast<float>(i) * 0.1f, QColor::fromHsv((i * 37) % 360, 64, 255));
+
+            if(!batched)
+            {
+                _spriteBatch.end(&_stateCache);
+                drawCalls += _spriteBatch.getDrawCalls();
+            }
+        }
+
+        if(batched)
+        {
+            _spriteBatch.end(&_stateCache);
+            drawCalls += _spriteBatch.getDrawCalls();
+        }
+
+        // Include the GPU work in the frame time
+        f->glFinish();
+    }
+
+    QCOMPARE(drawCalls, batched ? 1 : tokenCount);
+    qDebug() << "[TestPublishGLSpriteBatch] " << tokenCount << " tokens, " << (batched ? "batched" : "per token") << ": " << drawCalls << " draw calls per frame";
+}
+
+// A single colour texture of the benchmark texture size, left bound on the active unit
+GLuint TestPublishGLSpriteBatch::createTexture(const QColor& color)
+{
+    QOpenGLFunctions* f = _context->functions();
+
+    QImage image(BENCHMARK_TEXTURE_SIZE, BENCHMARK_TEXTURE_SIZE, QImage::Format_RGBA8888);
+    image.fill(color);
+
+    GLuint texture = 0;
+    f->glGenTextures(1, &texture);
+    f->glBindTexture(GL_TEXTURE_2D, texture);
+    f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    f->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, BENCHMARK_TEXTURE_SIZE, BENCHMARK_TEXTURE_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, image.constBits());
+    return texture;
+}
+
+QTEST_MAIN(TestPublishGLSpriteBatch)
+
+#include "tst_publishglspritebatch.moc"
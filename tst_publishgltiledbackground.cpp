@@ -0,0 +1,249 @@
+#include "publishgltiledbackground.h"
+#include "publishglspritebatch.h"
+#include "publishglshadermanager.h"
+#include "publishglstatecache.h"
+#include "publishglmipcache.h"
+#include <QtTest>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#include <QOpenGLExtraFunctions>
+#include <QOpenGLFramebufferObject>
+#include <QTemporaryDir>
+#include <QImageWriter>
+#include <QMatrix4x4>
+#include <QElapsedTimer>
+
+const GLuint BENCHMARK_SCENE_BLOCK_BINDING = 0;
+const int BENCHMARK_TARGET_WIDTH = 1920;
+const int BENCHMARK_TARGET_HEIGHT = 1080;
+const int BENCHMARK_MAP_SIZE = 32768;
+const int BENCHMARK_PAN_FRAMES = 600;
+const int BENCHMARK_LOAD_TIMEOUT = 600000;
+
+// Load time and pan cost of the tiled background on a synthetic 32k x 32k map.
+// benchmarkLoad times the cut into the tile cache on the first open and the
+// cache lookup on a later one. benchmarkPan moves a 1080p view diagonally
+// across the whole map at 1:1 and zoomed out, and reports the frame time, the
+// average tile latency and the peak tile memory.
+// The map is generated once as a grayscale JPEG, DMH_BENCHMARK_MAP can point
+// at a real map instead.
+class TestPublishGLTiledBackground : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+    void benchmarkLoad_data();
+    void benchmarkLoad();
+    void benchmarkPan_data();
+    void benchmarkPan();
+
+private:
+    PublishGLTiledBackground* createBackground(qint64* loadTime = nullptr);
+    QString getTileCacheFile() const;
+
+    QTemporaryDir _mapDir;
+    QString _mapFile;
+    QOffscreenSurface* _surface = nullptr;
+    QOpenGLContext* _context = nullptr;
+    QOpenGLFramebufferObject* _target = nullptr;
+    GLuint _sceneBlock = 0;
+    PublishGLSpriteBatch _spriteBatch;
+    PublishGLStateCache _stateCache;
+};
+
+void TestPublishGLTiledBackground::initTestCase()
+{
+    // Keeps the tile caches out of the user's cache directory
+    QStandardPaths::setTestModeEnabled(true);
+
+    _mapFile = qEnvironmentVariable("DMH_BENCHMARK_MAP");
+    if(_mapFile.isEmpty())
+    {
+        // Grayscale keeps the synthetic map at 1 GB in memory, the background converts it band by band
+        QImage map(BENCHMARK_MAP_SIZE, BENCHMARK_MAP_SIZE, QImage::Format_Grayscale8);
+        if(map.isNull())
+            QSKIP("Not enough memory to generate the synthetic map");
+
+        for(int y = 0; y < map.height(); ++y)
+        {
+            uchar* row = map.scanLine(y);
+            for(int x = 0; x < map.width(); ++x)
+                row[x] = static_cast<uchar>((x ^ y) + ((x * y) >> 12));
+        }
+
+        QVERIFY(_mapDir.isValid());
+        _mapFile = _mapDir.filePath(QString("map.jpg"));
+        QImageWriter writer(_mapFile, "jpg");
+        writer.setQuality(90);
+        QVERIFY2(writer.write(map), qPrintable(writer.errorString()));
+    }
+    QVERIFY(QFile::exists(_mapFile));
+
+    QSurfaceFormat format;
+    format.setVersion(3, 3);
+    format.setProfile(QSurfaceFormat::CoreProfile);
+
+    _context = new QOpenGLContext();
+    _context->setFormat(format);
+    if(!_context->create())
+        QSKIP("No OpenGL 3.3 context available");
+
+    _surface = new QOffscreenSurface();
+    _surface->setFormat(_context->format());
+    _surface->create();
+    QVERIFY(_context->makeCurrent(_surface));
+
+    QOpenGLFunctions* f = _context->functions();
+    QOpenGLExtraFunctions* e = _context->extraFunctions();
+
+    _target = new QOpenGLFramebufferObject(BENCHMARK_TARGET_WIDTH, BENCHMARK_TARGET_HEIGHT);
+    _target->bind();
+    f->glViewport(0, 0, BENCHMARK_TARGET_WIDTH, BENCHMARK_TARGET_HEIGHT);
+
+    // View and projection as the map renderer sets them up, centered with one scene unit per pixel
+    QMatrix4x4 matrices[2];
+    matrices[0].lookAt(QVector3D(0.f, 0.f, 500.f), QVector3D(0.f, 0.f, 0.f), QVector3D(0.f, 1.f, 0.f));
+    matrices[1].ortho(-BENCHMARK_TARGET_WIDTH / 2, BENCHMARK_TARGET_WIDTH / 2, -BENCHMARK_TARGET_HEIGHT / 2, BENCHMARK_TARGET_HEIGHT / 2, 0.1f, 1000.f);
+    f->glGenBuffers(1, &_sceneBlock);
+    f->glBindBuffer(GL_UNIFORM_BUFFER, _sceneBlock);
+    f->glBufferData(GL_UNIFORM_BUFFER, 2 * 16 * sizeof(GLfloat), nullptr, GL_DYNAMIC_DRAW);
+    f->glBufferSubData(GL_UNIFORM_BUFFER, 0, 16 * sizeof(GLfloat), matrices[0].constData());
+    f->glBufferSubData(GL_UNIFORM_BUFFER, 16 * sizeof(GLfloat), 16 * sizeof(GLfloat), matrices[1].constData());
+    e->glBindBufferBase(GL_UNIFORM_BUFFER, BENCHMARK_SCENE_BLOCK_BINDING, _sceneBlock);
+
+    QVERIFY(_spriteBatch.initialize(_context, PublishGLShaderManager::getManager(_context), BENCHMARK_SCENE_BLOCK_BINDING));
+}
+
+void TestPublishGLTiledBackground::cleanupTestCase()
+{
+    QFile::remove(getTileCacheFile());
+
+    if((!_context) || (!_context->makeCurrent(_surface)))
+        return;
+
+    _spriteBatch.cleanup();
+    _context->functions()->glDeleteBuffers(1, &_sceneBlock);
+    delete _target;
+    _context->doneCurrent();
+
+    delete _context;
+    delete _surface;
+}
+
+void TestPublishGLTiledBackground::benchmarkLoad_data()
+{
+    QTest::addColumn<bool>("cached");
+
+    QTest::newRow("first open") << false;
+    QTest::newRow("cached") << true;
+}
+
+void TestPublishGLTiledBackground::benchmarkLoad()
+{
+    QFETCH(bool, cached);
+
+    if(!cached)
+        QFile::remove(getTileCacheFile());
+    else if(!QFile::exists(getTileCacheFile()))
+        delete createBackground();
+
+    qint64 loadTime = 0;
+    PublishGLTiledBackground* background = createBackground(&loadTime);
+    QVERIFY(background);
+    const int levelCount = background->getLevelCount();
+    delete background;
+
+    QVERIFY(levelCount > 0);
+    QVERIFY(QFile::exists(getTileCacheFile()));
+    QTest::setBenchmarkResult(loadTime, QTest::WalltimeMilliseconds);
+    qDebug() << "[TestPublishGLTiledBackground] " << (cached ? "Cached" : "First") << " open: " << loadTime << " ms, tile cache: "
+             << (QFileInfo(getTileCacheFile()).size() / (1024 * 1024)) << " MB";
+}
+
+void TestPublishGLTiledBackground::benchmarkPan_data()
+{
+    QTest::addColumn<qreal>("pixelsPerSceneUnit");
+
+    QTest::newRow("1:1") << 1.0;
+    QTest::newRow("1:4") << 0.25;
+}
+
+// Pan from one corner of the map to the opposite one, one scene unit is one target pixel
+void TestPublishGLTiledBackground::benchmarkPan()
+{
+    QFETCH(qreal, pixelsPerSceneUnit);
+
+    PublishGLTiledBackground* background = createBackground();
+    QVERIFY(background);
+    QVERIFY(_context->makeCurrent(_surface));
+    background->initialize(_context);
+
+    QOpenGLFunctions* f = _context->functions();
+    const QRectF imageRect = background->getSceneRect();
+    const QRectF visibleRect(-BENCHMARK_TARGET_WIDTH / 2.0, -BENCHMARK_TARGET_HEIGHT / 2.0, BENCHMARK_TARGET_WIDTH, BENCHMARK_TARGET_HEIGHT);
+    const QSizeF visibleSize(BENCHMARK_TARGET_WIDTH / pixelsPerSceneUnit, BENCHMARK_TARGET_HEIGHT / pixelsPerSceneUnit);
+    const QPointF start = imageRect.topLeft() + QPointF(visibleSize.width() / 2.0, visibleSize.height() / 2.0);
+    const QPointF end = imageRect.bottomRight() - QPointF(visibleSize.width() / 2.0, visibleSize.height() / 2.0);
+
+    qint64 paintTime = 0;
+    qint64 peakMemory = 0;
+    QElapsedTimer frameTimer;
+    for(int frame = 0; frame < BENCHMARK_PAN_FRAMES; ++frame)
+    {
+        QCoreApplication::processEvents();
+
+        // The projection stays on the target, so the view is scaled and moved through the scene rect
+        const QPointF center = start + ((end - start) * frame / (BENCHMARK_PAN_FRAMES - 1));
+        background->setSceneRect(QRectF((imageRect.topLeft() - center) * pixelsPerSceneUnit, imageRect.size() * pixelsPerSceneUnit));
+
+        frameTimer.start();
+        _stateCache.reset(_context);
+        f->glClear(GL_COLOR_BUFFER_BIT);
+        background->paintGL(_spriteBatch, &_stateCache, visibleRect, 1.0);
+        f->glFinish();
+        paintTime += frameTimer.nsecsElapsed();
+
+        peakMemory = qMax(peakMemory, background->getMemoryUsed());
+    }
+
+    const qreal frameTime = static_cast<qreal>(paintTime) / BENCHMARK_PAN_FRAMES / 1000000.0;
+    QTest::setBenchmarkResult(frameTime, QTest::WalltimeMilliseconds);
+    qDebug() << "[TestPublishGLTiledBackground] Pan at " << pixelsPerSceneUnit << ": " << frameTime << " ms per frame, tile latency: " << background->getAverageTileLatency()
+             << " ms, peak memory: " << (peakMemory / (1024 * 1024)) << " MB of " << (background->getMemoryBudget() / (1024 * 1024))
+             << " MB, loaded: " << background->getTilesLoaded() << ", evicted: " << background->getTilesEvicted() << ", cancelled: " << background->getTilesCancelled();
+
+    QVERIFY(background->getTilesLoaded() > 0);
+    delete background;
+}
+
+// A background of the map with its tile cache ready, the time until then goes to loadTime
+PublishGLTiledBackground* TestPublishGLTiledBackground::createBackground(qint64* loadTime)
+{
+    QElapsedTimer loadTimer;
+    loadTimer.start();
+
+    PublishGLTiledBackground* background = new PublishGLTiledBackground(_mapFile);
+    QSignalSpy readySpy(background, &PublishGLTiledBackground::tileReady);
+    if((background->getLevelCount() == 0) || (!readySpy.wait(BENCHMARK_LOAD_TIMEOUT)))
+    {
+        delete background;
+        return nullptr;
+    }
+
+    if(loadTime)
+        *loadTime = loadTimer.elapsed();
+
+    return background;
+}
+
+QString TestPublishGLTiledBackground::getTileCacheFile() const
+{
+    return QDir(PublishGLMipCache::getCacheDirectory()).filePath(QString::fromLatin1(PublishGLMipCache::getCacheKey(_mapFile)) + QString(".tiles"));
+}
+
+QTEST_MAIN(TestPublishGLTiledBackground)
+
+#include "tst_publishgltiledbackground.moc"
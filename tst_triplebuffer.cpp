@@ -0,0 +1,231 @@
+#include "triplebuffer.h"
+#include <QtTest>
+#include <QThread>
+#include <QMutex>
+#include <QAtomicInt>
+#include <functional>
+#include <cstring>
+
+const int STRESS_FRAME_COUNT = 200000;
+const int STRESS_FRAME_WORDS = 64;
+const int STRESS_RESET_INTERVAL = 97;
+const int BENCHMARK_FRAME_COUNT = 100000;
+
+// Producer/consumer tests for TripleBuffer. The stress test checks that the
+// consumer never sees a buffer the producer is still writing and never sees
+// frames out of order, the benchmarks compare the handoff under contention
+// with the mutex-guarded rotation it replaced.
+class TestTripleBuffer : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initialState();
+    void publishAndAcquire();
+    void overwriteUnread();
+    void resetDropsFrame();
+    void stressProducerConsumer();
+    void benchmarkLockFree();
+    void benchmarkMutex();
+};
+
+// Runs a function on its own thread
+class TestThread : public QThread
+{
+public:
+    explicit TestThread(std::function<void()> function) : _function(function) {}
+
+protected:
+    void run() override { _function(); }
+
+private:
+    std::function<void()> _function;
+};
+
+void TestTripleBuffer::initialState()
+{
+    TripleBuffer buffer;
+
+    QVERIFY(!buffer.isFresh());
+    QVERIFY(!buffer.acquire());
+    QVERIFY(buffer.getWriteIndex() != buffer.getReadIndex());
+}
+
+void TestTripleBuffer::publishAndAcquire()
+{
+    TripleBuffer buffer;
+
+    int written = buffer.getWriteIndex();
+    QVERIFY(!buffer.publish());
+    QVERIFY(buffer.isFresh());
+    QVERIFY(buffer.getWriteIndex() != written);
+    QVERIFY(buffer.getWriteIndex() != buffer.getReadIndex());
+
+    QVERIFY(buffer.acquire());
+    QCOMPARE(buffer.getReadIndex(), written);
+    QVERIFY(!buffer.isFresh());
+    QVERIFY(!buffer.acquire());
+    QCOMPARE(buffer.getReadIndex(), written);
+}
+
+void TestTripleBuffer::overwriteUnread()
+{
+    TripleBuffer buffer;
+
+    buffer.publish();
+    int latest = buffer.getWriteIndex();
+    QVERIFY(buffer.publish());
+
+    QVERIFY(buffer.acquire());
+    QCOMPARE(buffer.getReadIndex(), latest);
+}
+
+void TestTripleBuffer::resetDropsFrame()
+{
+    TripleBuffer buffer;
+
+    buffer.publish();
+    int readIndex = buffer.getReadIndex();
+    buffer.reset();
+
+    QVERIFY(!buffer.isFresh());
+    QVERIFY(!buffer.acquire());
+    QCOMPARE(buffer.getReadIndex(), readIndex);
+
+    // The three indices are still distinct after a reset
+    int written = buffer.getWriteIndex();
+    QVERIFY(written != readIndex);
+    QVERIFY(!buffer.publish());
+    QVERIFY(buffer.acquire());
+    QCOMPARE(buffer.getReadIndex(), written);
+}
+
+void TestTripleBuffer::stressProducerConsumer()
+{
+    TripleBuffer buffer;
+    int frames[3][STRESS_FRAME_WORDS];
+    memset(frames, 0, sizeof(frames));
+    QAtomicInt done(0);
+
+    // The producer fills every word of a frame with its sequence number and
+    // now and then drops the published frame like a resize would
+    TestThread producer([&]()
+    {
+        for(int sequence = 1; sequence <= STRESS_FRAME_COUNT; ++sequence)
+        {
+            int* frame = frames[buffer.getWriteIndex()];
+            for(int i = 0; i < STRESS_FRAME_WORDS; ++i)
+                frame[i] = sequence;
+
+            buffer.publish();
+            if((sequence % STRESS_RESET_INTERVAL) == 0)
+                buffer.reset();
+        }
+        done.storeRelease(1);
+    });
+
+    int lastSequence = 0;
+    int framesRead = 0;
+    bool torn = false;
+    bool ordered = true;
+
+    producer.start();
+    while((done.loadAcquire() == 0) || (buffer.isFresh()))
+    {
+        if(!buffer.acquire())
+            continue;
+
+        const int* frame = frames[buffer.getReadIndex()];
+        int sequence = frame[0];
+        for(int i = 1; i < STRESS_FRAME_WORDS; ++i)
+        {
+            if(frame[i] != sequence)
+                torn = true;
+        }
+
+        if(sequence <= lastSequence)
+            ordered = false;
+
+        lastSequence = sequence;
+        ++framesRead;
+    }
+    producer.wait();
+
+    QVERIFY(!torn);
+    QVERIFY(ordered);
+    QVERIFY(framesRead > 0);
+    qDebug() << "[TestTripleBuffer] Frames read: " << framesRead << " of " << STRESS_FRAME_COUNT;
+}
+
+// Consumer throughput with a producer publishing as fast as it can
+void TestTripleBuffer::benchmarkLockFree()
+{
+    TripleBuffer buffer;
+    QAtomicInt stop(0);
+
+    TestThread producer([&]()
+    {
+        while(stop.loadAcquire() == 0)
+            buffer.publish();
+    });
+    producer.start();
+
+    int acquired = 0;
+    QBENCHMARK
+    {
+        for(int i = 0; i < BENCHMARK_FRAME_COUNT; ++i)
+        {
+            if(buffer.acquire())
+                ++acquired;
+        }
+    }
+
+    stop.storeRelease(1);
+    producer.wait();
+    QVERIFY(acquired > 0);
+}
+
+// The same handoff through the mutex-guarded index rotation used before TripleBuffer
+void TestTripleBuffer::benchmarkMutex()
+{
+    QMutex lock;
+    int renderIndex = 0;
+    int swapIndex = 1;
+    int displayIndex = 2;
+    bool updated = false;
+    QAtomicInt stop(0);
+
+    TestThread producer([&]()
+    {
+        while(stop.loadAcquire() == 0)
+        {
+            QMutexLocker locker(&lock);
+            std::swap(renderIndex, swapIndex);
+            updated = true;
+        }
+    });
+    producer.start();
+
+    int acquired = 0;
+    QBENCHMARK
+    {
+        for(int i = 0; i < BENCHMARK_FRAME_COUNT; ++i)
+        {
+            QMutexLocker locker(&lock);
+            if(updated)
+            {
+                std::swap(swapIndex, displayIndex);
+                updated = false;
+                ++acquired;
+            }
+        }
+    }
+
+    stop.storeRelease(1);
+    producer.wait();
+    QVERIFY(acquired > 0);
+}
+
+QTEST_APPLESS_MAIN(TestTripleBuffer)
+
+#include "tst_triplebuffer.moc"
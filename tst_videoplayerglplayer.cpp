@@ -0,0 +1,245 @@
+#include "videoplayerglplayer.h"
+#include "publishglstatecache.h"
+#include <QtTest>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#include <QOpenGLFramebufferObject>
+#include <QOpenGLShaderProgram>
+#include <QPointer>
+#include <QElapsedTimer>
+
+const int BENCHMARK_TARGET_WIDTH = 1920;
+const int BENCHMARK_TARGET_HEIGHT = 1080;
+const int BENCHMARK_FRAME_COUNT = 300;
+const int BENCHMARK_TIMEOUT = 60000;
+const int BENCHMARK_STOP_TIMEOUT = 5000;
+
+// Draws the player's quad over the whole target, the benchmark only needs the sampling and the draw
+const char* const BENCHMARK_VERTEX_SHADER =
+    "#version 330 core\n"
+    "layout (location = 0) in vec3 aPos;\n"
+    "layout (location = 2) in vec2 aTexCoord;\n"
+    "out vec2 TexCoord;\n"
+    "void main()\n"
+    "{\n"
+    "   gl_Position = vec4(aPos.xy * 2.0, 0.0, 1.0);\n"
+    "   TexCoord = aTexCoord;\n"
+    "}\n";
+
+const char* const BENCHMARK_FRAGMENT_SHADER =
+    "#version 330 core\n"
+    "out vec4 FragColor;\n"
+    "in vec2 TexCoord;\n"
+    "uniform sampler2D texture1;\n"
+    "void main()\n"
+    "{\n"
+    "   FragColor = texture(texture1, TexCoord);\n"
+    "}\n";
+
+// Plays the same video through the FBO path, where VLC renders into shared FBOs on its own
+// context, and through the software path, where VLC decodes into pooled buffers that are
+// streamed up through PBOs and converted on the GUI context. Reports the frames presented per
+// second and the GUI thread time per frame spent in updateFrame and paintGL.
+// benchmarkTextureAllocations counts the render textures the FBO path allocates
+// per presented frame, which stays at the three kept for the player's lifetime
+// instead of one per frame as with takeTexture.
+// The video is taken from DMH_BENCHMARK_VIDEO, ideally a 1080p clip of a few seconds.
+class TestVideoPlayerGLPlayer : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+    void cleanup();
+    void benchmarkFramePath_data();
+    void benchmarkFramePath();
+    void benchmarkTextureAllocations();
+
+private:
+    VideoPlayerGLPlayer* createPlayer(bool software);
+    int presentFrames(VideoPlayerGLPlayer* player, int frameCount, qint64* guiTime = nullptr);
+    void deletePlayer(VideoPlayerGLPlayer* player);
+
+    QString _videoFile;
+    QOffscreenSurface* _surface = nullptr;
+    QOpenGLContext* _context = nullptr;
+    QOpenGLFramebufferObject* _target = nullptr;
+    QOpenGLShaderProgram* _program = nullptr;
+    PublishGLStateCache _stateCache;
+};
+
+void TestVideoPlayerGLPlayer::initTestCase()
+{
+    _videoFile = qEnvironmentVariable("DMH_BENCHMARK_VIDEO");
+    if((_videoFile.isEmpty()) || (!QFile::exists(_videoFile)))
+        QSKIP("Set DMH_BENCHMARK_VIDEO to a video file to run the frame path benchmark");
+
+    QSurfaceFormat format;
+    format.setVersion(3, 3);
+    format.setProfile(QSurfaceFormat::CoreProfile);
+
+    _context = new QOpenGLContext();
+    _context->setFormat(format);
+    if(!_context->create())
+        QSKIP("No OpenGL 3.3 context available");
+
+    _surface = new QOffscreenSurface();
+    _surface->setFormat(_context->format());
+    _surface->create();
+    QVERIFY(_context->makeCurrent(_surface));
+
+    _target = new QOpenGLFramebufferObject(BENCHMARK_TARGET_WIDTH, BENCHMARK_TARGET_HEIGHT);
+    _program = new QOpenGLShaderProgram();
+    QVERIFY(_program->addShaderFromSourceCode(QOpenGLShader::Vertex, BENCHMARK_VERTEX_SHADER));
+    QVERIFY(_program->addShaderFromSourceCode(QOpenGLShader::Fragment, BENCHMARK_FRAGMENT_SHADER));
+    QVERIFY(_program->link());
+}
+
+void TestVideoPlayerGLPlayer::cleanupTestCase()
+{
+    if((!_context) || (!_context->makeCurrent(_surface)))
+        return;
+
+    delete _program;
+    delete _target;
+    _context->doneCurrent();
+
+    delete _context;
+    delete _surface;
+}
+
+void TestVideoPlayerGLPlayer::cleanup()
+{
+    VideoPlayerGLPlayer::setSoftwareFramesPreferred(false);
+}
+
+void TestVideoPlayerGLPlayer::benchmarkFramePath_data()
+{
+    QTest::addColumn<bool>("software");
+
+    QTest::newRow("FBO") << false;
+    QTest::newRow("software") << true;
+}
+
+void TestVideoPlayerGLPlayer::benchmarkFramePath()
+{
+    QFETCH(bool, software);
+
+    if((!software) && (!QOpenGLContext::supportsThreadedOpenGL()))
+        QSKIP("The FBO path needs threaded OpenGL");
+
+    VideoPlayerGLPlayer* player = createPlayer(software);
+    if(!player)
+        QSKIP("VLC could not open the video");
+    QCOMPARE(player->isSoftwareFrames(), software);
+
+    qint64 guiTime = 0;
+    QElapsedTimer playTimer;
+    playTimer.start();
+    const int framesPresented = presentFrames(player, BENCHMARK_FRAME_COUNT, &guiTime);
+    const qint64 playTime = playTimer.elapsed();
+
+    deletePlayer(player);
+
+    QVERIFY(framesPresented > 0);
+    const qreal guiTimePerFrame = static_cast<qreal>(guiTime) / framesPresented / 1000000.0;
+    QTest::setBenchmarkResult(guiTimePerFrame, QTest::WalltimeMilliseconds);
+    qDebug() << "[TestVideoPlayerGLPlayer] " << (software ? "Software" : "FBO") << " path: " << framesPresented << " frames in " << playTime << " ms ("
+             << (framesPresented * 1000.0 / qMax(playTime, static_cast<qint64>(1))) << " fps), GUI thread " << guiTimePerFrame << " ms per frame";
+}
+
+// The render textures are allocated when VLC sizes its output and then kept, so presenting more
+// frames must not allocate more of them
+void TestVideoPlayerGLPlayer::benchmarkTextureAllocations()
+{
+    if(!QOpenGLContext::supportsThreadedOpenGL())
+        QSKIP("The FBO path needs threaded OpenGL");
+
+    VideoPlayerGLPlayer* player = createPlayer(false);
+    if(!player)
+        QSKIP("VLC could not open the video");
+
+    QVERIFY(presentFrames(player, 1) > 0);
+    const quint64 initialAllocations = player->getTextureAllocations();
+    presentFrames(player, BENCHMARK_FRAME_COUNT);
+
+    const quint64 framesPresented = player->getFramesPresented();
+    const quint64 allocations = player->getTextureAllocations();
+    deletePlayer(player);
+
+    QCOMPARE(allocations, initialAllocations);
+    const qreal allocationsPerFrame = static_cast<qreal>(allocations) / static_cast<qreal>(framesPresented);
+    QTest::setBenchmarkResult(allocationsPerFrame, QTest::Events);
+    qDebug() << "[TestVideoPlayerGLPlayer] " << allocations << " texture allocations for " << framesPresented << " frames, " << allocationsPerFrame << " per frame";
+}
+
+// A player drawing into the benchmark target, nullptr if VLC can't open the video
+VideoPlayerGLPlayer* TestVideoPlayerGLPlayer::createPlayer(bool software)
+{
+    const QSize targetSize(BENCHMARK_TARGET_WIDTH, BENCHMARK_TARGET_HEIGHT);
+
+    VideoPlayerGLPlayer::setSoftwareFramesPreferred(software);
+    if(!_context->makeCurrent(_surface))
+        return nullptr;
+
+    VideoPlayerGLPlayer* player = new VideoPlayerGLPlayer(_videoFile, _context, _context->format(), targetSize, true, false);
+    if(player->isError())
+    {
+        delete player;
+        return nullptr;
+    }
+
+    player->targetResized(targetSize);
+    player->initializationComplete();
+    return player;
+}
+
+// Present new frames the way the map renderer does until the count or the timeout is reached,
+// adding only the GUI thread work to guiTime. Returns the frames presented.
+int TestVideoPlayerGLPlayer::presentFrames(VideoPlayerGLPlayer* player, int frameCount, qint64* guiTime)
+{
+    QOpenGLFunctions* f = _context->functions();
+
+    int framesPresented = 0;
+    QElapsedTimer playTimer;
+    QElapsedTimer frameTimer;
+    playTimer.start();
+    while((framesPresented < frameCount) && (playTimer.elapsed() < BENCHMARK_TIMEOUT))
+    {
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 1);
+        if(!player->isNewFrameAvailable())
+            continue;
+
+        _context->makeCurrent(_surface);
+
+        frameTimer.start();
+        _stateCache.reset(_context);
+        if(player->updateFrame(&_stateCache))
+        {
+            // The planar conversion leaves the default framebuffer bound
+            _target->bind();
+            f->glViewport(0, 0, BENCHMARK_TARGET_WIDTH, BENCHMARK_TARGET_HEIGHT);
+            _stateCache.useProgram(_program->programId());
+            player->paintGL(&_stateCache);
+            f->glFlush();
+            if(guiTime)
+                *guiTime += frameTimer.nsecsElapsed();
+            ++framesPresented;
+        }
+    }
+
+    return framesPresented;
+}
+
+void TestVideoPlayerGLPlayer::deletePlayer(VideoPlayerGLPlayer* player)
+{
+    QPointer<VideoPlayerGLPlayer> guard(player);
+    player->stopThenDelete();
+    QTRY_VERIFY_WITH_TIMEOUT(guard.isNull(), BENCHMARK_STOP_TIMEOUT);
+}
+
+QTEST_MAIN(TestVideoPlayerGLPlayer)
+
+#include "tst_videoplayerglplayer.moc"
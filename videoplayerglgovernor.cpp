@@ -0,0 +1,155 @@
+#include "videoplayerglgovernor.h"
+#include <QDebug>
+
+// Quality levels from full quality down, as render scale and frame divisor
+struct VideoPlayerGLGovernorLevel
+{
+    qreal renderScale;
+    int frameDivisor;
+};
+
+const VideoPlayerGLGovernorLevel GOVERNOR_LEVELS[] = {
+    { 1.0,  1 },
+    { 0.75, 1 },
+    { 0.5,  1 },
+    { 0.5,  2 },
+    { 0.35, 2 },
+    { 0.35, 3 }
+};
+const int GOVERNOR_LEVEL_COUNT = sizeof(GOVERNOR_LEVELS) / sizeof(GOVERNOR_LEVELS[0]);
+
+const qint64 GOVERNOR_DEFAULT_LATENCY_BUDGET = 50 * 1000 * 1000; // 50 ms in ns
+const int GOVERNOR_WINDOW_FRAMES = 60;
+const int GOVERNOR_HEADROOM_WINDOWS = 3;
+const qreal GOVERNOR_DROP_RATIO_LIMIT = 0.1;
+
+VideoPlayerGLGovernor::VideoPlayerGLGovernor(QObject *parent) :
+    QObject(parent),
+    _enabled(false),
+    _latencyBudget(GOVERNOR_DEFAULT_LATENCY_BUDGET),
+    _level(0),
+    _windowFrames(0),
+    _windowLatency(0),
+    _windowMaxLatency(0),
+    _windowStartDropped(0),
+    _lastDropped(0),
+    _headroomWindows(0)
+{
+}
+
+bool VideoPlayerGLGovernor::isEnabled() const
+{
+    return _enabled;
+}
+
+void VideoPlayerGLGovernor::setEnabled(bool enabled)
+{
+    if(_enabled == enabled)
+        return;
+
+    _enabled = enabled;
+    if(!_enabled)
+        setLevel(0, QString("governor disabled"));
+
+    reset();
+}
+
+// Budget for the delay from VLC handing a frame over to its pickup for display, in nanoseconds
+qint64 VideoPlayerGLGovernor::getLatencyBudget() const
+{
+    return _latencyBudget;
+}
+
+void VideoPlayerGLGovernor::setLatencyBudget(qint64 budget)
+{
+    _latencyBudget = budget;
+}
+
+int VideoPlayerGLGovernor::getLevel() const
+{
+    return _level;
+}
+
+int VideoPlayerGLGovernor::getLevelCount() const
+{
+    return GOVERNOR_LEVEL_COUNT;
+}
+
+qreal VideoPlayerGLGovernor::getRenderScale() const
+{
+    return GOVERNOR_LEVELS[_level].renderScale;
+}
+
+int VideoPlayerGLGovernor::getFrameDivisor() const
+{
+    return GOVERNOR_LEVELS[_level].frameDivisor;
+}
+
+void VideoPlayerGLGovernor::reset()
+{
+    _windowFrames = 0;
+    _windowLatency = 0;
+    _windowMaxLatency = 0;
+    _windowStartDropped = _lastDropped;
+    _headroomWindows = 0;
+}
+
+// Add one presented frame, with its pickup delay and the running total of dropped frames
+void VideoPlayerGLGovernor::addFrameSample(qint64 pickupDelay, quint64 droppedFrames)
+{
+    _lastDropped = droppedFrames;
+
+    if(!_enabled)
+        return;
+
+    ++_windowFrames;
+    _windowLatency += pickupDelay;
+    if(pickupDelay > _windowMaxLatency)
+        _windowMaxLatency = pickupDelay;
+
+    if(_windowFrames >= GOVERNOR_WINDOW_FRAMES)
+        evaluateWindow();
+}
+
+void VideoPlayerGLGovernor::evaluateWindow()
+{
+    qint64 averageLatency = _windowLatency / _windowFrames;
+    quint64 dropped = _lastDropped - _windowStartDropped;
+    qreal dropRatio = static_cast<qreal>(dropped) / static_cast<qreal>(_windowFrames + dropped);
+
+    if((averageLatency > _latencyBudget) || (dropRatio > GOVERNOR_DROP_RATIO_LIMIT))
+    {
+        _headroomWindows = 0;
+        if(_level < GOVERNOR_LEVEL_COUNT - 1)
+            setLevel(_level + 1, QString("over budget: average pickup delay %1 ms, max %2 ms, dropped %3 of %4 frames").arg(averageLatency / 1000000).arg(_windowMaxLatency / 1000000).arg(dropped).arg(_windowFrames + dropped));
+    }
+    else if((averageLatency < _latencyBudget / 2) && (dropped == 0))
+    {
+        // Only step back up after sustained headroom to avoid oscillating
+        if((++_headroomWindows >= GOVERNOR_HEADROOM_WINDOWS) && (_level > 0))
+        {
+            _headroomWindows = 0;
+            setLevel(_level - 1, QString("headroom: average pickup delay %1 ms, max %2 ms, no dropped frames").arg(averageLatency / 1000000).arg(_windowMaxLatency / 1000000));
+        }
+    }
+    else
+    {
+        _headroomWindows = 0;
+    }
+
+    _windowFrames = 0;
+    _windowLatency = 0;
+    _windowMaxLatency = 0;
+    _windowStartDropped = _lastDropped;
+}
+
+void VideoPlayerGLGovernor::setLevel(int level, const QString& reason)
+{
+    if((level < 0) || (level >= GOVERNOR_LEVEL_COUNT) || (level == _level))
+        return;
+
+    _level = level;
+
+    qDebug() << "[VideoPlayerGLGovernor] Quality level " << _level << ": render scale " << getRenderScale() << ", frame divisor " << getFrameDivisor() << " - " << reason;
+    emit qualityChanged(_level, getRenderScale(), getFrameDivisor(), reason);
+}
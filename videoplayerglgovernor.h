@@ -0,0 +1,51 @@
+#ifndef VIDEOPLAYERGLGOVERNOR_H
+#define VIDEOPLAYERGLGOVERNOR_H
+
+#include <QObject>
+
+// Watches the swap-to-pickup delay and dropped frames of a video player and
+// steps the render resolution and frame rate down when they exceed the budget,
+// and back up again once there is headroom. A lower render scale saves VLC
+// render work, a frame divisor only saves presentation work since VLC still
+// decodes and renders every frame.
+class VideoPlayerGLGovernor : public QObject
+{
+    Q_OBJECT
+public:
+    explicit VideoPlayerGLGovernor(QObject *parent = nullptr);
+
+    bool isEnabled() const;
+    void setEnabled(bool enabled);
+
+    qint64 getLatencyBudget() const;
+    void setLatencyBudget(qint64 budget);
+
+    int getLevel() const;
+    int getLevelCount() const;
+    qreal getRenderScale() const;
+    int getFrameDivisor() const;
+
+    void reset();
+    void addFrameSample(qint64 pickupDelay, quint64 droppedFrames);
+
+signals:
+    void qualityChanged(int level, qreal renderScale, int frameDivisor, const QString& reason);
+
+protected:
+    void evaluateWindow();
+    void setLevel(int level, const QString& reason);
+
+    bool _enabled;
+    qint64 _latencyBudget;
+    int _level;
+
+    // Current measurement window
+    int _windowFrames;
+    qint64 _windowLatency;
+    qint64 _windowMaxLatency;
+    quint64 _windowStartDropped;
+    quint64 _lastDropped;
+    int _headroomWindows;
+};
+
+#endif // VIDEOPLAYERGLGOVERNOR_H
@@ -0,0 +1,443 @@
+#include "videoplayerglloopcache.h"
+#include <QTemporaryFile>
+#include <QStandardPaths>
+#include <QDir>
+#include <QStorageInfo>
+#include <QDebug>
+#include <algorithm>
+#include <cstring>
+
+const qint64 LOOP_CACHE_MEMORY_LIMIT = 4096LL * 1024LL * 1024LL;
+const qint64 LOOP_CACHE_FILE_RESERVE = 1024LL * 1024LL * 1024LL;
+const int LOOP_CACHE_RATE_FRAMES = 10;
+const int LOOP_CACHE_BUDGET_HEADROOM = 10;
+const int LOOP_CACHE_WRITE_QUEUE = 8;
+const int LOOP_CACHE_COMPRESSION_LEVEL = 1;
+const int LOOP_CACHE_PREFETCH_FRAMES = 2;
+const qint64 LOOP_CACHE_DEFAULT_INTERVAL = 40000000;
+
+VideoPlayerGLLoopCache::VideoPlayerGLLoopCache(Storage storage, qint64 budget) :
+    _storage(storage),
+    _budget(budget),
+    _budgetLimit(budget),
+    _budgetSized(budget > 0),
+    _loopLength(0),
+    _captureLock(),
+    _frames(),
+    _frameData(),
+    _frameSize(),
+    _frameBytes(0),
+    _firstTimestamp(0),
+    _size(0),
+    _abandoned(0),
+    _complete(false),
+    _file(nullptr),
+    _worker(),
+    _writeSlots(LOOP_CACHE_WRITE_QUEUE),
+    _fileSize(0),
+    _map(nullptr),
+    _decodeLock(),
+    _decodedFrames(),
+    _decodedIndices(),
+    _nextDecodeSlot(0),
+    _shownSlot(-1),
+    _decodesPending(),
+    _hits(0),
+    _misses(0)
+{
+    for(int i = 0; i < DECODE_SLOT_COUNT; ++i)
+        _decodedIndices[i] = -1;
+
+    // One worker keeps the frames in order in the file
+    _worker.setMaxThreadCount(1);
+
+    QDir cacheDir(QStandardPaths::writableLocation(QStandardPaths::CacheLocation));
+    if(_storage == Storage_File)
+    {
+        cacheDir.mkpath(QString("videoloops"));
+        _file = new QTemporaryFile(cacheDir.filePath(QString("videoloops/loopXXXXXX.cache")));
+        if(!_file->open())
+        {
+            qDebug() << "[VideoPlayerGLLoopCache] ERROR: unable to create loop cache file " << _file->fileTemplate();
+            abandon();
+        }
+    }
+
+    // Without a budget the capture may use up to the limit until the loop length tells it what it needs
+    if(_budgetLimit <= 0)
+    {
+        if(_storage == Storage_File)
+            _budgetLimit = qMax(QStorageInfo(cacheDir.filePath(QString("videoloops"))).bytesAvailable() - LOOP_CACHE_FILE_RESERVE, static_cast<qint64>(0));
+        else
+            _budgetLimit = LOOP_CACHE_MEMORY_LIMIT;
+        _budget = _budgetLimit;
+    }
+
+    qDebug() << "[VideoPlayerGLLoopCache] Capturing loop into " << ((_storage == Storage_File) ? "file" : "memory") << " with a budget limit of " << (_budgetLimit / (1024 * 1024)) << " MB";
+}
+
+VideoPlayerGLLoopCache::~VideoPlayerGLLoopCache()
+{
+    abandon();
+    _worker.waitForDone();
+
+    if((_file) && (_map))
+        _file->unmap(_map);
+
+    delete _file;
+}
+
+VideoPlayerGLLoopCache::Storage VideoPlayerGLLoopCache::getStorage() const
+{
+    return _storage;
+}
+
+qint64 VideoPlayerGLLoopCache::getBudget() const
+{
+    return _budget;
+}
+
+qint64 VideoPlayerGLLoopCache::getBudgetLimit() const
+{
+    return _budgetLimit;
+}
+
+// Length of the loop in nanoseconds, as soon as VLC knows it
+void VideoPlayerGLLoopCache::setLoopLength(qint64 loopLength)
+{
+    _loopLength.storeRelease(loopLength);
+}
+
+// Store a copy of a decoded frame, returns false once the capture has been abandoned
+bool VideoPlayerGLLoopCache::addFrame(const uchar* data, size_t frameBytes, const QSize& frameSize, qint64 timestamp)
+{
+    if((!data) || (_complete) || (isAbandoned()))
+        return false;
+
+    QByteArray frame(reinterpret_cast<const char*>(data), static_cast<int>(frameBytes));
+
+    QMutexLocker locker(&_captureLock);
+    if(_frames.isEmpty())
+    {
+        _frameSize = frameSize;
+        _frameBytes = frameBytes;
+        _firstTimestamp = timestamp;
+    }
+    else if((frameSize != _frameSize) || (frameBytes != _frameBytes))
+    {
+        // Replay needs a single frame layout
+        qDebug() << "[VideoPlayerGLLoopCache] Frame format changed during the capture, abandoning the loop cache";
+        locker.unlock();
+        abandon();
+        return false;
+    }
+
+    CachedFrame cachedFrame;
+    cachedFrame._timestamp = timestamp - _firstTimestamp;
+    cachedFrame._offset = 0;
+    cachedFrame._size = 0;
+    int index = _frames.count();
+    _frames.append(cachedFrame);
+
+    if(!sizeBudget())
+    {
+        locker.unlock();
+        abandon();
+        return false;
+    }
+
+    if(_storage == Storage_Memory)
+    {
+        if(_size + static_cast<qint64>(frameBytes) > _budget)
+        {
+            qDebug() << "[VideoPlayerGLLoopCache] Loop does not fit the budget of " << (_budget / (1024 * 1024)) << " MB, abandoning the loop cache";
+            locker.unlock();
+            abandon();
+            return false;
+        }
+
+        _frameData.append(frame);
+        _frames[index]._size = static_cast<qint64>(frameBytes);
+        _size += static_cast<qint64>(frameBytes);
+        return true;
+    }
+
+    locker.unlock();
+
+    // Compression runs behind the decoder, which only waits once the writer falls too far behind
+    _writeSlots.acquire();
+    _worker.start([this, index, frame]()
+    {
+        writeFrame(index, frame);
+        _writeSlots.release();
+    });
+
+    return true;
+}
+
+// Once the loop length and enough frames to measure the frame rate are in, size the budget
+// for the whole loop with some headroom. Returns false if the loop can never fit the limit,
+// so the capture is abandoned right away instead of once the limit is reached.
+bool VideoPlayerGLLoopCache::sizeBudget()
+{
+    qint64 loopLength = _loopLength.loadAcquire();
+    if((_budgetSized) || (loopLength <= 0) || (_frames.count() < LOOP_CACHE_RATE_FRAMES))
+        return true;
+
+    _budgetSized = true;
+    qint64 frameCount = (loopLength / getFrameInterval()) + 1;
+    qint64 required = frameCount * static_cast<qint64>(_frameBytes) * (100 + LOOP_CACHE_BUDGET_HEADROOM) / 100;
+    if(required > _budgetLimit)
+    {
+        qDebug() << "[VideoPlayerGLLoopCache] Loop of about " << frameCount << " frames needs " << (required / (1024 * 1024)) << " MB, more than the limit of " << (_budgetLimit / (1024 * 1024)) << " MB, abandoning the loop cache";
+        return false;
+    }
+
+    _budget = required;
+    qDebug() << "[VideoPlayerGLLoopCache] Loop of about " << frameCount << " frames, budget sized to " << (_budget / (1024 * 1024)) << " MB";
+    return true;
+}
+
+// Stop capturing and drop what has been captured so far
+void VideoPlayerGLLoopCache::abandon()
+{
+    if(!_abandoned.testAndSetOrdered(0, 1))
+        return;
+
+    QMutexLocker locker(&_captureLock);
+    _frameData.clear();
+    _size = 0;
+}
+
+bool VideoPlayerGLLoopCache::isAbandoned() const
+{
+    return _abandoned.loadAcquire() != 0;
+}
+
+// Wait for outstanding writes and make the frames available for replay
+bool VideoPlayerGLLoopCache::finishCapture()
+{
+    _worker.waitForDone();
+
+    if(_complete)
+        return true;
+
+    QMutexLocker locker(&_captureLock);
+    if((isAbandoned()) || (_frames.isEmpty()))
+        return false;
+
+    if(_storage == Storage_File)
+    {
+        _file->flush();
+        _map = _file->map(0, _fileSize);
+        if(!_map)
+        {
+            qDebug() << "[VideoPlayerGLLoopCache] ERROR: unable to map loop cache file " << _file->fileName();
+            return false;
+        }
+
+        // The replay decompresses into these, so it never allocates per frame
+        for(int i = 0; i < DECODE_SLOT_COUNT; ++i)
+            _decodedFrames[i] = QByteArray(static_cast<int>(_frameBytes), Qt::Uninitialized);
+    }
+
+    _complete = true;
+
+    qDebug() << "[VideoPlayerGLLoopCache] Loop captured: " << _frames.count() << " frames of " << _frameSize << ", " << (static_cast<double>(getLoopDuration()) / 1000000000.0) << " s, " << (_size / 1024) << " KB";
+
+    return true;
+}
+
+bool VideoPlayerGLLoopCache::isComplete() const
+{
+    return _complete;
+}
+
+int VideoPlayerGLLoopCache::getFrameCount() const
+{
+    return _frames.count();
+}
+
+QSize VideoPlayerGLLoopCache::getFrameSize() const
+{
+    return _frameSize;
+}
+
+size_t VideoPlayerGLLoopCache::getFrameBytes() const
+{
+    return _frameBytes;
+}
+
+// Length of one pass in nanoseconds, the last frame is shown for an average frame interval
+qint64 VideoPlayerGLLoopCache::getLoopDuration() const
+{
+    if(_frames.isEmpty())
+        return 0;
+
+    return _frames.last()._timestamp + getFrameInterval();
+}
+
+// Average time between frames in nanoseconds
+qint64 VideoPlayerGLLoopCache::getFrameInterval() const
+{
+    if(_frames.count() < 2)
+        return LOOP_CACHE_DEFAULT_INTERVAL;
+
+    return qMax(_frames.last()._timestamp / (_frames.count() - 1), static_cast<qint64>(1));
+}
+
+// Index of the frame to show at the given time into the loop
+int VideoPlayerGLLoopCache::getFrameAt(qint64 loopTime) const
+{
+    if(_frames.isEmpty())
+        return -1;
+
+    auto it = std::upper_bound(_frames.constBegin(), _frames.constEnd(), loopTime, [](qint64 time, const CachedFrame& frame) {
+        return time < frame._timestamp;
+    });
+
+    return qMax(static_cast<int>(it - _frames.constBegin()) - 1, 0);
+}
+
+// The frame to show, nullptr if a file frame has not been decompressed yet. A decompressed frame
+// stays valid until the next call, the worker never reuses the slot of the frame last returned.
+const uchar* VideoPlayerGLLoopCache::getFrameData(int index)
+{
+    if((!_complete) || (index < 0) || (index >= _frames.count()))
+        return nullptr;
+
+    if(_storage == Storage_Memory)
+        return reinterpret_cast<const uchar*>(_frameData.at(index).constData());
+
+    QMutexLocker locker(&_decodeLock);
+    for(int i = 0; i < DECODE_SLOT_COUNT; ++i)
+    {
+        if(_decodedIndices[i] == index)
+        {
+            _shownSlot = i;
+            return reinterpret_cast<const uchar*>(_decodedFrames[i].constData());
+        }
+    }
+
+    return nullptr;
+}
+
+// Queue the given frame and the ones following it for decompression on the worker, file storage only
+void VideoPlayerGLLoopCache::prefetchFrames(int index)
+{
+    if((!_complete) || (_storage != Storage_File) || (index < 0) || (index >= _frames.count()))
+        return;
+
+    QMutexLocker locker(&_decodeLock);
+    for(int i = 0; i <= LOOP_CACHE_PREFETCH_FRAMES; ++i)
+    {
+        int frameIndex = (index + i) % _frames.count();
+        if(_decodesPending.contains(frameIndex))
+            continue;
+
+        bool decoded = false;
+        for(int slot = 0; slot < DECODE_SLOT_COUNT; ++slot)
+            decoded = ((decoded) || (_decodedIndices[slot] == frameIndex));
+        if(decoded)
+            continue;
+
+        _decodesPending.insert(frameIndex);
+        _worker.start([this, frameIndex]()
+        {
+            decodeFrame(frameIndex);
+        });
+    }
+}
+
+// Bytes held by the cache, in memory or on disk
+qint64 VideoPlayerGLLoopCache::getSize() const
+{
+    return _size;
+}
+
+// A frame shown from the cache
+void VideoPlayerGLLoopCache::recordHit()
+{
+    _hits.fetchAndAddRelaxed(1);
+}
+
+// A frame that had to be decoded
+void VideoPlayerGLLoopCache::recordMiss()
+{
+    _misses.fetchAndAddRelaxed(1);
+}
+
+quint64 VideoPlayerGLLoopCache::getHits() const
+{
+    return static_cast<quint64>(_hits.loadAcquire());
+}
+
+quint64 VideoPlayerGLLoopCache::getMisses() const
+{
+    return static_cast<quint64>(_misses.loadAcquire());
+}
+
+qreal VideoPlayerGLLoopCache::getHitRate() const
+{
+    quint64 total = getHits() + getMisses();
+    return (total > 0) ? static_cast<qreal>(getHits()) / static_cast<qreal>(total) : 0.0;
+}
+
+// Decompress a frame into the oldest slot not being shown, runs on the worker thread
+void VideoPlayerGLLoopCache::decodeFrame(int index)
+{
+    const CachedFrame& frame = _frames.at(index);
+    QByteArray data = qUncompress(_map + frame._offset, static_cast<int>(frame._size));
+
+    QMutexLocker locker(&_decodeLock);
+    _decodesPending.remove(index);
+    if(static_cast<size_t>(data.size()) != _frameBytes)
+    {
+        qDebug() << "[VideoPlayerGLLoopCache] ERROR: unable to decompress loop frame " << index;
+        return;
+    }
+
+    int slot = _nextDecodeSlot;
+    if(slot == _shownSlot)
+        slot = (slot + 1) % DECODE_SLOT_COUNT;
+    _nextDecodeSlot = (slot + 1) % DECODE_SLOT_COUNT;
+    _decodedIndices[slot] = -1;
+    locker.unlock();
+
+    // The slot is neither shown nor findable while it is filled
+    memcpy(_decodedFrames[slot].data(), data.constData(), _frameBytes);
+
+    locker.relock();
+    _decodedIndices[slot] = index;
+}
+
+// Compress a frame and append it to the file, runs on the worker thread
+void VideoPlayerGLLoopCache::writeFrame(int index, const QByteArray& frame)
+{
+    if(isAbandoned())
+        return;
+
+    QByteArray compressed = qCompress(frame, LOOP_CACHE_COMPRESSION_LEVEL);
+
+    QMutexLocker locker(&_captureLock);
+    if(_fileSize + compressed.size() > _budget)
+    {
+        qDebug() << "[VideoPlayerGLLoopCache] Loop does not fit the budget of " << (_budget / (1024 * 1024)) << " MB, abandoning the loop cache";
+        locker.unlock();
+        abandon();
+        return;
+    }
+
+    if(_file->write(compressed) != compressed.size())
+    {
+        qDebug() << "[VideoPlayerGLLoopCache] ERROR: unable to write loop cache file " << _file->fileName();
+        locker.unlock();
+        abandon();
+        return;
+    }
+
+    _frames[index]._offset = _fileSize;
+    _frames[index]._size = compressed.size();
+    _fileSize += compressed.size();
+    _size = _fileSize;
+}
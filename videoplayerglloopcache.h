@@ -0,0 +1,116 @@
+#ifndef VIDEOPLAYERGLLOOPCACHE_H
+#define VIDEOPLAYERGLLOOPCACHE_H
+
+#include <QVector>
+#include <QByteArray>
+#include <QSize>
+#include <QMutex>
+#include <QSemaphore>
+#include <QThreadPool>
+#include <QAtomicInt>
+#include <QAtomicInteger>
+#include <QSet>
+
+class QTemporaryFile;
+
+// Holds every decoded frame of the first pass through a short looping video,
+// so later passes can be shown without running the decoder. Frames are kept
+// either raw in memory or lightly compressed in a temporary file that is
+// memory mapped once the capture is complete. Unless a budget is given, it is
+// sized from the frame size, frame rate and loop length once those are known,
+// up to a limit. Captures that do not fit the budget are abandoned.
+class VideoPlayerGLLoopCache
+{
+public:
+    enum Storage
+    {
+        Storage_None = 0,   // No loop cache, every pass is decoded
+        Storage_Memory,     // Raw frames in memory, no cost to replay
+        Storage_File        // Compressed frames in a mapped file, decompressed on replay
+    };
+
+    explicit VideoPlayerGLLoopCache(Storage storage, qint64 budget = 0);
+    ~VideoPlayerGLLoopCache();
+
+    Storage getStorage() const;
+    qint64 getBudget() const;
+    qint64 getBudgetLimit() const;
+
+    // Capture side, called from the VLC thread
+    void setLoopLength(qint64 loopLength);
+    bool addFrame(const uchar* data, size_t frameBytes, const QSize& frameSize, qint64 timestamp);
+    void abandon();
+    bool isAbandoned() const;
+
+    // Call once VLC has stopped delivering frames
+    bool finishCapture();
+    bool isComplete() const;
+
+    // Replay side
+    int getFrameCount() const;
+    QSize getFrameSize() const;
+    size_t getFrameBytes() const;
+    qint64 getLoopDuration() const;
+    qint64 getFrameInterval() const;
+    int getFrameAt(qint64 loopTime) const;
+    const uchar* getFrameData(int index);
+    void prefetchFrames(int index);
+
+    // Statistics
+    qint64 getSize() const;
+    void recordHit();
+    void recordMiss();
+    quint64 getHits() const;
+    quint64 getMisses() const;
+    qreal getHitRate() const;
+
+private:
+    static const int DECODE_SLOT_COUNT = 4;
+
+    struct CachedFrame
+    {
+        qint64 _timestamp;
+        qint64 _offset;
+        qint64 _size;
+    };
+
+    bool sizeBudget();
+    void writeFrame(int index, const QByteArray& frame);
+    void decodeFrame(int index);
+
+    Storage _storage;
+    qint64 _budget;
+    qint64 _budgetLimit;
+    bool _budgetSized;
+    QAtomicInteger<qint64> _loopLength;
+
+    // Capture data, the frame list is shared with the file writer
+    QMutex _captureLock;
+    QVector<CachedFrame> _frames;
+    QVector<QByteArray> _frameData;
+    QSize _frameSize;
+    size_t _frameBytes;
+    qint64 _firstTimestamp;
+    qint64 _size;
+    QAtomicInt _abandoned;
+    bool _complete;
+
+    // File storage, frames are compressed and written in order on one worker thread,
+    // which decompresses them into a few reused slots ahead of the replay afterwards
+    QTemporaryFile* _file;
+    QThreadPool _worker;
+    QSemaphore _writeSlots;
+    qint64 _fileSize;
+    uchar* _map;
+    QMutex _decodeLock;
+    QByteArray _decodedFrames[DECODE_SLOT_COUNT];
+    int _decodedIndices[DECODE_SLOT_COUNT];
+    int _nextDecodeSlot;
+    int _shownSlot;
+    QSet<int> _decodesPending;
+
+    QAtomicInt _hits;
+    QAtomicInt _misses;
+};
+
+#endif // VIDEOPLAYERGLLOOPCACHE_H
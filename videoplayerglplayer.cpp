@@ -1,17 +1,32 @@
 #include "videoplayerglplayer.h"
 #include "videoplayerglvideo.h"
+#include "videoplayerglgovernor.h"
+#include "publishglstatecache.h"
+#include "publishglunitquad.h"
+#include "imagekernels.h"
 #include <QOpenGLFunctions>
 #include <QOpenGLExtraFunctions>
+#include <QThreadPool>
+#include <QPointer>
 #include <QDebug>
+#include <cstring>
 
-#define VIDEO_DEBUG_MESSAGES
+//#define VIDEO_DEBUG_MESSAGES
+
+// Use the software frame path even where threaded OpenGL is available, e.g. to compare both paths
+//#define VIDEO_SOFTWARE_FRAMES
 
 const int stopCallComplete = 0x01;
 const int stopConfirmed = 0x02;
 const int stopComplete = stopCallComplete | stopConfirmed;
 const int INVALID_TRACK_ID = -99999;
+const quint64 FRAME_STATS_INTERVAL = 600;
+const qint64 LOOP_WRAP_THRESHOLD = 500;
+const char* const LOOP_REPEAT_OPTION = ":input-repeat=65535";
+
+QAtomicInt VideoPlayerGLPlayer::_softwareFramesPreferred(0);
 
-VideoPlayerGLPlayer::VideoPlayerGLPlayer(const QString& videoFile, QOpenGLContext* context, QSurfaceFormat format, QSize targetSize, bool playVideo, bool playAudio, QObject *parent) :
+VideoPlayerGLPlayer::VideoPlayerGLPlayer(const QString& videoFile, QOpenGLContext* context, QSurfaceFormat format, QSize targetSize, bool playVideo, bool playAudio, VideoPlayerGLLoopCache::Storage loopCache, QObject *parent) :
     VideoPlayerGL(parent),
     _videoFile(videoFile),
     _context(context),
@@ -20,8 +35,11 @@ VideoPlayerGLPlayer::VideoPlayerGLPlayer(const QString& videoFile, QOpenGLContex
     _playVideo(playVideo),
     _playAudio(playAudio),
     _video(nullptr),
+    _software(nullptr),
     //_tempTexture(0),
-    _fboTexture(-1),
+    _framesPresented(0),
+    _governor(nullptr),
+    _lastFramesAcquired(0),
     _vlcError(false),
     _vlcPlayer(nullptr),
     _vlcMedia(nullptr),
@@ -34,15 +52,40 @@ VideoPlayerGLPlayer::VideoPlayerGLPlayer(const QString& videoFile, QOpenGLContex
     _firstImage(false),
     _originalTrack(INVALID_TRACK_ID),
     _modelMatrix(),
-    _VAO(0),
-    _VBO(0),
-    _EBO(0)
+    _quad(nullptr),
+    _geometryDirty(1),
+    _screenshotRequested(0),
+    _screenshotFBO(0),
+    _screenshotPBO(0),
+    _screenshotSize(),
+    _screenshotFence(nullptr),
+    _loopCacheStorage(loopCache),
+    _loopCache(nullptr),
+    _loopTimer(),
+    _loopClock(),
+    _looping(false),
+    _repeating(false),
+    _loopBoundaryClock(),
+    _lastPlayTime(0),
+    _loopWrapTime(0),
+    _lastFrameTime(0),
+    _loopCount(0),
+    _lastLoopLatency(0),
+    _maxLoopLatency(0),
+    _lastLoopGap(0)
 {
+    _loopBoundaryClock.start();
+    _loopTimer.setTimerType(Qt::PreciseTimer);
+    connect(&_loopTimer, &QTimer::timeout, this, &VideoPlayerGLPlayer::advanceLoop);
+
     if(_context)
     {
 #ifdef Q_OS_WIN
         _videoFile.replace("/","\\\\");
 #endif
+        _governor = new VideoPlayerGLGovernor(this);
+        connect(_governor, &VideoPlayerGLGovernor::qualityChanged, this, &VideoPlayerGLPlayer::applyQualityLevel);
+
         _vlcError = !initializeVLC();
 #ifdef VIDEO_DEBUG_MESSAGES
         qDebug() << "[VideoPlayerGLPlayer] Player object initialized: " << this;
@@ -61,9 +104,12 @@ VideoPlayerGLPlayer::~VideoPlayerGLPlayer()
     _selfRestart = false;
     stopPlayer();
 
+    _loopTimer.stop();
     delete _video;
 
     cleanupGLObjects();
+    delete _software;
+    delete _loopCache;
 
 #ifdef VIDEO_DEBUG_MESSAGES
     qDebug() << "[VideoPlayerGLPlayer] Player object destroyed: " << this;
@@ -97,9 +143,48 @@ QOpenGLFramebufferObject* VideoPlayerGL::getVideoFrame()
 }
 */
 
-void VideoPlayerGLPlayer::paintGL()
+// Take the newest frame for the following paintGL calls. Returns true if the
+// video needs to be drawn again: a new frame, new geometry or a pending screenshot.
+// Call it before deciding what to redraw, paintGL itself never takes a new frame.
+bool VideoPlayerGLPlayer::updateFrame(PublishGLStateCache* stateCache)
+{
+    bool redraw = ((_geometryDirty.loadAcquire() != 0) || (isScreenshotPending()));
+    if((!_context) || ((!_video) && (!_software)))
+        return redraw;
+
+    if(_video)
+    {
+        if(_video->acquireFrame())
+            redraw = true;
+    }
+    else
+    {
+        // Software frames are uploaded, and converted if planar, right away. The bindings
+        // go through the state cache, the viewport and blending are left to the caller.
+        quint64 framesUploaded = _software->getFramesAcquired();
+        _software->uploadFrame(_context, stateCache);
+        if(_software->getFramesAcquired() != framesUploaded)
+            redraw = true;
+    }
+
+    // Feed newly taken frames to the quality governor
+    quint64 framesAcquired = _video ? _video->getFramesAcquired() : _software->getFramesAcquired();
+    if((_governor) && (framesAcquired != _lastFramesAcquired))
+    {
+        _lastFramesAcquired = framesAcquired;
+        if(_video)
+            _governor->addFrameSample(_video->getLastPickupDelay(), _video->getFramesDropped());
+        else
+            _governor->addFrameSample(_software->getLastPickupDelay(), _software->getFramesDropped());
+    }
+
+    return redraw;
+}
+
+// Draw the frame taken by the last updateFrame
+void VideoPlayerGLPlayer::paintGL(PublishGLStateCache* stateCache)
 {
-    if((!_context) || (!_video))
+    if((!_context) || ((!_video) && (!_software)))
         return;
 
     //    QOpenGLFunctions *f = QOpenGLContext::currentContext()->functions();
@@ -109,43 +194,85 @@ void VideoPlayerGLPlayer::paintGL()
     if((!f) || (!e))
         return;
 
-    /*
-    if(_video->isNewFrameAvailable())
+    updateGeometry();
+    if((!_quad) || (_videoSize.isEmpty()))
+        return;
+
+    // The display FBO keeps its texture for its whole lifetime, so just sample it.
+    // Software frames are streamed into a texture owned by this context instead.
+    GLuint frameTexture = 0;
+    QSize frameSize;
+    if(_video)
     {
         QOpenGLFramebufferObject *fbo = _video->getVideoFrame();
-        if(!fbo)
-            return;
-
-        if(_fboTexture > 0)
-            f->glDeleteTextures(1, &_fboTexture);
-
-        _fboTexture = fbo->takeTexture();
+        if(fbo)
+        {
+            frameTexture = fbo->texture();
+            frameSize = fbo->size();
+        }
+    }
+    else
+    {
+        frameTexture = _software->getTexture();
+        frameSize = _software->getVideoSize();
     }
 
-    if(_fboTexture == 0)
+    if(frameTexture == 0)
         return;
 
-    // qDebug() << "[VideoPlayerGLPlayer] Painting new texture: " << fboTexture;
-    e->glBindVertexArray(_VAO);
-    f->glBindTexture(GL_TEXTURE_2D, _fboTexture);
-    f->glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
-    */
+    if(stateCache)
+    {
+        stateCache->bindVertexArray(_quad->getVAO());
+        stateCache->bindTexture(GL_TEXTURE_2D, frameTexture);
+    }
+    else
+    {
+        e->glBindVertexArray(_quad->getVAO());
+        f->glBindTexture(GL_TEXTURE_2D, frameTexture);
+    }
+    _quad->draw(f);
 
+    // Screenshots are read back from the displayed frame without stalling the pipeline
+    collectScreenshot();
+    readScreenshot(frameTexture, frameSize);
 
-    QOpenGLFramebufferObject *fbo = _video->getVideoFrame();
-    if(!fbo)
-        return;
+    ++_framesPresented;
 
-    e->glBindVertexArray(_VAO);
-    GLuint fboTexture = fbo->takeTexture();
-    // qDebug() << "[VideoPlayerGLPlayer] Painting new texture: " << fboTexture;
-    if(fboTexture > 0)
+#ifdef VIDEO_DEBUG_MESSAGES
+    if((_framesPresented % FRAME_STATS_INTERVAL) == 0)
     {
-        f->glBindTexture(GL_TEXTURE_2D, fboTexture);
-        //f->glBindTexture(GL_TEXTURE_2D, _tempTexture);
-        f->glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
-        f->glDeleteTextures(1, &fboTexture);
+        if(getLoopCount() > 0)
+            qDebug() << "[VideoPlayerGLPlayer] Loops: " << getLoopCount() << ", last boundary: " << (getLastLoopLatency() / 1000) << " us, worst: " << (getMaxLoopLatency() / 1000) << " us, last frame gap: " << (getLastLoopGap() / 1000) << " us";
+
+        if(_video)
+        {
+            qDebug() << "[VideoPlayerGLPlayer] Frames presented: " << _framesPresented << ", texture allocations: " << _video->getTextureAllocations() << ", allocations per frame: " << (static_cast<double>(_video->getTextureAllocations()) / static_cast<double>(_framesPresented));
+            if(_video->getFenceSyncCount() > 0)
+                qDebug() << "[VideoPlayerGLPlayer] Fence syncs: " << _video->getFenceSyncCount() << ", frames still rendering: " << _video->getFenceStallCount() << ", last sync: " << _video->getLastFenceSyncTime() << " ns, average: " << (_video->getTotalFenceSyncTime() / static_cast<qint64>(_video->getFenceSyncCount())) << " ns";
+        }
+        else
+        {
+            qDebug() << "[VideoPlayerGLPlayer] Frames presented: " << _framesPresented << ", software frames uploaded: " << _software->getUploadCount() << ", frame pool allocations: " << _software->getBufferAllocations();
+            if(_software->getUploadCount() > 0)
+                qDebug() << "[VideoPlayerGLPlayer] Frame uploads: last: " << _software->getLastUploadTime() << " ns, average: " << (_software->getTotalUploadTime() / static_cast<qint64>(_software->getUploadCount())) << " ns, average bytes: " << (_software->getBytesUploaded() / _software->getUploadCount());
+            if(_loopCache)
+                qDebug() << "[VideoPlayerGLPlayer] Loop cache: " << (_loopCache->getSize() / 1024) << " KB, " << _loopCache->getFrameCount() << " frames, hits: " << _loopCache->getHits() << ", misses: " << _loopCache->getMisses() << ", hit rate: " << _loopCache->getHitRate();
+        }
     }
+#endif
+}
+
+// Is there a new frame or new geometry to be displayed
+bool VideoPlayerGLPlayer::isNewFrameAvailable() const
+{
+    // A pending screenshot needs paints to issue and collect the readback
+    if((_geometryDirty.loadAcquire() != 0) || (isScreenshotPending()))
+        return true;
+
+    if(_software)
+        return _software->isNewFrameAvailable();
+
+    return _video ? _video->isNewFrameAvailable() : false;
 }
 
 bool VideoPlayerGLPlayer::isPlayingVideo() const
@@ -228,7 +355,7 @@ QMutex* VideoPlayerGL::getMutex()
 
 QSize VideoPlayerGLPlayer::getOriginalSize() const
 {
-    QSize originalSize = _video ? _video->getVideoSize() : QSize();
+    QSize originalSize = _video ? _video->getSourceSize() : (_software ? _software->getSourceSize() : QSize());
 
 #ifdef VIDEO_DEBUG_MESSAGES
     qDebug() << "[VideoPlayerGLPlayer] Getting original size: " << originalSize;
@@ -260,14 +387,99 @@ void VideoPlayerGL::clearNewImage()
 void VideoPlayerGLPlayer::registerNewFrame()
 {
     //qDebug() << "[VideoPlayerGLPlayer] Confirming frame available";
+
+    // The first frame after the play time wrapped closes the loop boundary
+    qint64 now = _loopBoundaryClock.nsecsElapsed();
+    qint64 previousFrame = _lastFrameTime.fetchAndStoreOrdered(now);
+    qint64 wrapTime = _loopWrapTime.fetchAndStoreOrdered(0);
+    if(wrapTime > 0)
+    {
+        qint64 latency = now - wrapTime;
+        qint64 gap = (previousFrame > 0) ? now - previousFrame : 0;
+        _lastLoopLatency.storeRelease(latency);
+        _lastLoopGap.storeRelease(gap);
+        if(latency > _maxLoopLatency.loadAcquire())
+            _maxLoopLatency.storeRelease(latency);
+        _loopCount.fetchAndAddOrdered(1);
+
+#ifdef VIDEO_DEBUG_MESSAGES
+        qDebug() << "[VideoPlayerGLPlayer] Loop " << _loopCount.loadAcquire() << " completed, wrap to frame: " << (latency / 1000) << " us, frame gap: " << (gap / 1000) << " us";
+#endif
+    }
+
     emit frameAvailable();
 }
 
+bool VideoPlayerGLPlayer::isRenderAtTargetSize() const
+{
+    return _video ? _video->isRenderAtTargetSize() : false;
+}
+
+void VideoPlayerGLPlayer::setRenderAtTargetSize(bool renderAtTargetSize)
+{
+    qDebug() << "[VideoPlayerGLPlayer] Setting render at target size: " << renderAtTargetSize;
+
+    if(_video)
+        _video->setRenderAtTargetSize(renderAtTargetSize);
+}
+
+VideoPlayerGLVideo::ScaleQuality VideoPlayerGLPlayer::getScaleQuality() const
+{
+    return _video ? _video->getScaleQuality() : VideoPlayerGLVideo::ScaleQuality_Smooth;
+}
+
+void VideoPlayerGLPlayer::setScaleQuality(VideoPlayerGLVideo::ScaleQuality quality)
+{
+    qDebug() << "[VideoPlayerGLPlayer] Setting scale quality: " << quality;
+
+    if(_video)
+        _video->setScaleQuality(quality);
+}
+
+qint64 VideoPlayerGLPlayer::getRenderMemorySaved() const
+{
+    return _video ? _video->getRenderMemorySaved() : 0;
+}
+
+quint64 VideoPlayerGLPlayer::getFramesPresented() const
+{
+    return _framesPresented;
+}
+
+quint64 VideoPlayerGLPlayer::getTextureAllocations() const
+{
+    return _video ? _video->getTextureAllocations() : 0;
+}
+
+VideoPlayerGLGovernor* VideoPlayerGLPlayer::getGovernor() const
+{
+    return _governor;
+}
+
+bool VideoPlayerGLPlayer::isGovernorEnabled() const
+{
+    return _governor ? _governor->isEnabled() : false;
+}
+
+void VideoPlayerGLPlayer::setGovernorEnabled(bool enabled)
+{
+    qDebug() << "[VideoPlayerGLPlayer] Setting quality governor enabled: " << enabled;
+
+    if(_governor)
+        _governor->setEnabled(enabled);
+}
+
 QSurfaceFormat VideoPlayerGLPlayer::getFormat() const
 {
     return _format;
 }
 
+const GLfloat* VideoPlayerGLPlayer::getMatrixData()
+{
+    updateGeometry();
+    return _modelMatrix.constData();
+}
+
 QSize VideoPlayerGLPlayer::getSize() const
 {
     return _videoSize;
@@ -275,6 +487,9 @@ QSize VideoPlayerGLPlayer::getSize() const
 
 QImage VideoPlayerGLPlayer::getLastScreenshot()
 {
+    if(_software)
+        return _software->getLastFrame();
+
     if(!_video)
         return QImage();
 
@@ -285,6 +500,93 @@ QImage VideoPlayerGLPlayer::getLastScreenshot()
     return fbo->toImage();
 }
 
+// Frames are decoded into system memory because the host has no threaded OpenGL
+bool VideoPlayerGLPlayer::isSoftwareFrames() const
+{
+    return _software != nullptr;
+}
+
+bool VideoPlayerGLPlayer::isSoftwareFramesPreferred()
+{
+    return _softwareFramesPreferred.loadAcquire() != 0;
+}
+
+// Use software frames in players created from now on, e.g. to work around a driver or to compare the paths
+void VideoPlayerGLPlayer::setSoftwareFramesPreferred(bool preferred)
+{
+    _softwareFramesPreferred.storeRelease(preferred ? 1 : 0);
+}
+
+// Will a player with the given loop cache use software frames, e.g. to prepare their shader early
+bool VideoPlayerGLPlayer::isSoftwareFramesRequired(VideoPlayerGLLoopCache::Storage loopCache)
+{
+    // The loop cache captures frames from system memory
+    if((loopCache != VideoPlayerGLLoopCache::Storage_None) || (isSoftwareFramesPreferred()))
+        return true;
+
+    // Without threaded OpenGL VLC cannot render into our FBOs, so let it decode into system memory instead
+#ifdef VIDEO_SOFTWARE_FRAMES
+    return true;
+#else
+    return !QOpenGLContext::supportsThreadedOpenGL();
+#endif
+}
+
+VideoPlayerGLLoopCache* VideoPlayerGLPlayer::getLoopCache() const
+{
+    return _loopCache;
+}
+
+// Frames come from the loop cache and the decoder has been shut down
+bool VideoPlayerGLPlayer::isLoopCacheReplaying() const
+{
+    return ((_software) && (_software->isReplaying()));
+}
+
+bool VideoPlayerGLPlayer::isLooping() const
+{
+    return _looping;
+}
+
+void VideoPlayerGLPlayer::setLooping(bool looping)
+{
+    qDebug() << "[VideoPlayerGLPlayer] Setting looping: " << looping;
+    _looping = looping;
+}
+
+quint64 VideoPlayerGLPlayer::getLoopCount() const
+{
+    return _loopCount.loadAcquire();
+}
+
+// Time in nanoseconds from the play time wrapping to the first frame of the new pass
+qint64 VideoPlayerGLPlayer::getLastLoopLatency() const
+{
+    return _lastLoopLatency.loadAcquire();
+}
+
+qint64 VideoPlayerGLPlayer::getMaxLoopLatency() const
+{
+    return _maxLoopLatency.loadAcquire();
+}
+
+// Time in nanoseconds between the last frame of a pass and the first frame of the next one
+qint64 VideoPlayerGLPlayer::getLastLoopGap() const
+{
+    return _lastLoopGap.loadAcquire();
+}
+
+bool VideoPlayerGLPlayer::isScreenshotPending() const
+{
+    return ((_screenshotRequested.loadAcquire() != 0) || (_screenshotFence != nullptr));
+}
+
+void VideoPlayerGLPlayer::requestScreenshot()
+{
+    _screenshotRequested.storeRelease(1);
+    emit frameAvailable();
+}
+
 /*
 // this callback will create the surfaces and FBO used by VLC to perform its rendering
 bool VideoPlayerGL::resizeRenderTextures(void* data, const libvlc_video_render_cfg_t *cfg, libvlc_video_output_cfg_t *render_cfg)
@@ -626,8 +928,15 @@ void VideoPlayerGLPlayer::targetResized(const QSize& newSize)
 {
     qDebug() << "[VideoPlayerGLPlayer] Target window resized: " << newSize;
     _targetSize = newSize;
+    if(_video)
+        _video->setTargetSize(_targetSize);
+    if(_software)
+        _software->setTargetSize(_targetSize);
     videoResized();
-    restartPlayer();
+
+    // Live resize: only the geometry changes, a running decoder is left untouched
+    if(!_vlcPlayer)
+        startPlayer();
 
 #ifdef VIDEO_DEBUG_MESSAGES
     qDebug() << "[VideoPlayerGLPlayer] Target window resize completed";
@@ -674,14 +983,92 @@ bool VideoPlayerGLPlayer::restartPlayer()
 
 void VideoPlayerGLPlayer::videoResized()
 {
-    qDebug() << "[VideoPlayerGLPlayer] Video being resized, recreating vertex arrays";
-    cleanupVBObjects();
-    createVBObjects();
+    // May be called from the VLC render thread, so only flag the vertex arrays for the next paint
+    qDebug() << "[VideoPlayerGLPlayer] Video being resized, geometry will be updated";
+    _geometryDirty.storeRelease(1);
+}
+
+void VideoPlayerGLPlayer::applyQualityLevel(int level, qreal renderScale, int frameDivisor, const QString& reason)
+{
+    qDebug() << "[VideoPlayerGLPlayer] Applying quality level " << level << " (render scale: " << renderScale << ", frame divisor: " << frameDivisor << "): " << reason;
+
+    // Software frames are already decoded at the target size, so only the presented frame rate is reduced
+    if(_video)
+    {
+        _video->setRenderScale(renderScale);
+        _video->setFrameDivisor(frameDivisor);
+    }
+    else if(_software)
+    {
+        _software->setFrameDivisor(frameDivisor);
+    }
+    else
+    {
+        return;
+    }
+
+    emit qualityChanged(level, renderScale, frameDivisor, reason);
+}
+
+// A looping input has used up its repeats, start it from the beginning again. The time jump
+// back to the start is counted as a loop boundary like the repeats inside the input.
+void VideoPlayerGLPlayer::repeatEnded()
+{
+    if((!_repeating) || (!_vlcPlayer))
+        return;
+
+    qDebug() << "[VideoPlayerGLPlayer] Looping input ended, starting it again";
+    libvlc_media_player_play(_vlcPlayer);
+}
+
+// The first pass has played through, replay it from the loop cache without the decoder
+void VideoPlayerGLPlayer::loopCaptureComplete()
+{
+    if((!_loopCache) || (!_software) || (_loopCache->isComplete()))
+        return;
+
+    qDebug() << "[VideoPlayerGLPlayer] First pass through the loop completed";
+
+    // Release the decoder first so no more frames arrive while the capture is finished
+    stopPlayer();
+    _software->setLoopCache(nullptr);
+
+    if(!_loopCache->finishCapture())
+    {
+        qDebug() << "[VideoPlayerGLPlayer] Loop cache not usable, restarting the decoder";
+        delete _loopCache;
+        _loopCache = nullptr;
+        _loopCacheStorage = VideoPlayerGLLoopCache::Storage_None;
+        startPlayer();
+        return;
+    }
+
+    _software->startReplay(_loopCache);
+    videoResized();
+
+    // Tick at half the frame interval, the frame itself is picked from the loop clock
+    _loopClock.start();
+    _loopTimer.start(qMax(static_cast<int>(_loopCache->getFrameInterval() / 2000000), 1));
+    advanceLoop();
+}
+
+void VideoPlayerGLPlayer::advanceLoop()
+{
+    if((!_loopCache) || (!isLoopCacheReplaying()))
+        return;
+
+    qint64 loopTime = _loopClock.nsecsElapsed() % _loopCache->getLoopDuration();
+    int index = _loopCache->getFrameAt(loopTime);
+
+    // Compressed frames are decompressed on the cache's worker, a frame still in flight is painted on a later tick
+    _loopCache->prefetchFrames(index);
+    if((_software->setReplayFrame(index)) || (_software->isNewFrameAvailable()))
+        registerNewFrame();
 }
 
 void VideoPlayerGLPlayer::initializationComplete()
 {
-    if((!_context) || (!_video))
+    if((!_context) || ((!_video) && (!_software)))
         return;
 
     qDebug() << "[VideoPlayerGLPlayer] Confirming initialization complete";
@@ -714,7 +1101,17 @@ bool VideoPlayerGLPlayer::initializeVLC()
     //_surface = new QOffscreenSurface(nullptr);
     //_surface->setFormat(format);
     //_surface->create();
-    _video = new VideoPlayerGLVideo(this);
+    if(isSoftwareFramesRequired(_loopCacheStorage))
+    {
+        qDebug() << "[VideoPlayerGLPlayer] Using software video frames";
+        _software = new VideoPlayerGLSoftware(this);
+        _software->setTargetSize(_targetSize);
+    }
+    else
+    {
+        _video = new VideoPlayerGLVideo(this);
+        _video->setTargetSize(_targetSize);
+    }
 
     // TBD - do we need this
     //libvlc_set_exit_handler(_vlcInstance, playerExitEventCallback, this);
@@ -741,6 +1138,12 @@ bool VideoPlayerGLPlayer::startPlayer()
         return false;
     }
 
+    if(isLoopCacheReplaying())
+    {
+        qDebug() << "[VideoPlayerGLPlayer] Playing from the loop cache - not starting player!";
+        return false;
+    }
+
     if(_videoFile.isEmpty())
     {
         qDebug() << "[VideoPlayerGLPlayer] Playback file empty - not able to start player!";
@@ -762,6 +1165,14 @@ bool VideoPlayerGLPlayer::startPlayer()
     if (!_vlcMedia)
         return false;
 
+    // Loop inside the running input, so the decoder and video output are kept across the boundary.
+    // The repeat count is finite, playback is started again if the input ever runs out of repeats.
+    // A loop being captured into the cache has to end instead, its replay does the looping.
+    bool capturingLoop = ((_loopCacheStorage != VideoPlayerGLLoopCache::Storage_None) && (!_loopCache));
+    _repeating = ((_looping) && (!capturingLoop));
+    if(_repeating)
+        libvlc_media_add_option(_vlcMedia, LOOP_REPEAT_OPTION);
+
     //libvlc_media_list_add_media(vlcMediaList, vlcMedia);
     //libvlc_media_release(vlcMedia);
 
@@ -780,6 +1191,18 @@ bool VideoPlayerGLPlayer::startPlayer()
     //libvlc_media_list_player_set_playback_mode(_vlcListPlayer, libvlc_playback_mode_loop);
     libvlc_audio_set_volume(_vlcPlayer, 0);
 
+    if(_repeating)
+    {
+        _lastPlayTime.storeRelease(0);
+        _loopWrapTime.storeRelease(0);
+        libvlc_event_manager_t* eventManager = libvlc_media_player_event_manager(_vlcPlayer);
+        if(eventManager)
+        {
+            libvlc_event_attach(eventManager, libvlc_MediaPlayerTimeChanged, timeEventCallback, static_cast<void*>(this));
+            libvlc_event_attach(eventManager, libvlc_MediaPlayerStopping, loopEventCallback, static_cast<void*>(this));
+        }
+    }
+
     //libvlc_video_set_scale(_vlcPlayer, 0.25f );
 
     // TBD
@@ -804,20 +1227,48 @@ bool VideoPlayerGLPlayer::startPlayer()
     }
     */
 
-    bool callbackResult = libvlc_video_set_output_callbacks(_vlcPlayer,
-                                                            libvlc_video_engine_opengl,
-                                                            VideoPlayerGLVideo::setup,
-                                                            VideoPlayerGLVideo::cleanup,
-                                                            nullptr,
-                                                            VideoPlayerGLVideo::resizeRenderTextures,
-                                                            VideoPlayerGLVideo::swap,
-                                                            VideoPlayerGLVideo::makeCurrent,
-                                                            VideoPlayerGLVideo::getProcAddress,
-                                                            nullptr,
-                                                            nullptr,
-                                                            _video);
-
-    qDebug() << "[VideoPlayerGLPlayer] Player callback result: " << callbackResult;
+    if(_software)
+    {
+        libvlc_video_set_callbacks(_vlcPlayer,
+                                   VideoPlayerGLSoftware::lock,
+                                   VideoPlayerGLSoftware::unlock,
+                                   VideoPlayerGLSoftware::display,
+                                   _software);
+        libvlc_video_set_format_callbacks(_vlcPlayer,
+                                          VideoPlayerGLSoftware::format,
+                                          VideoPlayerGLSoftware::formatCleanup);
+
+        // Capture the first pass, the decoder is shut down once it has played through
+        if((_loopCacheStorage != VideoPlayerGLLoopCache::Storage_None) && (!_loopCache))
+        {
+            _loopCache = new VideoPlayerGLLoopCache(_loopCacheStorage);
+            _software->setLoopCache(_loopCache);
+
+            libvlc_event_manager_t* eventManager = libvlc_media_player_event_manager(_vlcPlayer);
+            if(eventManager)
+            {
+                libvlc_event_attach(eventManager, libvlc_MediaPlayerLengthChanged, loopEventCallback, static_cast<void*>(this));
+                libvlc_event_attach(eventManager, libvlc_MediaPlayerStopping, loopEventCallback, static_cast<void*>(this));
+            }
+        }
+    }
+    else
+    {
+        bool callbackResult = libvlc_video_set_output_callbacks(_vlcPlayer,
+                                                                libvlc_video_engine_opengl,
+                                                                VideoPlayerGLVideo::setup,
+                                                                VideoPlayerGLVideo::cleanup,
+                                                                VideoPlayerGLVideo::setResizeCallback,
+                                                                VideoPlayerGLVideo::resizeRenderTextures,
+                                                                VideoPlayerGLVideo::swap,
+                                                                VideoPlayerGLVideo::makeCurrent,
+                                                                VideoPlayerGLVideo::getProcAddress,
+                                                                nullptr,
+                                                                nullptr,
+                                                                _video);
+
+        qDebug() << "[VideoPlayerGLPlayer] Player callback result: " << callbackResult;
+    }
 
     //libvlc_video_set_callbacks(player, playerLockCallback, playerUnlockCallback, playerDisplayCallback, static_cast<void*>(this));
     //libvlc_video_set_format_callbacks(player, playerFormatCallback, playerCleanupCallback);
@@ -831,12 +1282,73 @@ bool VideoPlayerGLPlayer::startPlayer()
     return true;
 }
 
+// This callback is called by VLC as the play time advances, a jump back means the input has wrapped to the start
+void VideoPlayerGLPlayer::timeEventCallback(const struct libvlc_event_t *p_event, void *data)
+{
+    VideoPlayerGLPlayer* that = static_cast<VideoPlayerGLPlayer*>(data);
+    if((!that) || (!p_event) || (p_event->type != libvlc_MediaPlayerTimeChanged))
+        return;
+
+    qint64 newTime = static_cast<qint64>(p_event->u.media_player_time_changed.new_time);
+    qint64 previousTime = that->_lastPlayTime.fetchAndStoreOrdered(newTime);
+    if(newTime + LOOP_WRAP_THRESHOLD < previousTime)
+        that->_loopWrapTime.storeRelease(qMax(that->_loopBoundaryClock.nsecsElapsed(), static_cast<qint64>(1)));
+}
+
+// This callback is called by VLC when the length is known and when the media has played through,
+// either during the loop capture or after the last repeat of a looping input
+void VideoPlayerGLPlayer::loopEventCallback(const struct libvlc_event_t *p_event, void *data)
+{
+    VideoPlayerGLPlayer* that = static_cast<VideoPlayerGLPlayer*>(data);
+    if((!that) || (!p_event))
+        return;
+
+    // The length sizes the capture budget, the cache outlives the VLC player it is attached to
+    if(p_event->type == libvlc_MediaPlayerLengthChanged)
+    {
+        if(that->_loopCache)
+            that->_loopCache->setLoopLength(static_cast<qint64>(p_event->u.media_player_length_changed.new_length) * 1000000);
+        return;
+    }
+
+    if(p_event->type != libvlc_MediaPlayerStopping)
+        return;
+
+    // The player cannot be released or restarted from inside one of its own events
+    if(that->_repeating)
+        QMetaObject::invokeMethod(that, "repeatEnded", Qt::QueuedConnection);
+    else
+        QMetaObject::invokeMethod(that, "loopCaptureComplete", Qt::QueuedConnection);
+}
+
 bool VideoPlayerGLPlayer::stopPlayer()
 {
     qDebug() << "[VideoPlayerGLPlayer] Stop Player called";
 
     if(_vlcPlayer)
     {
+        // Length and stopping are only attached while the loop is being captured
+        if((_loopCache) && (!_loopCache->isComplete()))
+        {
+            libvlc_event_manager_t* eventManager = libvlc_media_player_event_manager(_vlcPlayer);
+            if(eventManager)
+            {
+                libvlc_event_detach(eventManager, libvlc_MediaPlayerLengthChanged, loopEventCallback, static_cast<void*>(this));
+                libvlc_event_detach(eventManager, libvlc_MediaPlayerStopping, loopEventCallback, static_cast<void*>(this));
+            }
+        }
+
+        if(_repeating)
+        {
+            libvlc_event_manager_t* eventManager = libvlc_media_player_event_manager(_vlcPlayer);
+            if(eventManager)
+            {
+                libvlc_event_detach(eventManager, libvlc_MediaPlayerTimeChanged, timeEventCallback, static_cast<void*>(this));
+                libvlc_event_detach(eventManager, libvlc_MediaPlayerStopping, loopEventCallback, static_cast<void*>(this));
+            }
+            _repeating = false;
+        }
+
         libvlc_media_player_release(_vlcPlayer);
         _vlcPlayer = nullptr;
     }
@@ -943,10 +1455,7 @@ void VideoPlayerGLPlayer::createGLObjects()
     if((!f) || (!e))
         return;
 
-    QImage image;
-    image.load(QString("C:\\Users\\turne\\Documents\\DnD\\DM Helper\\testdata\\Desert Stronghold.jpg"));
-
-    createVBObjects();
+    _quad = PublishGLUnitQuad::acquire(_context);
 
     /*
     // Texture
@@ -958,74 +1467,96 @@ void VideoPlayerGLPlayer::createGLObjects()
     f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     */
+}
 
-    // load and generate the background texture
-    QImage glBackgroundImage = image.convertToFormat(QImage::Format_RGBA8888).mirrored();
-    f->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, glBackgroundImage.width(), glBackgroundImage.height(), 0, GL_RGBA, GL_UNSIGNED_BYTE, glBackgroundImage.bits());
-    f->glGenerateMipmap(GL_TEXTURE_2D);
+void VideoPlayerGLPlayer::cleanupGLObjects()
+{
+    QOpenGLFunctions *f = _context ? _context->functions() : nullptr;
+    QOpenGLExtraFunctions *e = _context ? _context->extraFunctions() : nullptr;
+    if((f) && (e))
+    {
+        if(_screenshotFence)
+            e->glDeleteSync(_screenshotFence);
+
+        if(_screenshotPBO > 0)
+            f->glDeleteBuffers(1, &_screenshotPBO);
 
+        if(_screenshotFBO > 0)
+            f->glDeleteFramebuffers(1, &_screenshotFBO);
+    }
+    _screenshotFence = nullptr;
+    _screenshotPBO = 0;
+    _screenshotFBO = 0;
+
+    if(_software)
+        _software->cleanupGL(_context);
+
+    if(_quad)
+    {
+        PublishGLUnitQuad::release(_context);
+        _quad = nullptr;
+    }
 }
 
-void VideoPlayerGLPlayer::cleanupGLObjects()
+// Resizing only touches the model matrix, the quad itself is shared
+void VideoPlayerGLPlayer::updateGeometry()
 {
-    cleanupVBObjects();
+    if(((!_video) && (!_software)) || (!_geometryDirty.testAndSetOrdered(1, 0)))
+        return;
+
+    QSize frameSize = _video ? _video->getVideoSize() : _software->getVideoSize();
+
+    // Between two output formats, e.g. across a loop boundary, keep showing the last frame where it was
+    if(frameSize.isEmpty())
+    {
+        _geometryDirty.storeRelease(1);
+        return;
+    }
+
+    _videoSize = frameSize.scaled(_targetSize, Qt::KeepAspectRatio);
+    _modelMatrix.setToIdentity();
+    _modelMatrix.scale(static_cast<float>(_videoSize.width()), static_cast<float>(_videoSize.height()), 1.f);
 }
 
-void VideoPlayerGLPlayer::createVBObjects()
+// Queue a readback of the frame into the pixel buffer, guarded by a fence
+void VideoPlayerGLPlayer::readScreenshot(GLuint texture, const QSize& frameSize)
 {
-    if((!_context) || (!_video))
+    if((_screenshotFence) || (texture == 0) || (frameSize.isEmpty()) || (!_screenshotRequested.testAndSetOrdered(1, 0)))
         return;
 
-    // Set up the rendering context, load shaders and other resources, etc.:
     QOpenGLFunctions *f = _context->functions();
     QOpenGLExtraFunctions *e = _context->extraFunctions();
     if((!f) || (!e))
         return;
 
-    //QSize videoSize = getOriginalSize();
-    _videoSize = _video->getVideoSize().scaled(_targetSize, Qt::KeepAspectRatio);
-    //QSize videoSize = image.size();
-    if((_videoSize.width() <= 0) || (_videoSize.height() <= 0))
-        return;
-
-    float vertices[] = {
-        // positions    // colors           // texture coords
-         (float)_videoSize.width() / 2,  (float)_videoSize.height() / 2, 0.0f,   1.0f, 0.0f, 0.0f,   1.0f, 1.0f,   // top right
-         (float)_videoSize.width() / 2, -(float)_videoSize.height() / 2, 0.0f,   0.0f, 1.0f, 0.0f,   1.0f, 0.0f,   // bottom right
-        -(float)_videoSize.width() / 2, -(float)_videoSize.height() / 2, 0.0f,   0.0f, 0.0f, 1.0f,   0.0f, 0.0f,   // bottom left
-        -(float)_videoSize.width() / 2,  (float)_videoSize.height() / 2, 0.0f,   1.0f, 1.0f, 0.0f,   0.0f, 1.0f    // top left
-    };
+    if(_screenshotFBO == 0)
+        f->glGenFramebuffers(1, &_screenshotFBO);
 
-    unsigned int indices[] = {  // note that we start from 0!
-        0, 1, 3,   // first triangle
-        1, 2, 3    // second triangle
-    };
+    if(_screenshotPBO == 0)
+        f->glGenBuffers(1, &_screenshotPBO);
 
-    e->glGenVertexArrays(1, &_VAO);
-    f->glGenBuffers(1, &_VBO);
-    f->glGenBuffers(1, &_EBO);
-
-    e->glBindVertexArray(_VAO);
+    f->glBindBuffer(GL_PIXEL_PACK_BUFFER, _screenshotPBO);
+    if(frameSize != _screenshotSize)
+    {
+        f->glBufferData(GL_PIXEL_PACK_BUFFER, static_cast<GLsizeiptr>(frameSize.width()) * frameSize.height() * 4, nullptr, GL_STREAM_READ);
+        _screenshotSize = frameSize;
+    }
 
-    f->glBindBuffer(GL_ARRAY_BUFFER, _VBO);
-    f->glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-    f->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _EBO);
-    f->glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+    // The video FBO belongs to the VLC context, so read its texture through a framebuffer of this context
+    f->glBindFramebuffer(GL_FRAMEBUFFER, _screenshotFBO);
+    f->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+    f->glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    f->glReadPixels(0, 0, frameSize.width(), frameSize.height(), GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    f->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    f->glBindFramebuffer(GL_FRAMEBUFFER, _context->defaultFramebufferObject());
 
-    // position attribute
-    f->glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)0);
-    f->glEnableVertexAttribArray(0);
-    // color attribute
-    f->glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(3*sizeof(float)));
-    f->glEnableVertexAttribArray(1);
-    // texture attribute
-    f->glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(6 * sizeof(float)));
-    f->glEnableVertexAttribArray(2);
+    _screenshotFence = e->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 }
 
-void VideoPlayerGLPlayer::cleanupVBObjects()
+// Once the readback has completed, copy the pixels out and convert them on a worker thread
+void VideoPlayerGLPlayer::collectScreenshot()
 {
-    if(!_context)
+    if(!_screenshotFence)
         return;
 
     QOpenGLFunctions *f = _context->functions();
@@ -1033,25 +1564,46 @@ void VideoPlayerGLPlayer::cleanupVBObjects()
     if((!f) || (!e))
         return;
 
-    _videoSize = QSize();
+    GLenum waitResult = e->glClientWaitSync(_screenshotFence, 0, 0);
+    if(waitResult == GL_TIMEOUT_EXPIRED)
+        return;
+
+    e->glDeleteSync(_screenshotFence);
+    _screenshotFence = nullptr;
 
-    if(_VAO > 0)
+    if(waitResult == GL_WAIT_FAILED)
     {
-        e->glDeleteVertexArrays(1, &_VAO);
-        _VAO = 0;
+        qDebug() << "[VideoPlayerGLPlayer] ERROR: screenshot readback failed";
+        return;
     }
 
-    if(_VBO > 0)
+    QImage rawImage(_screenshotSize, QImage::Format_RGBA8888);
+    const GLsizeiptr byteCount = static_cast<GLsizeiptr>(rawImage.sizeInBytes());
+    f->glBindBuffer(GL_PIXEL_PACK_BUFFER, _screenshotPBO);
+    void* pixels = e->glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, byteCount, GL_MAP_READ_BIT);
+    if(pixels)
     {
-        f->glDeleteBuffers(1, &_VBO);
-        _VBO = 0;
+        memcpy(rawImage.bits(), pixels, static_cast<size_t>(byteCount));
+        e->glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
     }
+    f->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
 
-    if(_EBO > 0)
+    if(!pixels)
+        return;
+
+    QPointer<VideoPlayerGLPlayer> player(this);
+    QThreadPool::globalInstance()->start([player, rawImage]()
     {
-        f->glDeleteBuffers(1, &_EBO);
-        _EBO = 0;
-    }
+        // GL rows start at the bottom of the image
+        QImage screenshot = ImageKernels::convertReadback(rawImage);
+        if(player)
+        {
+            QMetaObject::invokeMethod(player.data(), [player, screenshot]() {
+                if(player)
+                    emit player->screenshotReady(screenshot);
+            }, Qt::QueuedConnection);
+        }
+    });
 }
 
 void VideoPlayerGLPlayer::internalAudioCheck(int newStatus)
@@ -2,6 +2,9 @@
 #define VIDEOPLAYERGLPLAYER_H
 
 #include "videoplayergl.h"
+#include "videoplayerglvideo.h"
+#include "videoplayerglsoftware.h"
+#include "videoplayerglloopcache.h"
 #include <QObject>
 #include <QMutex>
 #include <QImage>
@@ -10,20 +13,27 @@
 #include <QOffscreenSurface>
 #include <QSemaphore>
 #include <QMatrix4x4>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QAtomicInteger>
 #include "dmh_vlc.h"
 
-class VideoPlayerGLVideo;
+class VideoPlayerGLGovernor;
+class PublishGLStateCache;
+class PublishGLUnitQuad;
 
 class VideoPlayerGLPlayer : public VideoPlayerGL
 {
     Q_OBJECT
 public:
-    VideoPlayerGLPlayer(const QString& videoFile, QOpenGLContext* context, QSurfaceFormat format, QSize targetSize, bool playVideo = true, bool playAudio = true, QObject *parent = nullptr);
+    VideoPlayerGLPlayer(const QString& videoFile, QOpenGLContext* context, QSurfaceFormat format, QSize targetSize, bool playVideo = true, bool playAudio = true, VideoPlayerGLLoopCache::Storage loopCache = VideoPlayerGLLoopCache::Storage_None, QObject *parent = nullptr);
     virtual ~VideoPlayerGLPlayer();
 
     virtual const QString& getFileName() const;
 //    QOpenGLFramebufferObject* getVideoFrame();
-    void paintGL();
+    bool updateFrame(PublishGLStateCache* stateCache = nullptr);
+    void paintGL(PublishGLStateCache* stateCache = nullptr);
+    bool isNewFrameAvailable() const;
 
     virtual bool isPlayingVideo() const;
     virtual void setPlayingVideo(bool playVideo);
@@ -37,12 +47,46 @@ public:
     //virtual void clearNewImage();
     virtual void registerNewFrame() override;
 
+    bool isRenderAtTargetSize() const;
+    void setRenderAtTargetSize(bool renderAtTargetSize);
+    VideoPlayerGLVideo::ScaleQuality getScaleQuality() const;
+    void setScaleQuality(VideoPlayerGLVideo::ScaleQuality quality);
+    qint64 getRenderMemorySaved() const;
+
+    // Frames drawn by paintGL and render textures allocated for the FBO path so far
+    quint64 getFramesPresented() const;
+    quint64 getTextureAllocations() const;
+
+    VideoPlayerGLGovernor* getGovernor() const;
+    bool isGovernorEnabled() const;
+    void setGovernorEnabled(bool enabled);
+
     virtual QSurfaceFormat getFormat() const override;
     virtual QSize getSize() const override;
+    const GLfloat* getMatrixData();
 
     QImage getLastScreenshot();
+    bool isScreenshotPending() const;
+    bool isSoftwareFrames() const;
+    static bool isSoftwareFramesRequired(VideoPlayerGLLoopCache::Storage loopCache);
+    static bool isSoftwareFramesPreferred();
+    static void setSoftwareFramesPreferred(bool preferred);
+
+    VideoPlayerGLLoopCache* getLoopCache() const;
+    bool isLoopCacheReplaying() const;
+
+    // Gapless looping inside the running player, applies from the next start
+    bool isLooping() const;
+    void setLooping(bool looping);
+    quint64 getLoopCount() const;
+    qint64 getLastLoopLatency() const;
+    qint64 getMaxLoopLatency() const;
+    qint64 getLastLoopGap() const;
 
     // libvlc callback static functions
+    static void loopEventCallback(const struct libvlc_event_t *p_event, void *data);
+    static void timeEventCallback(const struct libvlc_event_t *p_event, void *data);
+
     /*
     static bool resizeRenderTextures(void* data, const libvlc_video_render_cfg_t *cfg, libvlc_video_output_cfg_t *render_cfg);
     static bool setup(void** data, const libvlc_video_setup_device_cfg_t *cfg, libvlc_video_setup_device_info_t *out);
@@ -72,6 +116,8 @@ signals:
 
     //void screenShotAvailable();
     void frameAvailable();
+    void qualityChanged(int level, qreal renderScale, int frameDivisor, const QString& reason);
+    void screenshotReady(const QImage& image);
 
 public slots:
     virtual void targetResized(const QSize& newSize);
@@ -82,6 +128,15 @@ public slots:
 
     void initializationComplete();
 
+    // Thread safe, the image is delivered through screenshotReady a frame or two later
+    void requestScreenshot();
+
+protected slots:
+    void applyQualityLevel(int level, qreal renderScale, int frameDivisor, const QString& reason);
+    void loopCaptureComplete();
+    void repeatEnded();
+    void advanceLoop();
+
 protected:
 
     virtual bool initializeVLC() override;
@@ -91,8 +146,9 @@ protected:
     //virtual void cleanupBuffers();
     void createGLObjects();
     void cleanupGLObjects();
-    void createVBObjects();
-    void cleanupVBObjects();
+    void updateGeometry();
+    void readScreenshot(GLuint texture, const QSize& frameSize);
+    void collectScreenshot();
 
 //    virtual void internalStopCheck(int status);
     virtual void internalAudioCheck(int newStatus);
@@ -110,8 +166,11 @@ protected:
     bool _playAudio;
 
     VideoPlayerGLVideo* _video;
+    VideoPlayerGLSoftware* _software;
 //    GLuint _tempTexture;
-    GLuint _fboTexture;
+    quint64 _framesPresented;
+    VideoPlayerGLGovernor* _governor;
+    quint64 _lastFramesAcquired;
 
     bool _vlcError;
     libvlc_media_player_t* _vlcPlayer;
@@ -128,9 +187,36 @@ protected:
     int _originalTrack;
 
     QMatrix4x4 _modelMatrix;
-    unsigned int _VAO;
-    unsigned int _VBO;
-    unsigned int _EBO;
+    PublishGLUnitQuad* _quad;
+    QAtomicInt _geometryDirty;
+
+    // Asynchronous screenshot readback
+    QAtomicInt _screenshotRequested;
+    GLuint _screenshotFBO;
+    GLuint _screenshotPBO;
+    QSize _screenshotSize;
+    GLsync _screenshotFence;
+
+    // Decoded frame loop cache
+    VideoPlayerGLLoopCache::Storage _loopCacheStorage;
+    VideoPlayerGLLoopCache* _loopCache;
+    QTimer _loopTimer;
+    QElapsedTimer _loopClock;
+
+    // Software frames for players created from now on, even where the FBO path works
+    static QAtomicInt _softwareFramesPreferred;
+
+    // Gapless looping, the boundary is timed from the play time wrapping to the next frame
+    bool _looping;
+    bool _repeating;
+    QElapsedTimer _loopBoundaryClock;
+    QAtomicInteger<qint64> _lastPlayTime;
+    QAtomicInteger<qint64> _loopWrapTime;
+    QAtomicInteger<qint64> _lastFrameTime;
+    QAtomicInteger<quint64> _loopCount;
+    QAtomicInteger<qint64> _lastLoopLatency;
+    QAtomicInteger<qint64> _maxLoopLatency;
+    QAtomicInteger<qint64> _lastLoopGap;
 
 };
 
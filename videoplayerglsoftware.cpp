@@ -0,0 +1,825 @@
+#include "videoplayerglsoftware.h"
+#include "videoplayergl.h"
+#include "publishglshadermanager.h"
+#include "publishglunitquad.h"
+#include "publishglstatecache.h"
+#include "videoplayerglloopcache.h"
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#include <QOpenGLExtraFunctions>
+#include <QDebug>
+#include <cstring>
+
+//#define VIDEO_DEBUG_MESSAGES
+
+const int FRAME_POOL_SIZE = 3;
+const unsigned FRAME_PITCH_ALIGNMENT = 64;
+const unsigned FRAME_LINE_ALIGNMENT = 16;
+const int FRAME_PLANE_COUNT = 3;
+const unsigned HD_MIN_LINES = 720;
+
+const char* const YUV_VERTEX_SHADER = "#version 330 core\n"
+    "layout (location = 0) in vec2 aPos;\n"
+    "layout (location = 2) in vec2 aTexCoord;\n"
+    "out vec2 TexCoord;\n"
+    "void main()\n"
+    "{\n"
+    "   gl_Position = vec4(aPos * 2.0, 0.0, 1.0);\n"
+    "   // The planes are stored top row first\n"
+    "   TexCoord = vec2(aTexCoord.x, 1.0 - aTexCoord.y);\n"
+    "}\0";
+
+const char* const YUV_FRAGMENT_SHADER = "#version 330 core\n"
+    "out vec4 FragColor;\n"
+    "in vec2 TexCoord;\n"
+    "uniform sampler2D planeY;\n"
+    "uniform sampler2D planeU;\n"
+    "uniform sampler2D planeV;\n"
+    "uniform bool interleaved;\n"
+    "uniform mat3 yuvMatrix;\n"
+    "uniform vec3 yuvOffset;\n"
+    "void main()\n"
+    "{\n"
+    "    vec3 yuv;\n"
+    "    yuv.x = texture(planeY, TexCoord).r;\n"
+    "    if(interleaved)\n"
+    "        yuv.yz = texture(planeU, TexCoord).rg;\n"
+    "    else\n"
+    "        yuv.yz = vec2(texture(planeU, TexCoord).r, texture(planeV, TexCoord).r);\n"
+    "    FragColor = vec4(clamp(yuvMatrix * (yuv - yuvOffset), 0.0, 1.0), 1.0);\n"
+    "}\0";
+
+VideoPlayerGLSoftware::VideoPlayerGLSoftware(VideoPlayerGL* player) :
+    _player(player),
+    _poolLock(),
+    _buffers(),
+    _bufferCapacity(0),
+    _frames(),
+    _frameTimes(),
+    _width(0),
+    _height(0),
+    _bufferAllocations(0),
+    _frameFormat(FrameFormat_Planar),
+    _layoutFormat(FrameFormat_RGBA),
+    _interleavedChroma(false),
+    _planeCount(0),
+    _planeSizes(),
+    _pitches(),
+    _planeOffsets(),
+    _frameBytes(0),
+    _colorSpace(libvlc_video_colorspace_BT709),
+    _fullRange(false),
+    _colorSpaceSet(false),
+    _texture(0),
+    _textureSize(),
+    _textureFormat(FrameFormat_RGBA),
+    _planeTextures(),
+    _unpackBuffers(),
+    _unpackIndex(0),
+    _bytesUploaded(0),
+    _uploadedFrame(nullptr),
+    _convertFBO(0),
+    _convertProgram(0),
+    _matrixLocation(-1),
+    _offsetLocation(-1),
+    _interleavedLocation(-1),
+    _quad(nullptr),
+    _captureCache(nullptr),
+    _replayCache(nullptr),
+    _replayFrame(-1),
+    _replayUploaded(-1),
+    _sourceSize(),
+    _targetSize(),
+    _frameClock(),
+    _frameDivisor(1),
+    _framesDecoded(0),
+    _framesDropped(0),
+    _framesAcquired(0),
+    _lastPickupDelay(0),
+    _lastUploadTime(0),
+    _totalUploadTime(0),
+    _uploadCount(0)
+{
+    qDebug() << "[VideoPlayerGLSoftware] Creating VideoPlayerGLSoftware";
+
+    for(int i = 0; i < FRAME_POOL_SIZE; ++i)
+    {
+        _buffers[i] = nullptr;
+        _frameTimes[i] = 0;
+        _unpackBuffers[i] = 0;
+    }
+
+    for(int i = 0; i < FRAME_PLANE_COUNT; ++i)
+    {
+        _pitches[i] = 0;
+        _planeOffsets[i] = 0;
+        _planeTextures[i] = 0;
+    }
+    _frameClock.start();
+}
+
+VideoPlayerGLSoftware::~VideoPlayerGLSoftware()
+{
+    qDebug() << "[VideoPlayerGLSoftware] Destroying VideoPlayerGLSoftware";
+
+    freeBuffers();
+}
+
+// Start compiling the planar conversion program ahead of the first frame, a context of the share group must be current
+void VideoPlayerGLSoftware::requestProgram(PublishGLShaderManager* shaderManager)
+{
+    if(shaderManager)
+        shaderManager->requestProgram(QString("yuv"), YUV_VERTEX_SHADER, YUV_FRAGMENT_SHADER);
+}
+
+// Is there a new decoded or replayed frame to be uploaded
+bool VideoPlayerGLSoftware::isNewFrameAvailable()
+{
+    if(_replayCache)
+        return _replayFrame.loadAcquire() != _replayUploaded;
+
+    return _frames.isFresh();
+}
+
+// Stream the newest decoded frame into the texture and return it. Each upload
+// goes through the next unpack buffer so the copy never waits on the transfer
+// of the previous frame.
+GLuint VideoPlayerGLSoftware::uploadFrame(QOpenGLContext* context, PublishGLStateCache* stateCache)
+{
+    if((!context) || (!context->functions()) || (!context->extraFunctions()))
+        return _texture;
+
+    PublishGLStateCache localStateCache;
+    if(!stateCache)
+    {
+        localStateCache.reset(context);
+        stateCache = &localStateCache;
+    }
+
+    if(_replayCache)
+        return uploadReplayFrame(context, stateCache);
+
+    if(!_frames.acquire())
+        return _texture;
+
+    QMutexLocker locker(&_poolLock);
+    int readIndex = _frames.getReadIndex();
+    if((_width == 0) || (_height == 0) || (!_buffers[readIndex]))
+        return _texture;
+
+    _lastPickupDelay = _frameClock.nsecsElapsed() - _frameTimes[readIndex];
+    ++_framesAcquired;
+
+    uploadPixels(context, stateCache, _buffers[readIndex]);
+
+    return _texture;
+}
+
+// Show the cached frame picked by the player. File frames are decompressed ahead by the cache's
+// worker, one that is not ready yet keeps the previous frame up until a later paint.
+GLuint VideoPlayerGLSoftware::uploadReplayFrame(QOpenGLContext* context, PublishGLStateCache* stateCache)
+{
+    int index = _replayFrame.loadAcquire();
+    if((index < 0) || (index == _replayUploaded))
+        return _texture;
+
+    QMutexLocker locker(&_poolLock);
+    const uchar* src = _replayCache->getFrameData(index);
+    if(!src)
+        return _texture;
+
+    uploadPixels(context, stateCache, src);
+    _replayUploaded = index;
+    _replayCache->recordHit();
+    ++_framesAcquired;
+
+    return _texture;
+}
+
+// Copy a frame in the current layout into an unpack buffer and update the textures from it
+void VideoPlayerGLSoftware::uploadPixels(QOpenGLContext* context, PublishGLStateCache* stateCache, const uchar* src)
+{
+    QOpenGLFunctions* f = context->functions();
+    QOpenGLExtraFunctions* e = context->extraFunctions();
+
+    QElapsedTimer uploadTimer;
+    uploadTimer.start();
+
+    QSize frameSize(static_cast<int>(_width), static_cast<int>(_height));
+    if((_textureSize != frameSize) || (_textureFormat != _layoutFormat))
+    {
+        // Only on format changes, the texture setup binds directly
+        bool created = createTextures(context);
+        stateCache->invalidate();
+        if(!created)
+            return;
+    }
+
+    if(_unpackBuffers[0] == 0)
+        f->glGenBuffers(FRAME_POOL_SIZE, _unpackBuffers);
+
+    _unpackIndex = (_unpackIndex + 1) % FRAME_POOL_SIZE;
+    _uploadedFrame = src;
+    f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _unpackBuffers[_unpackIndex]);
+    f->glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if(_layoutFormat == FrameFormat_RGBA)
+    {
+        const int rowBytes = frameSize.width() * 4;
+        const GLsizeiptr byteCount = static_cast<GLsizeiptr>(rowBytes) * frameSize.height();
+        f->glBufferData(GL_PIXEL_UNPACK_BUFFER, byteCount, nullptr, GL_STREAM_DRAW);
+        uchar* dst = static_cast<uchar*>(e->glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, byteCount, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+        if(dst)
+        {
+            // VLC rows start at the top of the image, GL rows at the bottom
+            for(int y = 0; y < frameSize.height(); ++y)
+                memcpy(dst + (static_cast<size_t>(frameSize.height() - 1 - y) * rowBytes), src + (static_cast<size_t>(y) * _pitches[0]), static_cast<size_t>(rowBytes));
+
+            e->glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            stateCache->bindTexture(GL_TEXTURE_2D, _texture);
+            f->glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, frameSize.width(), frameSize.height(), GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+            _bytesUploaded += static_cast<quint64>(byteCount);
+        }
+    }
+    else
+    {
+        // The planes go up unchanged with their pitch, the conversion pass flips them
+        const GLsizeiptr byteCount = static_cast<GLsizeiptr>(_frameBytes);
+        f->glBufferData(GL_PIXEL_UNPACK_BUFFER, byteCount, nullptr, GL_STREAM_DRAW);
+        uchar* dst = static_cast<uchar*>(e->glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, byteCount, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+        if(dst)
+        {
+            memcpy(dst, src, _frameBytes);
+            e->glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            for(int i = 0; i < _planeCount; ++i)
+            {
+                bool interleaved = ((_interleavedChroma) && (i > 0));
+                stateCache->activeTexture(GL_TEXTURE0 + static_cast<GLenum>(i));
+                stateCache->bindTexture(GL_TEXTURE_2D, _planeTextures[i]);
+                f->glPixelStorei(GL_UNPACK_ROW_LENGTH, static_cast<GLint>(_pitches[i] / (interleaved ? 2 : 1)));
+                f->glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, _planeSizes[i].width(), _planeSizes[i].height(),
+                                   interleaved ? GL_RG : GL_RED, GL_UNSIGNED_BYTE, reinterpret_cast<const void*>(_planeOffsets[i]));
+            }
+            f->glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+            _bytesUploaded += static_cast<quint64>(byteCount);
+        }
+    }
+    f->glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    if(_layoutFormat == FrameFormat_Planar)
+        convertPlanes(context, stateCache);
+
+    _lastUploadTime = uploadTimer.nsecsElapsed();
+    _totalUploadTime += _lastUploadTime;
+    ++_uploadCount;
+}
+
+// Release the GL objects, needs the render context to be current
+void VideoPlayerGLSoftware::cleanupGL(QOpenGLContext* context)
+{
+    QOpenGLFunctions* f = context ? context->functions() : nullptr;
+    if(!f)
+        return;
+
+    if(_unpackBuffers[0] > 0)
+        f->glDeleteBuffers(FRAME_POOL_SIZE, _unpackBuffers);
+
+    if(_planeTextures[0] > 0)
+        f->glDeleteTextures(FRAME_PLANE_COUNT, _planeTextures);
+
+    if(_convertFBO > 0)
+        f->glDeleteFramebuffers(1, &_convertFBO);
+
+    if(_texture > 0)
+        f->glDeleteTextures(1, &_texture);
+
+    // The program belongs to the shader manager
+    if(_quad)
+        PublishGLUnitQuad::release(context);
+
+    for(int i = 0; i < FRAME_PLANE_COUNT; ++i)
+        _planeTextures[i] = 0;
+    for(int i = 0; i < FRAME_POOL_SIZE; ++i)
+        _unpackBuffers[i] = 0;
+    _convertFBO = 0;
+    _convertProgram = 0;
+    _quad = nullptr;
+    _texture = 0;
+    _textureSize = QSize();
+}
+
+GLuint VideoPlayerGLSoftware::getTexture() const
+{
+    return _texture;
+}
+
+// Copy of the frame most recently uploaded by the render thread, top row first
+QImage VideoPlayerGLSoftware::getLastFrame()
+{
+    QMutexLocker locker(&_poolLock);
+    const uchar* buffer = _uploadedFrame;
+    if((_width == 0) || (_height == 0) || (!buffer))
+        return QImage();
+
+    if(_layoutFormat == FrameFormat_RGBA)
+        return QImage(buffer, static_cast<int>(_width), static_cast<int>(_height), static_cast<int>(_pitches[0]), QImage::Format_RGBA8888).copy();
+
+    // Rarely used, so the planes are simply converted here with the same matrix as the shader
+    GLfloat matrix[9];
+    GLfloat offset[3];
+    getColorMatrix(matrix, offset);
+
+    QImage image(static_cast<int>(_width), static_cast<int>(_height), QImage::Format_RGBA8888);
+    for(int y = 0; y < image.height(); ++y)
+    {
+        const uchar* lumaRow = buffer + _planeOffsets[0] + (static_cast<size_t>(y) * _pitches[0]);
+        const uchar* chromaRow = buffer + _planeOffsets[1] + (static_cast<size_t>(y / 2) * _pitches[1]);
+        const uchar* crRow = _interleavedChroma ? chromaRow + 1 : buffer + _planeOffsets[2] + (static_cast<size_t>(y / 2) * _pitches[2]);
+        const int chromaStep = _interleavedChroma ? 2 : 1;
+        uchar* dst = image.scanLine(y);
+        for(int x = 0; x < image.width(); ++x)
+        {
+            GLfloat yuv[3] = { (lumaRow[x] / 255.f) - offset[0],
+                               (chromaRow[(x / 2) * chromaStep] / 255.f) - offset[1],
+                               (crRow[(x / 2) * chromaStep] / 255.f) - offset[2] };
+            for(int c = 0; c < 3; ++c)
+            {
+                GLfloat value = (matrix[c] * yuv[0]) + (matrix[3 + c] * yuv[1]) + (matrix[6 + c] * yuv[2]);
+                dst[(x * 4) + c] = static_cast<uchar>(qBound(0.f, value, 1.f) * 255.f + 0.5f);
+            }
+            dst[(x * 4) + 3] = 255;
+        }
+    }
+
+    return image;
+}
+
+// Every decoded frame is also handed to this cache until it is cleared again
+void VideoPlayerGLSoftware::setLoopCache(VideoPlayerGLLoopCache* loopCache)
+{
+    _captureCache = loopCache;
+}
+
+// Show frames from a completed cache instead of decoded ones, the layout is still the one of the capture
+void VideoPlayerGLSoftware::startReplay(VideoPlayerGLLoopCache* loopCache)
+{
+    if((!loopCache) || (!loopCache->isComplete()))
+        return;
+
+    QMutexLocker locker(&_poolLock);
+    _replayCache = loopCache;
+    _width = static_cast<unsigned>(loopCache->getFrameSize().width());
+    _height = static_cast<unsigned>(loopCache->getFrameSize().height());
+    _replayFrame.storeRelease(-1);
+    _replayUploaded = -1;
+    _uploadedFrame = nullptr;
+}
+
+void VideoPlayerGLSoftware::stopReplay()
+{
+    QMutexLocker locker(&_poolLock);
+    _replayCache = nullptr;
+    _uploadedFrame = nullptr;
+}
+
+bool VideoPlayerGLSoftware::isReplaying() const
+{
+    return _replayCache != nullptr;
+}
+
+// Select the cached frame to show next, returns true if it changed
+bool VideoPlayerGLSoftware::setReplayFrame(int index)
+{
+    return _replayFrame.fetchAndStoreOrdered(index) != index;
+}
+
+VideoPlayerGLSoftware::FrameFormat VideoPlayerGLSoftware::getFrameFormat() const
+{
+    QMutexLocker locker(&_poolLock);
+    return _frameFormat;
+}
+
+void VideoPlayerGLSoftware::setFrameFormat(FrameFormat frameFormat)
+{
+    QMutexLocker locker(&_poolLock);
+    _frameFormat = frameFormat;
+}
+
+libvlc_video_color_space_t VideoPlayerGLSoftware::getColorSpace() const
+{
+    QMutexLocker locker(&_poolLock);
+    return _colorSpace;
+}
+
+// The matrix used to convert planar frames. Until this is called, each format callback picks
+// the colour space from the frame height the way VLC does for untagged video, in video range.
+void VideoPlayerGLSoftware::setColorSpace(libvlc_video_color_space_t colorSpace, bool fullRange)
+{
+    QMutexLocker locker(&_poolLock);
+    _colorSpace = colorSpace;
+    _fullRange = fullRange;
+    _colorSpaceSet = true;
+}
+
+QSize VideoPlayerGLSoftware::getVideoSize() const
+{
+    QMutexLocker locker(&_poolLock);
+    return QSize(static_cast<int>(_width), static_cast<int>(_height));
+}
+
+QSize VideoPlayerGLSoftware::getSourceSize() const
+{
+    QMutexLocker locker(&_poolLock);
+    return _sourceSize;
+}
+
+// Frames are decoded at the target size, takes effect with the next format callback
+void VideoPlayerGLSoftware::setTargetSize(const QSize& targetSize)
+{
+    QMutexLocker locker(&_poolLock);
+    _targetSize = targetSize;
+}
+
+int VideoPlayerGLSoftware::getFrameDivisor() const
+{
+    return _frameDivisor.loadAcquire();
+}
+
+void VideoPlayerGLSoftware::setFrameDivisor(int frameDivisor)
+{
+    _frameDivisor.storeRelease(qMax(frameDivisor, 1));
+}
+
+quint64 VideoPlayerGLSoftware::getFramesAcquired() const
+{
+    return _framesAcquired;
+}
+
+quint64 VideoPlayerGLSoftware::getFramesDropped() const
+{
+    return static_cast<quint64>(_framesDropped.loadAcquire());
+}
+
+// Time in nanoseconds from VLC's display of a frame to it being taken for upload
+qint64 VideoPlayerGLSoftware::getLastPickupDelay() const
+{
+    return _lastPickupDelay;
+}
+
+// Number of times the frame pool had to grow
+quint64 VideoPlayerGLSoftware::getBufferAllocations() const
+{
+    return _bufferAllocations;
+}
+
+// Time in nanoseconds spent in the most recent frame upload
+qint64 VideoPlayerGLSoftware::getLastUploadTime() const
+{
+    return _lastUploadTime;
+}
+
+qint64 VideoPlayerGLSoftware::getTotalUploadTime() const
+{
+    return _totalUploadTime;
+}
+
+quint64 VideoPlayerGLSoftware::getUploadCount() const
+{
+    return _uploadCount;
+}
+
+// Bytes streamed through the unpack buffers so far
+quint64 VideoPlayerGLSoftware::getBytesUploaded() const
+{
+    return _bytesUploaded;
+}
+
+// This callback is called by VLC to negotiate the frame format and size
+unsigned VideoPlayerGLSoftware::format(void** data, char* chroma, unsigned* width, unsigned* height, unsigned* pitches, unsigned* lines)
+{
+    if((!data) || (!chroma) || (!width) || (!height) || (!pitches) || (!lines))
+        return 0;
+
+    VideoPlayerGLSoftware* that = static_cast<VideoPlayerGLSoftware*>(*data);
+    if(!that)
+        return 0;
+
+    qDebug() << "[VideoPlayerGLSoftware] Format callback with chroma: " << QString::fromLatin1(chroma, 4) << ", width: " << *width << ", height: " << *height;
+
+    QMutexLocker locker(&that->_poolLock);
+    that->_sourceSize = QSize(static_cast<int>(*width), static_cast<int>(*height));
+
+    // The callback gets no colour metadata, so fall back like VLC: BT.601 for SD, BT.709 from 720 lines up
+    if(!that->_colorSpaceSet)
+        that->_colorSpace = (*height < HD_MIN_LINES) ? libvlc_video_colorspace_BT601 : libvlc_video_colorspace_BT709;
+
+    // Planar frames are taken as the decoder produces them, so VLC has no colour conversion to do.
+    // RGBA matches the texture layout, so those frames are uploaded without a swizzle.
+    that->_layoutFormat = that->_frameFormat;
+    that->_interleavedChroma = ((that->_layoutFormat == FrameFormat_Planar) && (memcmp(chroma, "NV12", 4) == 0));
+    if(that->_layoutFormat == FrameFormat_RGBA)
+        memcpy(chroma, "RGBA", 4);
+    else
+        memcpy(chroma, that->_interleavedChroma ? "NV12" : "I420", 4);
+
+    // Let VLC scale down to the target, there is no point in copying pixels that are never shown
+    QSize frameSize = that->_sourceSize;
+    if((!that->_targetSize.isEmpty()) &&
+       ((frameSize.width() > that->_targetSize.width()) || (frameSize.height() > that->_targetSize.height())))
+    {
+        frameSize.scale(that->_targetSize, Qt::KeepAspectRatio);
+    }
+    // Subsampled chroma needs even dimensions
+    if(that->_layoutFormat == FrameFormat_Planar)
+        frameSize = QSize(frameSize.width() & ~1, frameSize.height() & ~1);
+    if(frameSize.isEmpty())
+        return 0;
+
+    that->_width = static_cast<unsigned>(frameSize.width());
+    that->_height = static_cast<unsigned>(frameSize.height());
+    unsigned alignedLines = (that->_height + FRAME_LINE_ALIGNMENT - 1) & ~(FRAME_LINE_ALIGNMENT - 1);
+
+    // Lay the planes out back to back, each with an aligned pitch
+    QSize chromaSize(frameSize.width() / 2, frameSize.height() / 2);
+    that->_planeCount = (that->_layoutFormat == FrameFormat_RGBA) ? 1 : (that->_interleavedChroma ? 2 : 3);
+    size_t frameBytes = 0;
+    for(int i = 0; i < that->_planeCount; ++i)
+    {
+        int bytesPerPixel = (that->_layoutFormat == FrameFormat_RGBA) ? 4 : (((that->_interleavedChroma) && (i > 0)) ? 2 : 1);
+        that->_planeSizes[i] = (i == 0) ? frameSize : chromaSize;
+        unsigned rowBytes = static_cast<unsigned>(that->_planeSizes[i].width() * bytesPerPixel);
+        that->_pitches[i] = (rowBytes + FRAME_PITCH_ALIGNMENT - 1) & ~(FRAME_PITCH_ALIGNMENT - 1);
+        that->_planeOffsets[i] = frameBytes;
+        pitches[i] = that->_pitches[i];
+        lines[i] = (i == 0) ? alignedLines : (alignedLines / 2);
+        frameBytes += static_cast<size_t>(pitches[i]) * lines[i];
+    }
+    that->_frameBytes = frameBytes;
+
+    // The pool only grows, so a restart or a smaller stream reuses the buffers
+    if(frameBytes > that->_bufferCapacity)
+    {
+        that->freeBuffers();
+        for(int i = 0; i < FRAME_POOL_SIZE; ++i)
+        {
+            that->_buffers[i] = static_cast<uchar*>(qMallocAligned(frameBytes, FRAME_PITCH_ALIGNMENT));
+            if(!that->_buffers[i])
+            {
+                qDebug() << "[VideoPlayerGLSoftware] ERROR: unable to allocate frame buffer of " << frameBytes << " bytes";
+                that->freeBuffers();
+                that->_width = 0;
+                that->_height = 0;
+                return 0;
+            }
+        }
+        that->_bufferCapacity = frameBytes;
+        ++that->_bufferAllocations;
+    }
+    that->_frames.reset();
+
+    *width = that->_width;
+    *height = that->_height;
+    locker.unlock();
+
+    if(that->_player)
+        that->_player->videoResized();
+
+    return FRAME_POOL_SIZE;
+}
+
+// This callback is called when VLC is done with the negotiated format, the pool is kept for reuse
+void VideoPlayerGLSoftware::formatCleanup(void* data)
+{
+    VideoPlayerGLSoftware* that = static_cast<VideoPlayerGLSoftware*>(data);
+    if(!that)
+        return;
+
+    qDebug() << "[VideoPlayerGLSoftware] Format cleanup callback";
+
+    QMutexLocker locker(&that->_poolLock);
+    that->_width = 0;
+    that->_height = 0;
+}
+
+// This callback is called by VLC to get the buffer for the next decoded frame
+void* VideoPlayerGLSoftware::lock(void* data, void** planes)
+{
+    VideoPlayerGLSoftware* that = static_cast<VideoPlayerGLSoftware*>(data);
+    if((!that) || (!planes))
+        return nullptr;
+
+    // The producer owns the write buffer, the render thread never touches it
+    uchar* buffer = that->_buffers[that->_frames.getWriteIndex()];
+    for(int i = 0; i < that->_planeCount; ++i)
+        planes[i] = buffer ? buffer + that->_planeOffsets[i] : nullptr;
+
+    return buffer;
+}
+
+// This callback is called once VLC has written the frame
+void VideoPlayerGLSoftware::unlock(void* data, void* picture, void* const* planes)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(picture);
+    Q_UNUSED(planes);
+}
+
+// This callback is called when the frame is due, hand it over to the render thread
+void VideoPlayerGLSoftware::display(void* data, void* picture)
+{
+    Q_UNUSED(picture);
+
+#ifdef VIDEO_DEBUG_MESSAGES
+    qDebug() << "[VideoPlayerGLSoftware] Displaying video frame";
+#endif
+
+    VideoPlayerGLSoftware* that = static_cast<VideoPlayerGLSoftware*>(data);
+    if((!that) || (!that->_player))
+        return;
+
+    // Every decoded frame goes into the loop cache, even the ones skipped for display
+    if(that->_captureCache)
+    {
+        that->_captureCache->recordMiss();
+        that->_captureCache->addFrame(that->_buffers[that->_frames.getWriteIndex()], that->_frameBytes,
+                                      QSize(static_cast<int>(that->_width), static_cast<int>(that->_height)), that->_frameClock.nsecsElapsed());
+    }
+
+    // Skip handing over frames when the display rate is reduced, VLC simply decodes over this one again.
+    // The frame has already been decoded and converted by now, only the upload and paint are saved.
+    int frameDivisor = that->_frameDivisor.loadAcquire();
+    if((frameDivisor > 1) && ((++that->_framesDecoded % static_cast<quint64>(frameDivisor)) != 0))
+        return;
+
+    that->_frameTimes[that->_frames.getWriteIndex()] = that->_frameClock.nsecsElapsed();
+    if(that->_frames.publish())
+        that->_framesDropped.fetchAndAddOrdered(1);
+
+    that->_player->registerNewFrame();
+}
+
+void VideoPlayerGLSoftware::freeBuffers()
+{
+    for(int i = 0; i < FRAME_POOL_SIZE; ++i)
+    {
+        qFreeAligned(_buffers[i]);
+        _buffers[i] = nullptr;
+    }
+    _bufferCapacity = 0;
+    _uploadedFrame = nullptr;
+}
+
+// (Re)create the display texture, and for planar frames the plane textures and conversion target
+bool VideoPlayerGLSoftware::createTextures(QOpenGLContext* context)
+{
+    QOpenGLFunctions* f = context->functions();
+    QSize frameSize(static_cast<int>(_width), static_cast<int>(_height));
+
+    qDebug() << "[VideoPlayerGLSoftware] Creating textures for " << frameSize << (_layoutFormat == FrameFormat_RGBA ? " RGBA" : (_interleavedChroma ? " NV12" : " I420")) << " frames";
+
+    if(_texture == 0)
+        f->glGenTextures(1, &_texture);
+
+    f->glBindTexture(GL_TEXTURE_2D, _texture);
+    f->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, frameSize.width(), frameSize.height(), 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    if(_layoutFormat == FrameFormat_Planar)
+    {
+        if(_planeTextures[0] == 0)
+            f->glGenTextures(FRAME_PLANE_COUNT, _planeTextures);
+
+        for(int i = 0; i < _planeCount; ++i)
+        {
+            bool interleaved = ((_interleavedChroma) && (i > 0));
+            f->glBindTexture(GL_TEXTURE_2D, _planeTextures[i]);
+            f->glTexImage2D(GL_TEXTURE_2D, 0, interleaved ? GL_RG8 : GL_R8, _planeSizes[i].width(), _planeSizes[i].height(), 0,
+                            interleaved ? GL_RG : GL_RED, GL_UNSIGNED_BYTE, nullptr);
+            f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        }
+
+        if(_convertFBO == 0)
+            f->glGenFramebuffers(1, &_convertFBO);
+
+        f->glBindFramebuffer(GL_FRAMEBUFFER, _convertFBO);
+        f->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, _texture, 0);
+        GLenum status = f->glCheckFramebufferStatus(GL_FRAMEBUFFER);
+        f->glBindFramebuffer(GL_FRAMEBUFFER, context->defaultFramebufferObject());
+        if(status != GL_FRAMEBUFFER_COMPLETE)
+        {
+            qDebug() << "[VideoPlayerGLSoftware] ERROR: conversion framebuffer incomplete: " << status;
+            return false;
+        }
+    }
+
+    _textureSize = frameSize;
+    _textureFormat = _layoutFormat;
+    return true;
+}
+
+// Convert the uploaded planes into the display texture. Program, texture and vertex array bindings
+// go through the state cache. Nothing is read back from GL, so the default framebuffer is bound
+// again afterwards and the caller sets its viewport and blending again.
+bool VideoPlayerGLSoftware::convertPlanes(QOpenGLContext* context, PublishGLStateCache* stateCache)
+{
+    QOpenGLFunctions* f = context->functions();
+
+    if(!_quad)
+    {
+        // Creating the quad binds its buffers directly
+        _quad = PublishGLUnitQuad::acquire(context);
+        stateCache->invalidate();
+    }
+
+    if(_convertProgram == 0)
+    {
+        PublishGLShaderManager* shaderManager = PublishGLShaderManager::getManager(context);
+        _convertProgram = shaderManager ? shaderManager->getProgram(QString("yuv"), YUV_VERTEX_SHADER, YUV_FRAGMENT_SHADER) : 0;
+        if(_convertProgram == 0)
+        {
+            qDebug() << "[VideoPlayerGLSoftware] ERROR: yuv shader program not available";
+            return false;
+        }
+
+        stateCache->useProgram(_convertProgram);
+        f->glUniform1i(f->glGetUniformLocation(_convertProgram, "planeY"), 0);
+        f->glUniform1i(f->glGetUniformLocation(_convertProgram, "planeU"), 1);
+        f->glUniform1i(f->glGetUniformLocation(_convertProgram, "planeV"), 2);
+        _matrixLocation = f->glGetUniformLocation(_convertProgram, "yuvMatrix");
+        _offsetLocation = f->glGetUniformLocation(_convertProgram, "yuvOffset");
+        _interleavedLocation = f->glGetUniformLocation(_convertProgram, "interleaved");
+    }
+
+    if((!_quad) || (_convertFBO == 0))
+        return false;
+
+    GLfloat matrix[9];
+    GLfloat offset[3];
+    getColorMatrix(matrix, offset);
+
+    f->glBindFramebuffer(GL_FRAMEBUFFER, _convertFBO);
+    f->glViewport(0, 0, _textureSize.width(), _textureSize.height());
+    f->glDisable(GL_BLEND);
+
+    stateCache->useProgram(_convertProgram);
+    f->glUniformMatrix3fv(_matrixLocation, 1, GL_FALSE, matrix);
+    f->glUniform3fv(_offsetLocation, 1, offset);
+    f->glUniform1i(_interleavedLocation, _interleavedChroma ? 1 : 0);
+    for(int i = 0; i < _planeCount; ++i)
+    {
+        stateCache->activeTexture(GL_TEXTURE0 + static_cast<GLenum>(i));
+        stateCache->bindTexture(GL_TEXTURE_2D, _planeTextures[i]);
+    }
+    stateCache->activeTexture(GL_TEXTURE0);
+
+    stateCache->bindVertexArray(_quad->getVAO());
+    _quad->draw(f);
+
+    f->glBindFramebuffer(GL_FRAMEBUFFER, context->defaultFramebufferObject());
+
+    return true;
+}
+
+// Column major YUV to RGB matrix and the offset to subtract first, for the selected colour space and range
+void VideoPlayerGLSoftware::getColorMatrix(GLfloat* matrix, GLfloat* offset) const
+{
+    GLfloat kr = 0.2126f;
+    GLfloat kb = 0.0722f;
+    if(_colorSpace == libvlc_video_colorspace_BT601)
+    {
+        kr = 0.299f;
+        kb = 0.114f;
+    }
+    else if(_colorSpace == libvlc_video_colorspace_BT2020)
+    {
+        kr = 0.2627f;
+        kb = 0.0593f;
+    }
+    GLfloat kg = 1.f - kr - kb;
+
+    // Video range puts luma in 16-235 and chroma in 16-240
+    GLfloat lumaScale = _fullRange ? 1.f : (255.f / 219.f);
+    GLfloat chromaScale = _fullRange ? 1.f : (255.f / 224.f);
+    offset[0] = _fullRange ? 0.f : (16.f / 255.f);
+    offset[1] = 128.f / 255.f;
+    offset[2] = 128.f / 255.f;
+
+    // Y column
+    matrix[0] = lumaScale;
+    matrix[1] = lumaScale;
+    matrix[2] = lumaScale;
+    // U column
+    matrix[3] = 0.f;
+    matrix[4] = -chromaScale * 2.f * kb * (1.f - kb) / kg;
+    matrix[5] = chromaScale * 2.f * (1.f - kb);
+    // V column
+    matrix[6] = chromaScale * 2.f * (1.f - kr);
+    matrix[7] = -chromaScale * 2.f * kr * (1.f - kr) / kg;
+    matrix[8] = 0.f;
+}
@@ -0,0 +1,159 @@
+#ifndef VIDEOPLAYERGLSOFTWARE_H
+#define VIDEOPLAYERGLSOFTWARE_H
+
+#include "dmh_vlc.h"
+#include "triplebuffer.h"
+#include <QMutex>
+#include <QSize>
+#include <QImage>
+#include <QElapsedTimer>
+#include <QAtomicInt>
+#include <qopengl.h>
+
+class VideoPlayerGL;
+class QOpenGLContext;
+class QOpenGLFunctions;
+class QOpenGLExtraFunctions;
+class PublishGLUnitQuad;
+class PublishGLShaderManager;
+class VideoPlayerGLLoopCache;
+class PublishGLStateCache;
+
+// Frame source for hosts without threaded OpenGL. VLC decodes into a pool of
+// aligned system memory buffers through the lock/unlock/display callbacks and
+// the render thread streams the newest frame into a texture through rotating
+// pixel unpack buffers. Planar frames are uploaded as they come from the
+// decoder and converted to RGBA by a shader pass.
+class VideoPlayerGLSoftware
+{
+public:
+    enum FrameFormat
+    {
+        FrameFormat_RGBA = 0,   // VLC converts to RGBA, 4 bytes per pixel
+        FrameFormat_Planar      // I420 or NV12 as decoded, 1.5 bytes per pixel, converted on the GPU
+    };
+
+    VideoPlayerGLSoftware(VideoPlayerGL* player);
+    ~VideoPlayerGLSoftware();
+
+    static void requestProgram(PublishGLShaderManager* shaderManager);
+
+    // Render thread side, needs the render context to be current. Bindings go
+    // through the state cache, the planar conversion pass leaves the default
+    // framebuffer bound with the viewport at the frame size and blending off.
+    bool isNewFrameAvailable();
+    GLuint uploadFrame(QOpenGLContext* context, PublishGLStateCache* stateCache = nullptr);
+    void cleanupGL(QOpenGLContext* context);
+    GLuint getTexture() const;
+    QImage getLastFrame();
+
+    // Takes effect with the next format callback
+    FrameFormat getFrameFormat() const;
+    void setFrameFormat(FrameFormat frameFormat);
+    libvlc_video_color_space_t getColorSpace() const;
+    void setColorSpace(libvlc_video_color_space_t colorSpace, bool fullRange);
+
+    // Loop cache, owned by the player. Only change the capture cache while VLC is not running.
+    void setLoopCache(VideoPlayerGLLoopCache* loopCache);
+    void startReplay(VideoPlayerGLLoopCache* loopCache);
+    void stopReplay();
+    bool isReplaying() const;
+    bool setReplayFrame(int index);
+
+    QSize getVideoSize() const;
+    QSize getSourceSize() const;
+    void setTargetSize(const QSize& targetSize);
+    int getFrameDivisor() const;
+    void setFrameDivisor(int frameDivisor);
+
+    quint64 getFramesAcquired() const;
+    quint64 getFramesDropped() const;
+    qint64 getLastPickupDelay() const;
+    quint64 getBufferAllocations() const;
+    qint64 getLastUploadTime() const;
+    qint64 getTotalUploadTime() const;
+    quint64 getUploadCount() const;
+    quint64 getBytesUploaded() const;
+
+    static unsigned format(void** data, char* chroma, unsigned* width, unsigned* height, unsigned* pitches, unsigned* lines);
+    static void formatCleanup(void* data);
+    static void* lock(void* data, void** planes);
+    static void unlock(void* data, void* picture, void* const* planes);
+    static void display(void* data, void* picture);
+
+private:
+    void freeBuffers();
+    void uploadPixels(QOpenGLContext* context, PublishGLStateCache* stateCache, const uchar* src);
+    GLuint uploadReplayFrame(QOpenGLContext* context, PublishGLStateCache* stateCache);
+    bool createTextures(QOpenGLContext* context);
+    bool convertPlanes(QOpenGLContext* context, PublishGLStateCache* stateCache);
+    void getColorMatrix(GLfloat* matrix, GLfloat* offset) const;
+
+    VideoPlayerGL *_player;
+
+    // Frame pool, only reallocated between format and cleanup callbacks
+    mutable QMutex _poolLock;
+    uchar* _buffers[3];
+    size_t _bufferCapacity;
+    TripleBuffer _frames;
+    qint64 _frameTimes[3];
+    unsigned _width;
+    unsigned _height;
+    quint64 _bufferAllocations;
+
+    // Frame layout, the planes are stored back to back in each pool buffer
+    FrameFormat _frameFormat;
+    FrameFormat _layoutFormat;
+    bool _interleavedChroma;
+    int _planeCount;
+    QSize _planeSizes[3];
+    unsigned _pitches[3];
+    size_t _planeOffsets[3];
+    size_t _frameBytes;
+    libvlc_video_color_space_t _colorSpace;
+    bool _fullRange;
+    bool _colorSpaceSet;
+
+    // Upload data
+    GLuint _texture;
+    QSize _textureSize;
+    FrameFormat _textureFormat;
+    GLuint _planeTextures[3];
+    GLuint _unpackBuffers[3];
+    int _unpackIndex;
+    quint64 _bytesUploaded;
+    const uchar* _uploadedFrame;
+
+    // Planar conversion pass
+    GLuint _convertFBO;
+    GLuint _convertProgram;
+    GLint _matrixLocation;
+    GLint _offsetLocation;
+    GLint _interleavedLocation;
+    PublishGLUnitQuad* _quad;
+
+    // Loop cache data
+    VideoPlayerGLLoopCache* _captureCache;
+    VideoPlayerGLLoopCache* _replayCache;
+    QAtomicInt _replayFrame;
+    int _replayUploaded;
+
+    // Render target sizing
+    QSize _sourceSize;
+    QSize _targetSize;
+
+    // Frame pacing data
+    QElapsedTimer _frameClock;
+    QAtomicInt _frameDivisor;
+    quint64 _framesDecoded;
+    QAtomicInt _framesDropped;
+    quint64 _framesAcquired;
+    qint64 _lastPickupDelay;
+
+    // Upload timing data
+    qint64 _lastUploadTime;
+    qint64 _totalUploadTime;
+    quint64 _uploadCount;
+};
+
+#endif // VIDEOPLAYERGLSOFTWARE_H
@@ -3,9 +3,11 @@
 #include <QOpenGLContext>
 #include <QOpenGLFramebufferObject>
 #include <QOffscreenSurface>
+#include <QElapsedTimer>
 #include <QDebug>
 
 //#define VIDEO_DEBUG_MESSAGES
+//#define VIDEO_FRAME_TIMING
 
 VideoPlayerGLVideo::VideoPlayerGLVideo(VideoPlayerGL* player) :
     _player(player),
@@ -14,12 +16,33 @@ VideoPlayerGLVideo::VideoPlayerGLVideo(VideoPlayerGL* player) :
     _videoReady(),
     _width(0),
     _height(0),
-    _textLock(),
     _buffers(),
-    _idxRender(0),
-    _idxSwap(1),
-    _idxDisplay(2),
-    _updated(false)
+    _frames(),
+    _fences(),
+    _textureAllocations(0),
+    _bufferLock(),
+    _displayBuffer(nullptr),
+    _retiredBuffers(),
+    _retiredFences(),
+    _resizeLock(),
+    _reportSizeChange(nullptr),
+    _reportOpaque(nullptr),
+    _sourceSize(),
+    _targetSize(),
+    _reportedSize(),
+    _renderAtTargetSize(false),
+    _scaleQuality(ScaleQuality_Smooth),
+    _renderScale(1.0),
+    _frameClock(),
+    _frameDivisor(1),
+    _framesRendered(0),
+    _framesDropped(0),
+    _framesAcquired(0),
+    _lastPickupDelay(0),
+    _lastFenceSyncTime(0),
+    _totalFenceSyncTime(0),
+    _fenceSyncCount(0),
+    _fenceStallCount(0)
 {
     qDebug() << "[VideoPlayerGLVideo] Creating VideoPlayerGLVideo";
 
@@ -27,6 +50,15 @@ VideoPlayerGLVideo::VideoPlayerGLVideo(VideoPlayerGL* player) :
     _buffers[1] = nullptr;
     _buffers[2] = nullptr;
 
+    _fences[0] = nullptr;
+    _fences[1] = nullptr;
+    _fences[2] = nullptr;
+
+    _frameTimes[0] = 0;
+    _frameTimes[1] = 0;
+    _frameTimes[2] = 0;
+    _frameClock.start();
+
     // Use default format for context
     _context = new QOpenGLContext(player);
 
@@ -39,6 +71,10 @@ VideoPlayerGLVideo::VideoPlayerGLVideo(VideoPlayerGL* player) :
         if((!_player) || (!_surface) || (!_context))
             return;
 
+        // Already set up, e.g. when the target window was only resized
+        if(_context->isValid())
+            return;
+
         // Video view is now ready, we can start
         _surface->setFormat(_player->getFormat());
         _surface->create();
@@ -57,36 +93,210 @@ VideoPlayerGLVideo::~VideoPlayerGLVideo()
     qDebug() << "[VideoPlayerGLVideo] Destroying VideoPlayerGLVideo";
 
     cleanup(this);
+
+    QMutexLocker locker(&_bufferLock);
+    _displayBuffer = nullptr;
+    deleteRetired();
 }
 
 // Is there a new texture to be displayed
 bool VideoPlayerGLVideo::isNewFrameAvailable()
 {
-    return _updated;
+    return _frames.isFresh();
 }
 
-// Return the texture to be displayed
-QOpenGLFramebufferObject *VideoPlayerGLVideo::getVideoFrame()
+// Take the newest rendered frame for display, returns false if there was none.
+// Needs the consuming context to be current for the fence wait.
+bool VideoPlayerGLVideo::acquireFrame()
 {
 #ifdef VIDEO_DEBUG_MESSAGES
     qDebug() << "[VideoPlayerGLVideo] Video frame requested";
 #endif
 
-    QMutexLocker locker(&_textLock);
+    QMutexLocker locker(&_bufferLock);
+    if(!_frames.acquire())
+        return false;
 
-    if(_updated)
-    {
-        std::swap(_idxSwap, _idxDisplay);
-        _updated = false;
-    }
-    return _buffers[_idxDisplay];
+    waitForFrame(_frames.getReadIndex());
+    _displayBuffer = _buffers[_frames.getReadIndex()];
+    deleteRetired();
+    _lastPickupDelay = _frameClock.nsecsElapsed() - _frameTimes[_frames.getReadIndex()];
+    ++_framesAcquired;
+    return true;
+}
+
+// Return the frame taken by the last acquireFrame
+QOpenGLFramebufferObject *VideoPlayerGLVideo::getVideoFrame()
+{
+    return _displayBuffer;
 }
 
 QSize VideoPlayerGLVideo::getVideoSize() const
 {
+    QMutexLocker locker(&_resizeLock);
     return QSize(static_cast<int>(_width), static_cast<int>(_height));
 }
 
+// Number of color textures allocated for the render buffers so far
+quint64 VideoPlayerGLVideo::getTextureAllocations() const
+{
+    return _textureAllocations;
+}
+
+// CPU time in nanoseconds to check the most recent frame fence and queue the GPU wait.
+// This does not include the time the GPU itself spends waiting.
+qint64 VideoPlayerGLVideo::getLastFenceSyncTime() const
+{
+    return _lastFenceSyncTime;
+}
+
+qint64 VideoPlayerGLVideo::getTotalFenceSyncTime() const
+{
+    return _totalFenceSyncTime;
+}
+
+quint64 VideoPlayerGLVideo::getFenceSyncCount() const
+{
+    return _fenceSyncCount;
+}
+
+// Number of frames picked up before VLC's rendering of them had finished on the GPU
+quint64 VideoPlayerGLVideo::getFenceStallCount() const
+{
+    return _fenceStallCount;
+}
+
+// Size of the decoded video, independent of the size VLC renders at
+QSize VideoPlayerGLVideo::getSourceSize() const
+{
+    QMutexLocker locker(&_resizeLock);
+    return _sourceSize;
+}
+
+void VideoPlayerGLVideo::setTargetSize(const QSize& targetSize)
+{
+    QMutexLocker locker(&_resizeLock);
+    if(_targetSize == targetSize)
+        return;
+
+    _targetSize = targetSize;
+    locker.unlock();
+
+    updateRenderSize();
+}
+
+bool VideoPlayerGLVideo::isRenderAtTargetSize() const
+{
+    QMutexLocker locker(&_resizeLock);
+    return _renderAtTargetSize;
+}
+
+void VideoPlayerGLVideo::setRenderAtTargetSize(bool renderAtTargetSize)
+{
+    QMutexLocker locker(&_resizeLock);
+    if(_renderAtTargetSize == renderAtTargetSize)
+        return;
+
+    _renderAtTargetSize = renderAtTargetSize;
+    locker.unlock();
+
+    updateRenderSize();
+}
+
+VideoPlayerGLVideo::ScaleQuality VideoPlayerGLVideo::getScaleQuality() const
+{
+    QMutexLocker locker(&_resizeLock);
+    return _scaleQuality;
+}
+
+void VideoPlayerGLVideo::setScaleQuality(ScaleQuality quality)
+{
+    QMutexLocker locker(&_resizeLock);
+    if(_scaleQuality == quality)
+        return;
+
+    _scaleQuality = quality;
+    locker.unlock();
+
+    updateRenderSize();
+}
+
+// FBO memory saved by rendering below the source resolution, in bytes
+qint64 VideoPlayerGLVideo::getRenderMemorySaved() const
+{
+    QMutexLocker locker(&_resizeLock);
+    if((_sourceSize.isEmpty()) || (_width == 0) || (_height == 0))
+        return 0;
+
+    qint64 sourceBytes = static_cast<qint64>(_sourceSize.width()) * static_cast<qint64>(_sourceSize.height()) * 4 * 3;
+    qint64 renderBytes = static_cast<qint64>(_width) * static_cast<qint64>(_height) * 4 * 3;
+    return sourceBytes - renderBytes;
+}
+
+// Additional scale applied on top of the render size, e.g. by the quality governor
+qreal VideoPlayerGLVideo::getRenderScale() const
+{
+    QMutexLocker locker(&_resizeLock);
+    return _renderScale;
+}
+
+void VideoPlayerGLVideo::setRenderScale(qreal renderScale)
+{
+    QMutexLocker locker(&_resizeLock);
+    if(qFuzzyCompare(_renderScale, renderScale))
+        return;
+
+    _renderScale = renderScale;
+    locker.unlock();
+
+    updateRenderSize();
+}
+
+// Only every n-th rendered frame is handed over for display. VLC still decodes
+// and renders every frame, so this only saves the presentation work: fence,
+// pickup, paint and everything drawn on top of the video.
+int VideoPlayerGLVideo::getFrameDivisor() const
+{
+    return _frameDivisor.loadAcquire();
+}
+
+void VideoPlayerGLVideo::setFrameDivisor(int frameDivisor)
+{
+    _frameDivisor.storeRelease(qMax(frameDivisor, 1));
+}
+
+quint64 VideoPlayerGLVideo::getFramesAcquired() const
+{
+    return _framesAcquired;
+}
+
+// Frames that were overwritten before the display could pick them up
+quint64 VideoPlayerGLVideo::getFramesDropped() const
+{
+    return static_cast<quint64>(_framesDropped.loadAcquire());
+}
+
+// Time from VLC's swap of a frame to its pickup for display, in nanoseconds
+qint64 VideoPlayerGLVideo::getLastPickupDelay() const
+{
+    return _lastPickupDelay;
+}
+
+// This callback hands over the function used to tell VLC the size of the output window
+void VideoPlayerGLVideo::setResizeCallback(void* data,
+                                           void (*report_size_change)(void *report_opaque, unsigned width, unsigned height),
+                                           void* report_opaque)
+{
+    VideoPlayerGLVideo* that = static_cast<VideoPlayerGLVideo*>(data);
+    if(!that)
+        return;
+
+    QMutexLocker locker(&that->_resizeLock);
+    that->_reportSizeChange = report_size_change;
+    that->_reportOpaque = report_opaque;
+    that->_reportedSize = QSize();
+}
+
 // This callback will create the surfaces and FBO used by VLC to perform its rendering
 bool VideoPlayerGLVideo::resizeRenderTextures(void* data,
                                               const libvlc_video_render_cfg_t *cfg,
@@ -99,20 +309,50 @@ bool VideoPlayerGLVideo::resizeRenderTextures(void* data,
 
     qDebug() << "[VideoPlayerGLVideo] Resizing render textures to: " << cfg->width << " x " << cfg->height;
 
+    // Until a size has been reported, VLC asks for the source size of the video
+    QMutexLocker resizeLocker(&that->_resizeLock);
+    if(!that->_reportedSize.isValid())
+        that->_sourceSize = QSize(static_cast<int>(cfg->width), static_cast<int>(cfg->height));
+    ScaleQuality quality = that->_scaleQuality;
+    resizeLocker.unlock();
+
     if((cfg->width != that->_width) || (cfg->height != that->_height))
         cleanup(data);
 
+    QMutexLocker bufferLocker(&that->_bufferLock);
     if(!that->_buffers[0])
     {
         that->_buffers[0] = new QOpenGLFramebufferObject(cfg->width, cfg->height);
         that->_buffers[1] = new QOpenGLFramebufferObject(cfg->width, cfg->height);
         that->_buffers[2] = new QOpenGLFramebufferObject(cfg->width, cfg->height);
+        that->_textureAllocations += 3;
+        that->_frames.reset();
 
+        // The VLC thread is the only writer, the lock is for readers on other threads
+        resizeLocker.relock();
         that->_width = cfg->width;
         that->_height = cfg->height;
+        resizeLocker.unlock();
+
+        qDebug() << "[VideoPlayerGLVideo] Render target memory saved compared to the source size: " << (that->getRenderMemorySaved() / 1024) << " KB";
+    }
+
+    // Apply the sampling filter for the selected downscale quality
+    QOpenGLFunctions* f = that->_context ? that->_context->functions() : nullptr;
+    if(f)
+    {
+        GLint filter = (quality == ScaleQuality_Fast) ? GL_NEAREST : GL_LINEAR;
+        for(int i = 0; i < 3; ++i)
+        {
+            f->glBindTexture(GL_TEXTURE_2D, that->_buffers[i]->texture());
+            f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+            f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+        }
+        f->glBindTexture(GL_TEXTURE_2D, 0);
     }
 
-    that->_buffers[that->_idxRender]->bind();
+    that->_buffers[that->_frames.getWriteIndex()]->bind();
+    bufferLocker.unlock();
 
     render_cfg->opengl_format = GL_RGBA;
     render_cfg->full_range = true;
@@ -121,8 +361,13 @@ bool VideoPlayerGLVideo::resizeRenderTextures(void* data,
     render_cfg->transfer   = libvlc_video_transfer_func_SRGB;
 
     if(that->_player)
+    {
         that->_player->videoResized();
 
+        // Reporting a new size from inside a VLC callback could deadlock, so do it from the player thread
+        QMetaObject::invokeMethod(that->_player, [that]() { that->updateRenderSize(); }, Qt::QueuedConnection);
+    }
+
     return true;
 }
 
@@ -144,13 +389,18 @@ bool VideoPlayerGLVideo::setup(void** data,
     // Wait for rendering view to be ready
     that->_videoReady.acquire();
 
+    QMutexLocker locker(&that->_resizeLock);
     that->_width = 0;
     that->_height = 0;
+    that->_sourceSize = QSize();
+    that->_reportedSize = QSize();
+
     return true;
 }
 
 
-// This callback is called to release the texture and FBO created in resize
+// This callback is called to release the texture and FBO created in resize.
+// The consumer deletes them once it no longer displays their last frame.
 void VideoPlayerGLVideo::cleanup(void* data)
 {
     VideoPlayerGLVideo* that = static_cast<VideoPlayerGLVideo*>(data);
@@ -164,9 +414,8 @@ void VideoPlayerGLVideo::cleanup(void* data)
     if((that->_width == 0) && (that->_height == 0))
         return;
 
-    delete that->_buffers[0]; that->_buffers[0] = nullptr;
-    delete that->_buffers[1]; that->_buffers[1] = nullptr;
-    delete that->_buffers[2]; that->_buffers[2] = nullptr;
+    QMutexLocker locker(&that->_bufferLock);
+    that->retireBuffers();
 }
 
 //This callback is called after VLC performs drawing calls
@@ -180,11 +429,32 @@ void VideoPlayerGLVideo::swap(void* data)
     if((!that) || (!that->_player))
         return;
 
-    QMutexLocker locker(&that->_textLock);
-    std::swap(that->_idxSwap, that->_idxRender);
-    that->_buffers[that->_idxRender]->bind();
-    that->_updated = true;
-    locker.unlock();
+    // Skip handing over frames when the display rate is reduced, VLC simply renders over this one again.
+    // The frame has already been decoded and rendered by now, only the presentation is saved.
+    int frameDivisor = that->_frameDivisor.loadAcquire();
+    if((frameDivisor > 1) && ((++that->_framesRendered % static_cast<quint64>(frameDivisor)) != 0))
+    {
+        that->_buffers[that->_frames.getWriteIndex()]->bind();
+        return;
+    }
+
+    // Fence the finished frame so the consuming context can wait for it on the GPU
+    QOpenGLExtraFunctions* e = that->_context ? that->_context->extraFunctions() : nullptr;
+    if(e)
+    {
+        int index = that->_frames.getWriteIndex();
+        if(that->_fences[index])
+            e->glDeleteSync(that->_fences[index]);
+        that->_fences[index] = e->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+        // The fence must reach the GPU before another context can wait on it
+        e->glFlush();
+    }
+
+    that->_frameTimes[that->_frames.getWriteIndex()] = that->_frameClock.nsecsElapsed();
+    if(that->_frames.publish())
+        that->_framesDropped.fetchAndAddOrdered(1);
+    that->_buffers[that->_frames.getWriteIndex()]->bind();
 
     that->_player->registerNewFrame();
 }
@@ -227,3 +497,119 @@ void* VideoPlayerGLVideo::getProcAddress(void* data, const char* current)
      * thread local state to call the correct variant. */
     return reinterpret_cast<void*>(that->_context->getProcAddress(current));
 }
+
+// Make the current (consumer) context wait on the GPU for the producer to finish the given frame
+void VideoPlayerGLVideo::waitForFrame(int index)
+{
+    if(!_fences[index])
+        return;
+
+    QOpenGLContext* currentContext = QOpenGLContext::currentContext();
+    QOpenGLExtraFunctions* e = currentContext ? currentContext->extraFunctions() : nullptr;
+    if(!e)
+        return;
+
+    QElapsedTimer syncTimer;
+    syncTimer.start();
+
+    // Only queue a server-side wait if the frame is still in flight. glWaitSync
+    // returns immediately, so the timer only covers the CPU cost of the sync.
+    GLenum status = e->glClientWaitSync(_fences[index], 0, 0);
+    if((status != GL_ALREADY_SIGNALED) && (status != GL_CONDITION_SATISFIED))
+    {
+        e->glWaitSync(_fences[index], 0, GL_TIMEOUT_IGNORED);
+        ++_fenceStallCount;
+    }
+
+    e->glDeleteSync(_fences[index]);
+    _fences[index] = nullptr;
+
+    _lastFenceSyncTime = syncTimer.nsecsElapsed();
+    _totalFenceSyncTime += _lastFenceSyncTime;
+    ++_fenceSyncCount;
+
+#ifdef VIDEO_FRAME_TIMING
+    qDebug() << "[VideoPlayerGLVideo] Fence sync for frame " << index << ": " << _lastFenceSyncTime << " ns, still rendering: " << (status == GL_TIMEOUT_EXPIRED) << ", average: " << (_totalFenceSyncTime / static_cast<qint64>(_fenceSyncCount)) << " ns";
+#endif
+}
+
+// Hand the render targets and their fences over for deletion by the consumer, the caller holds the buffer lock
+void VideoPlayerGLVideo::retireBuffers()
+{
+    for(int i = 0; i < 3; ++i)
+    {
+        if(_buffers[i])
+            _retiredBuffers.append(_buffers[i]);
+        if(_fences[i])
+            _retiredFences.append(_fences[i]);
+        _buffers[i] = nullptr;
+        _fences[i] = nullptr;
+    }
+
+    _frames.reset();
+}
+
+// Delete the retired render targets and fences once the display buffer is no longer one of them.
+// Requires a context of the share group to be current, the caller holds the buffer lock.
+void VideoPlayerGLVideo::deleteRetired()
+{
+    if(_retiredBuffers.contains(_displayBuffer))
+        return;
+
+    QOpenGLContext* currentContext = QOpenGLContext::currentContext();
+    QOpenGLExtraFunctions* e = currentContext ? currentContext->extraFunctions() : nullptr;
+    for(GLsync fence : qAsConst(_retiredFences))
+    {
+        if(e)
+            e->glDeleteSync(fence);
+    }
+    _retiredFences.clear();
+
+    qDeleteAll(_retiredBuffers);
+    _retiredBuffers.clear();
+}
+
+// The size the render targets should have for the current mode
+QSize VideoPlayerGLVideo::getRenderSize() const
+{
+    if(_sourceSize.isEmpty())
+        return _sourceSize;
+
+    QSize renderSize = _sourceSize;
+    if((_renderAtTargetSize) && (!_targetSize.isEmpty()))
+    {
+        renderSize = (_scaleQuality == ScaleQuality_Supersampled) ? _targetSize * 2 : _targetSize;
+        renderSize = _sourceSize.scaled(renderSize, Qt::KeepAspectRatio);
+
+        // Never render above the source resolution
+        if((renderSize.width() > _sourceSize.width()) || (renderSize.height() > _sourceSize.height()))
+            renderSize = _sourceSize;
+    }
+
+    if(_renderScale < 1.0)
+        renderSize = (renderSize * _renderScale).expandedTo(QSize(1, 1));
+
+    return renderSize;
+}
+
+// Tell VLC about the desired render size, it will call resizeRenderTextures in response
+void VideoPlayerGLVideo::updateRenderSize()
+{
+    QMutexLocker locker(&_resizeLock);
+    if(!_reportSizeChange)
+        return;
+
+    QSize renderSize = getRenderSize();
+    if((renderSize.isEmpty()) || (renderSize == _reportedSize))
+        return;
+
+    qDebug() << "[VideoPlayerGLVideo] Requesting render size: " << renderSize << " for source size " << _sourceSize << " and target size " << _targetSize;
+
+    _reportedSize = renderSize;
+    void (*reportSizeChange)(void *report_opaque, unsigned width, unsigned height) = _reportSizeChange;
+    void* reportOpaque = _reportOpaque;
+    locker.unlock();
+
+    // VLC may call resizeRenderTextures from inside the report, which takes the lock again
+    reportSizeChange(reportOpaque, static_cast<unsigned>(renderSize.width()), static_cast<unsigned>(renderSize.height()));
+}
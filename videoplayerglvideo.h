@@ -2,9 +2,14 @@
 #define VIDEOPLAYERGLVIDEO_H
 
 #include "dmh_vlc.h"
+#include "triplebuffer.h"
 #include <QSemaphore>
 #include <QMutex>
 #include <QSize>
+#include <QOpenGLExtraFunctions>
+#include <QElapsedTimer>
+#include <QAtomicInt>
+#include <QList>
 
 class VideoPlayerGL;
 class QOpenGLContext;
@@ -14,13 +19,45 @@ class QOffscreenSurface;
 class VideoPlayerGLVideo
 {
 public:
+    enum ScaleQuality
+    {
+        ScaleQuality_Fast = 0,      // Render at the target size, nearest sampling
+        ScaleQuality_Smooth,        // Render at the target size, linear sampling
+        ScaleQuality_Supersampled   // Render at twice the target size (up to the source size), linear sampling
+    };
+
     VideoPlayerGLVideo(VideoPlayerGL* player);
     ~VideoPlayerGLVideo();
 
     bool isNewFrameAvailable();
+    bool acquireFrame();
     QOpenGLFramebufferObject *getVideoFrame();
     QSize getVideoSize() const;
+    quint64 getTextureAllocations() const;
+    qint64 getLastFenceSyncTime() const;
+    qint64 getTotalFenceSyncTime() const;
+    quint64 getFenceSyncCount() const;
+    quint64 getFenceStallCount() const;
+
+    QSize getSourceSize() const;
+    void setTargetSize(const QSize& targetSize);
+    bool isRenderAtTargetSize() const;
+    void setRenderAtTargetSize(bool renderAtTargetSize);
+    ScaleQuality getScaleQuality() const;
+    void setScaleQuality(ScaleQuality quality);
+    qint64 getRenderMemorySaved() const;
+    qreal getRenderScale() const;
+    void setRenderScale(qreal renderScale);
+    int getFrameDivisor() const;
+    void setFrameDivisor(int frameDivisor);
 
+    quint64 getFramesAcquired() const;
+    quint64 getFramesDropped() const;
+    qint64 getLastPickupDelay() const;
+
+    static void setResizeCallback(void* data,
+                                  void (*report_size_change)(void *report_opaque, unsigned width, unsigned height),
+                                  void* report_opaque);
     static bool resizeRenderTextures(void* data, const libvlc_video_render_cfg_t *cfg,
                                      libvlc_video_output_cfg_t *render_cfg);
     static bool setup(void** data, const libvlc_video_setup_device_cfg_t *cfg,
@@ -31,6 +68,12 @@ public:
     static void* getProcAddress(void* data, const char* current);
 
 private:
+    void waitForFrame(int index);
+    void retireBuffers();
+    void deleteRetired();
+    QSize getRenderSize() const;
+    void updateRenderSize();
+
     VideoPlayerGL *_player;
     QOpenGLContext *_context;
     QOffscreenSurface *_surface;
@@ -39,12 +82,43 @@ private:
     //FBO data
     unsigned _width = 0;
     unsigned _height = 0;
-    QMutex _textLock;
     QOpenGLFramebufferObject *_buffers[3];
-    size_t _idxRender = 0;
-    size_t _idxSwap = 1;
-    size_t _idxDisplay = 2;
-    bool _updated = false;
+    TripleBuffer _frames;
+    GLsync _fences[3];
+    qint64 _frameTimes[3];
+    quint64 _textureAllocations = 0;
+
+    // The consumer may still draw from render targets VLC replaces on its own thread,
+    // so replaced targets and fences are only deleted once the consumer has moved on
+    QMutex _bufferLock;
+    QOpenGLFramebufferObject *_displayBuffer = nullptr;
+    QList<QOpenGLFramebufferObject*> _retiredBuffers;
+    QList<GLsync> _retiredFences;
+
+    // Render target sizing
+    mutable QMutex _resizeLock;
+    void (*_reportSizeChange)(void *report_opaque, unsigned width, unsigned height) = nullptr;
+    void* _reportOpaque = nullptr;
+    QSize _sourceSize;
+    QSize _targetSize;
+    QSize _reportedSize;
+    bool _renderAtTargetSize = false;
+    ScaleQuality _scaleQuality = ScaleQuality_Smooth;
+    qreal _renderScale = 1.0;
+
+    // Frame pacing data
+    QElapsedTimer _frameClock;
+    QAtomicInt _frameDivisor;
+    quint64 _framesRendered = 0;
+    QAtomicInt _framesDropped;
+    quint64 _framesAcquired = 0;
+    qint64 _lastPickupDelay = 0;
+
+    // Fence data, the times are CPU side only since the GPU wait is queued, not waited for
+    qint64 _lastFenceSyncTime = 0;
+    qint64 _totalFenceSyncTime = 0;
+    quint64 _fenceSyncCount = 0;
+    quint64 _fenceStallCount = 0;
 };
 
 #endif // VIDEOPLAYERGLVIDEO_H